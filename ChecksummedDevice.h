@@ -0,0 +1,385 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <string>
+#include "Crc32c.h"
+#include "PerThread.h"
+#include "FilePageDevice.h"
+
+using namespace std;
+/*
+	Контрольные суммы страниц поверх любого устройства: при сохранении страницы её CRC32C
+	запоминается отдельно от данных, при загрузке - сверяется. Несовпадение (порванная запись,
+	порча хранилища) превращает загрузку в отказ: GetData вернёт NULL, LastError() -
+	CacheLoadFailed, ChecksumErrors() вырастет.
+
+		ChecksummedDevice< StaticPageDevice<16,16,8,LRUCache> >	SPD;
+
+	Суммы хранятся в памяти, по 12 байт на страницу; страницы, которые ещё ни разу не
+	сохранялись, не проверяются. У файловых устройств Open открывает рядом с файлом страниц
+	файл сумм Path + ".crc" (Create - как у файла страниц): суммы читаются из него при открытии,
+	порванная запись страницы обнаружится и после аварии и переоткрытия. Файл сумм с чужой
+	геометрией или оставшийся от удалённого файла страниц (новый файл пуст) отбрасывается.
+
+		ChecksummedDevice< FilePageDevice<16,64,14,Cache> >	FPD;
+		FPD.Open( "pages.bin" );		// и pages.bin.crc
+
+	Запись суммы уходит в файл сумм до записи данных страницы и держит обе версии - новую
+	и предыдущую, так же и в памяти; только после удачной записи данных (в пакете - после
+	удачного EndBatch) в памяти остаётся одна новая. Неудачная запись оставляет обе: что бы
+	ни осталось в хранилище, ложной ошибки не будет. Flush доводит данные до диска
+	и переписывает записи уже без предыдущих (с fdatasync файла сумм). После аварии страница, записанная после последнего Flush,
+	принимается с любой из двух версий, а впервые сохранённая - с любым содержимым (прежнее
+	суммы не имело); первая загрузка показывает, какая версия на диске, дальше проверяется она.
+	Порядок, в котором запись суммы и данные доходят до диска при отключении питания, решает ОС.
+
+	Частичное сохранение (SaveExtents) пересчитывает сумму всей страницы - в пуле она целиком
+	актуальна. Страницы, отданные без копирования (PassThroughCache), и страницы из сжатого
+	второго уровня мимо Load не проходят и не проверяются. В пакете (BeginBatch/EndBatch)
+	асинхронное устройство дочитывает страницы только в EndBatch - там они и проверяются,
+	отказ проверки проваливает пакет.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						ChecksummedDevice
+///////////////////////////////////////////////////////////////////////////////
+
+template< class _Device >
+class ChecksummedDevice : public _Device
+{
+public:
+	typedef typename _Device::DataType DataType;
+
+	ChecksummedDevice(): Sums(_Device::__PageCount), Changed(_Device::__PageCount, 0), SumFile(FileIO::Invalid())
+	{
+		Verify = true;
+		Errors.store( 0 );
+	}
+
+	virtual ~ChecksummedDevice()
+	{
+		// сливаем кэш, пока Save с подсчётом сумм ещё доступен, суммы - следом
+		this->Close();
+		if( SumFile != FileIO::Invalid() ) FileIO::Close( SumFile );
+	}
+
+	// открывает файл страниц устройства и файл его сумм Path + ".crc"
+	bool	Open( const char* Path, bool Create = true )
+	{
+		bool Fresh;
+		if( !Probe( Path, Fresh ) && !Create ) return _Device::Open( Path, Create );
+		return OpenSums( Path, Create, Fresh ) && (_Device::Open( Path, Create ) || CloseSums());
+	}
+
+	bool	Open( const char* Path, bool Create, bool Direct )
+	{
+		bool Fresh;
+		if( !Probe( Path, Fresh ) && !Create ) return _Device::Open( Path, Create, Direct );
+		return OpenSums( Path, Create, Fresh ) && (_Device::Open( Path, Create, Direct ) || CloseSums());
+	}
+
+	// сбрасывает кэш, затем суммы сохранённых страниц - в них остаются только новые версии
+	virtual bool	Flush()
+	{
+		return _Device::Flush() && SaveSums();
+	}
+
+	// включает и выключает проверку при загрузке, суммы считаются всегда
+	void	SetVerify( bool On )
+	{
+		Verify = On;
+	}
+
+	unsigned long long	ChecksumErrors() const
+	{
+		return Errors.load();
+	}
+
+protected:
+	// серии и участки устройство может делать и через Load/Save, и своим путём:
+	// Nested не даёт посчитать сумму дважды; сумма записывается до данных
+	virtual bool  Load( unsigned Index, DataType& Ref )
+	{
+		return _Device::Load( Index, Ref ) && (Nested() || Check( Index, Ref ));
+	}
+
+	virtual bool  Save( unsigned Index, DataType& Ref )
+	{
+		DataType* One = &Ref;
+		unsigned New;
+		if( Nested() ) return _Device::Save( Index, Ref );
+		if( !Remember( Index, 1, &One, &New ) || !_Device::Save( Index, Ref ) ) return false;
+		Settle( Index, 1, &New );
+		return true;
+	}
+
+	virtual bool  LoadRange( unsigned Index, unsigned Count, DataType** Refs )
+	{
+		ThreadState& State = Threads::Enter( this );
+		State.Nested++;
+		bool Result = _Device::LoadRange( Index, Count, Refs );
+		State.Nested--;
+		if( Result && State.Batch > 0 )
+		{
+			for( unsigned i = 0; i < Count; i++ ) State.Deferred.push_back( make_pair( Index + i, Refs[i] ) );
+			return true;
+		}
+		Threads::Leave( this );
+		for( unsigned i = 0; Result && i < Count; i++ ) Result = Check( Index + i, *Refs[i] );
+		return Result;
+	}
+
+	virtual bool  SaveRange( unsigned Index, unsigned Count, DataType** Refs )
+	{
+		vector< unsigned > New( Count > 0 ? Count : 1 );
+		if( !Remember( Index, Count, Refs, &New[0] ) ) return false;
+		ThreadState& State = Threads::Enter( this );
+		State.Nested++;
+		bool Result = _Device::SaveRange( Index, Count, Refs );
+		State.Nested--;
+		if( Result ) Settle( Index, Count, &New[0] );
+		Threads::Leave( this );
+		return Result;
+	}
+
+	virtual bool  SaveExtents( unsigned Index, DataType& Ref, const PageExtent* Extents, unsigned Count )
+	{
+		DataType* One = &Ref;
+		unsigned New;
+		if( !Remember( Index, 1, &One, &New ) ) return false;
+		ThreadState& State = Threads::Enter( this );
+		State.Nested++;
+		bool Result = _Device::SaveExtents( Index, Ref, Extents, Count );
+		State.Nested--;
+		if( Result ) Settle( Index, 1, &New );
+		Threads::Leave( this );
+		return Result;
+	}
+
+	virtual void  BeginBatch()
+	{
+		_Device::BeginBatch();
+		Threads::Enter( this ).Batch++;
+	}
+
+	// страницы, прочитанные в пакете, готовы только теперь, записанные - тоже
+	virtual bool  EndBatch()
+	{
+		ThreadState& State = Threads::Enter( this );
+		State.Batch--;
+		bool Result = _Device::EndBatch();
+		for( size_t i = 0; i < State.Deferred.size(); i++ )
+			if( !Check( State.Deferred[i].first, *State.Deferred[i].second ) ) Result = false;
+		if( Result )
+		{
+			lock_guard< mutex > Guard( SumLock );
+			for( size_t i = 0; i < State.Unsettled.size(); i++ ) Known( State.Unsettled[i].first, State.Unsettled[i].second );
+		}
+		State.Deferred.clear();
+		State.Unsettled.clear();
+		Threads::Leave( this );
+		return Result;
+	}
+
+private:
+	// запись файла сумм, страница Index - по смещению (Index + 1) * 12, в начале файла - SumHeader
+	struct SumRecord
+	{
+		unsigned	Sum;	// CRC32C последней сохранённой версии страницы
+		unsigned	Prev;	// при PendingMark - CRC32C предыдущей версии
+		unsigned	Mark;	// что известно о суммах страницы; дыра в файле - нули, страница не сохранялась
+	};
+	static const unsigned KnownMark = 0x43524331;	// годится только Sum
+	static const unsigned PendingMark = 0x43524332;	// в файле: запись после Flush, годится Sum или Prev
+	static const unsigned FirstMark = 0x43524333;	// в файле: прежняя версия без суммы, годится любое содержимое
+
+	// заголовок файла сумм: с другой геометрией устройства файл сумм чужой
+	struct SumHeader
+	{
+		unsigned	Magic;
+		unsigned	PageBytes;
+		unsigned	Pages;
+	};
+	static const unsigned SumMagic = 0x53435243;
+
+	vector< SumRecord >	Sums;
+	vector< unsigned char >	Changed;	// в файле сумм запись ещё с предыдущей версией, Flush её перепишет
+	FileIO::Handle		SumFile;
+	mutex				SumLock;	// записи Sums, Changed и файл сумм
+	bool				Verify;
+	atomic< unsigned long long >	Errors;
+
+	// что делает с устройством поток: у каждого устройства своё
+	struct ThreadState
+	{
+		unsigned	Nested;	// глубина вызовов LoadRange/SaveRange/SaveExtents
+		unsigned	Batch;	// внутри BeginBatch/EndBatch
+		vector< pair< unsigned, DataType* > >	Deferred;	// загрузки пакета, ждущие проверки
+		vector< pair< unsigned, unsigned > >	Unsettled;	// записи пакета и их новые суммы
+
+		ThreadState(): Nested(0), Batch(0) {}
+
+		bool	Idle() const
+		{
+			return Nested == 0 && Batch == 0 && Deferred.empty() && Unsettled.empty();
+		}
+	};
+	typedef PerThread< ThreadState > Threads;
+
+	bool	Nested() const
+	{
+		ThreadState* State = Threads::Find( this );
+		return State && State->Nested > 0;
+	}
+
+	// пересчитывает суммы страниц [Index, Index + Count) перед их записью, New - новые суммы
+	// для Settle. И в памяти, и в файле сумм до записи данных запись держит обе версии:
+	// дойдёт ли запись до хранилища, станет известно только после неё
+	bool	Remember( unsigned Index, unsigned Count, DataType** Refs, unsigned* New )
+	{
+		if( Index >= Sums.size() ) return true;
+		if( Count > Sums.size() - Index ) Count = (unsigned)(Sums.size() - Index);
+		SumRecord Single;
+		vector< SumRecord > Many( Count > 1 ? Count : 0 );
+		SumRecord* Out = Count > 1 ? &Many[0] : &Single;
+		for( unsigned i = 0; i < Count; i++ ) New[i] = Out[i].Sum = Crc32c( Refs[i], sizeof(DataType) );
+
+		lock_guard< mutex > Guard( SumLock );
+		bool Updated = false;
+		for( unsigned i = 0; i < Count; i++ )
+		{
+			SumRecord& Record = Sums[Index + i];
+			if( Record.Mark == KnownMark && Record.Sum == Out[i].Sum )
+			{
+				Out[i] = Record;
+				continue;
+			}
+			// прежняя версия известна, только если её сумма проверена
+			Out[i].Prev = Record.Mark == KnownMark ? Record.Sum : 0;
+			Out[i].Mark = Record.Mark == KnownMark ? PendingMark : FirstMark;
+			Record = Out[i];
+			Changed[Index + i] = 1;
+			Updated = true;
+		}
+		if( !Updated || SumFile == FileIO::Invalid() ) return true;
+		size_t Bytes = Count * sizeof(SumRecord);
+		return FileIO::WriteAt( SumFile, Out, Bytes, (Index + 1) * sizeof(SumRecord) ) == (long long)Bytes;
+	}
+
+	// данные страниц [Index, Index + Count) записаны: в хранилище версия с суммами New.
+	// В пакете запись закончится только в EndBatch
+	void	Settle( unsigned Index, unsigned Count, const unsigned* New )
+	{
+		if( Index >= Sums.size() ) return;
+		if( Count > Sums.size() - Index ) Count = (unsigned)(Sums.size() - Index);
+		ThreadState* State = Threads::Find( this );
+		if( State && State->Batch > 0 )
+		{
+			for( unsigned i = 0; i < Count; i++ ) State->Unsettled.push_back( make_pair( Index + i, New[i] ) );
+			return;
+		}
+		lock_guard< mutex > Guard( SumLock );
+		for( unsigned i = 0; i < Count; i++ ) Known( Index + i, New[i] );
+	}
+
+	// под SumLock: в хранилище страница Index с суммой Sum
+	void	Known( unsigned Index, unsigned Sum )
+	{
+		SumRecord& Record = Sums[Index];
+		if( Record.Mark == KnownMark && Record.Sum == Sum ) return;
+		Record.Sum = Sum;
+		Record.Prev = 0;
+		Record.Mark = KnownMark;
+		Changed[Index] = 1;
+	}
+
+	// незавершённая запись (прошлого сеанса или неудавшаяся) принимает обе версии; прочитанное показывает,
+	// какая из них на самом деле в хранилище, дальше проверяется только она
+	bool	Check( unsigned Index, DataType& Ref )
+	{
+		if( !Verify || Index >= Sums.size() ) return true;
+		unsigned Sum = Crc32c( &Ref, sizeof(DataType) );
+		{
+			lock_guard< mutex > Guard( SumLock );
+			SumRecord& Record = Sums[Index];
+			if( Record.Mark == 0 || (Record.Mark == KnownMark && Record.Sum == Sum) ) return true;
+			if( Record.Mark == FirstMark || Record.Sum == Sum || (Record.Mark == PendingMark && Record.Prev == Sum) )
+			{
+				Known( Index, Sum );
+				return true;
+			}
+		}
+		Errors++;
+		return false;
+	}
+
+	// есть ли файл страниц; Fresh - его нет или он пуст, прежним суммам верить нельзя
+	static bool	Probe( const char* Path, bool& Fresh )
+	{
+		FileIO::Handle File = FileIO::Open( Path, false );
+		Fresh = true;
+		if( File == FileIO::Invalid() ) return false;
+		Fresh = FileIO::Size( File ) == 0;
+		FileIO::Close( File );
+		return true;
+	}
+
+	// открывает файл сумм и читает из него известные суммы; чего в файле нет - неизвестно.
+	// Файл сумм нового файла страниц или с чужим заголовком начинается заново. Незавершённые
+	// записи прошлого сеанса остаются незавершёнными: какая версия дошла до диска, покажет Check
+	bool	OpenSums( const char* Path, bool Create, bool Fresh )
+	{
+		if( SumFile != FileIO::Invalid() ) return false;
+		SumFile = FileIO::Open( (string( Path ) + ".crc").c_str(), Create );
+		if( SumFile == FileIO::Invalid() ) return false;
+
+		SumHeader Expected = { SumMagic, (unsigned)sizeof(DataType), (unsigned)Sums.size() }, Header;
+		long long Done = FileIO::ReadAt( SumFile, &Header, sizeof(Header), 0 );
+		if( Done < 0 ) return CloseSums();
+		memset( &Sums[0], 0, Sums.size() * sizeof(SumRecord) );
+		if( Fresh || Done != sizeof(Header) || memcmp( &Header, &Expected, sizeof(Header) ) != 0 )
+		{
+			if( !FileIO::Resize( SumFile, 0 ) || FileIO::WriteAt( SumFile, &Expected, sizeof(Expected), 0 ) != sizeof(Expected) )
+				return CloseSums();
+		}
+		else if( FileIO::ReadAt( SumFile, &Sums[0], Sums.size() * sizeof(SumRecord), sizeof(SumRecord) ) < 0 ) return CloseSums();
+
+		for( size_t i = 0; i < Sums.size(); i++ )
+		{
+			if( Sums[i].Mark != KnownMark && Sums[i].Mark != PendingMark && Sums[i].Mark != FirstMark ) Sums[i].Mark = 0;
+			Changed[i] = 0;
+		}
+		return true;
+	}
+
+	bool	CloseSums()
+	{
+		FileIO::Close( SumFile );
+		SumFile = FileIO::Invalid();
+		return false;
+	}
+
+	// пишет изменённые записи уже без предыдущих версий - данные на диске - и доводит
+	// файл сумм до диска
+	bool	SaveSums()
+	{
+		lock_guard< mutex > Guard( SumLock );
+		bool Written = false;
+		for( size_t First = 0, Last; First < Sums.size(); First = Last )
+		{
+			for( ; First < Sums.size() && !Changed[First]; First++ );
+			for( Last = First; Last < Sums.size() && Changed[Last]; Last++ ) Changed[Last] = 0;
+			if( Last == First || SumFile == FileIO::Invalid() ) continue;
+			size_t Bytes = (Last - First) * sizeof(SumRecord);
+			if( FileIO::WriteAt( SumFile, &Sums[First], Bytes, (First + 1) * sizeof(SumRecord) ) != (long long)Bytes )
+			{
+				for( size_t i = First; i < Last; i++ ) Changed[i] = 1;
+				return false;
+			}
+			Written = true;
+		}
+		return !Written || FileIO::Sync( SumFile );
+	}
+};
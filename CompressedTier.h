@@ -0,0 +1,153 @@
+#pragma once
+#include <vector>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "PageCodec.h"
+
+using namespace std;
+/*
+	Второй уровень кэша: страницы, вытесненные из пула политики, хранятся сжатыми в памяти
+	(LZCompress), и повторная загрузка стоит распаковки вместо обращения к устройству.
+
+		StaticPageDevice<16,16,8,LRUCache>	SPD;
+		SPD.SetSecondTier( 64 << 20 );		// до 64 МБ сжатых страниц
+
+	Включается у любой политики через CacheBase::SetSecondTier. Уровень держит только
+	чистые копии: грязная страница при вытеснении, как и раньше, сохраняется в устройство
+	и только потом попадает сюда, поэтому Flush и устойчивость данных не меняются.
+	Страница, загруженная обратно в пул, из уровня удаляется, при переполнении бюджета
+	выбрасываются давно положенные страницы. Несжимаемые страницы хранятся как есть.
+
+	Уровень защищён своим мьютексом - его можно звать из шардов и потока сброса.
+*/
+
+// счётчики второго уровня
+struct TierStatistics
+{
+	unsigned long long	Hits;			// загрузок, обслуженных уровнем
+	unsigned long long	Misses;			// загрузок, ушедших в устройство
+	unsigned long long	Stored;			// страниц положено
+	unsigned long long	Dropped;		// страниц выброшено по бюджету
+	unsigned long long	BytesIn;		// несжатый объём положенных страниц
+	unsigned long long	BytesCompressed;	// их сжатый объём
+	unsigned long long	Pages;			// страниц сейчас в уровне
+	unsigned long long	MemoryUsed;		// байт сейчас занято
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						CompressedTier
+///////////////////////////////////////////////////////////////////////////////
+
+template< class _T >
+class CompressedTier
+{
+public:
+	explicit CompressedTier( size_t BudgetBytes ): Budget(BudgetBytes), Used(0), Scratch(sizeof(_T))
+	{
+		memset( &Stats, 0, sizeof(Stats) );
+	}
+
+	// кладёт чистую копию вытесненной страницы
+	void	Put( unsigned Index, const _T& Ref )
+	{
+		lock_guard< mutex > Guard( Lock );
+		Remove( Index );
+
+		unsigned Size = LZCompress( (const unsigned char*)&Ref, sizeof(_T), &Scratch[0], sizeof(_T) );
+		Entry& E = Entries[Index];
+		if( Size > 0 ) E.Data.assign( Scratch.begin(), Scratch.begin() + Size );
+		else E.Data.assign( (const unsigned char*)&Ref, (const unsigned char*)&Ref + sizeof(_T) );
+		E.Raw = Size == 0;
+		Order.push_back( Index );
+		E.Position = --Order.end();
+		Used += Cost( E );
+
+		Stats.Stored++;
+		Stats.BytesIn += sizeof(_T);
+		Stats.BytesCompressed += E.Data.size();
+
+		while( Used > Budget && !Order.empty() )
+		{
+			Remove( Order.front() );
+			Stats.Dropped++;
+		}
+	}
+
+	// достаёт страницу в Ref и удаляет её из уровня, false - страницы нет
+	bool	Take( unsigned Index, _T& Ref )
+	{
+		lock_guard< mutex > Guard( Lock );
+		typename unordered_map< unsigned, Entry >::iterator It = Entries.find( Index );
+		if( It == Entries.end() )
+		{
+			Stats.Misses++;
+			return false;
+		}
+
+		const Entry& E = It->second;
+		bool Result = E.Raw ? (memcpy( &Ref, &E.Data[0], sizeof(_T) ), true)
+			: LZDecompress( &E.Data[0], (unsigned)E.Data.size(), (unsigned char*)&Ref, sizeof(_T) );
+		Remove( Index );
+		if( Result ) Stats.Hits++;
+		else Stats.Misses++;
+		return Result;
+	}
+
+	// в устройство записана новая версия страниц [Index, Index + Count) - копии устарели
+	void	Forget( unsigned Index, unsigned Count )
+	{
+		lock_guard< mutex > Guard( Lock );
+		if( Entries.empty() ) return;
+		for( unsigned i = 0; i < Count; i++ ) Remove( Index + i );
+	}
+
+	// устройство сменило содержимое целиком - все копии устарели
+	void	Clear()
+	{
+		lock_guard< mutex > Guard( Lock );
+		Entries.clear();
+		Order.clear();
+		Used = 0;
+	}
+
+	TierStatistics	Statistics() const
+	{
+		lock_guard< mutex > Guard( Lock );
+		TierStatistics Result = Stats;
+		Result.Pages = Entries.size();
+		Result.MemoryUsed = Used;
+		return Result;
+	}
+
+private:
+	struct Entry
+	{
+		vector< unsigned char >	Data;
+		bool	Raw;	// не сжалась, лежит как есть
+		list< unsigned >::iterator	Position;	// место в Order
+	};
+
+	mutable mutex	Lock;
+	unordered_map< unsigned, Entry >	Entries;
+	list< unsigned >	Order;		// номера страниц от давно положенных к недавним
+	size_t			Budget;
+	size_t			Used;
+	vector< unsigned char >	Scratch;	// буфер сжатия
+	TierStatistics	Stats;
+
+	// память записи вместе с накладными расходами контейнеров
+	static size_t	Cost( const Entry& E )
+	{
+		return E.Data.capacity() + sizeof(Entry) + 4 * sizeof(void*);
+	}
+
+	void	Remove( unsigned Index )
+	{
+		typename unordered_map< unsigned, Entry >::iterator It = Entries.find( Index );
+		if( It == Entries.end() ) return;
+		Used -= Cost( It->second );
+		Order.erase( It->second.Position );
+		Entries.erase( It );
+	}
+};
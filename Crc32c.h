@@ -0,0 +1,141 @@
+#pragma once
+#include <stddef.h>
+#include <string.h>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+/*
+	CRC32C (Castagnoli, полином 0x82F63B78) для контрольных сумм страниц.
+	На x86 с SSE4.2 считается командой crc32 по 8 байт, иначе - таблично, slicing-by-8
+	(8 таблиц по 256 значений, 8 байт за шаг). Выбор делается один раз, по cpuid.
+
+		unsigned Sum = Crc32c( Data, Size );
+		Sum = Crc32c( More, MoreSize, Sum );	// продолжение той же суммы
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						Crc32c
+///////////////////////////////////////////////////////////////////////////////
+
+namespace Crc32cImpl
+{
+	const unsigned Polynomial = 0x82F63B78;
+
+	struct Tables
+	{
+		unsigned	T[8][256];
+
+		Tables()
+		{
+			for( unsigned n = 0; n < 256; n++ )
+			{
+				unsigned c = n;
+				for( int k = 0; k < 8; k++ ) c = c & 1 ? (c >> 1) ^ Polynomial : c >> 1;
+				T[0][n] = c;
+			}
+			for( unsigned n = 0; n < 256; n++ )
+				for( int k = 1; k < 8; k++ ) T[k][n] = (T[k - 1][n] >> 8) ^ T[0][T[k - 1][n] & 0xFF];
+		}
+	};
+
+	inline const Tables&	GetTables()
+	{
+		static Tables Instance;
+		return Instance;
+	}
+
+	inline unsigned	Software( unsigned Crc, const unsigned char* p, size_t Size )
+	{
+		const Tables& t = GetTables();
+		for( ; Size && ((size_t)p & 7); Size--, p++ ) Crc = (Crc >> 8) ^ t.T[0][(Crc ^ *p) & 0xFF];
+		for( ; Size >= 8; Size -= 8, p += 8 )
+		{
+			unsigned Lo, Hi;
+			memcpy( &Lo, p, 4 );
+			memcpy( &Hi, p + 4, 4 );
+			Lo ^= Crc;
+			Crc = t.T[7][Lo & 0xFF] ^ t.T[6][(Lo >> 8) & 0xFF] ^ t.T[5][(Lo >> 16) & 0xFF] ^ t.T[4][Lo >> 24]
+				^ t.T[3][Hi & 0xFF] ^ t.T[2][(Hi >> 8) & 0xFF] ^ t.T[1][(Hi >> 16) & 0xFF] ^ t.T[0][Hi >> 24];
+		}
+		for( ; Size; Size--, p++ ) Crc = (Crc >> 8) ^ t.T[0][(Crc ^ *p) & 0xFF];
+		return Crc;
+	}
+
+#ifdef CRC32C_X86
+#ifdef _MSC_VER
+#define CRC32C_TARGET
+#else
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+
+	CRC32C_TARGET inline unsigned	Hardware( unsigned Crc, const unsigned char* p, size_t Size )
+	{
+		for( ; Size && ((size_t)p & 7); Size--, p++ ) Crc = _mm_crc32_u8( Crc, *p );
+#if defined(_M_X64) || defined(__x86_64__)
+		unsigned long long Crc64 = Crc;
+		for( ; Size >= 8; Size -= 8, p += 8 )
+		{
+			unsigned long long v;
+			memcpy( &v, p, 8 );
+			Crc64 = _mm_crc32_u64( Crc64, v );
+		}
+		Crc = (unsigned)Crc64;
+#else
+		for( ; Size >= 4; Size -= 4, p += 4 )
+		{
+			unsigned v;
+			memcpy( &v, p, 4 );
+			Crc = _mm_crc32_u32( Crc, v );
+		}
+#endif
+		for( ; Size; Size--, p++ ) Crc = _mm_crc32_u8( Crc, *p );
+		return Crc;
+	}
+
+	inline bool	HasSse42()
+	{
+#ifdef _MSC_VER
+		int Info[4];
+		__cpuid( Info, 1 );
+		return (Info[2] & (1 << 20)) != 0;
+#else
+		unsigned a, b, c, d;
+		return __get_cpuid( 1, &a, &b, &c, &d ) && (c & bit_SSE4_2) != 0;
+#endif
+	}
+#endif
+
+	// true - считаем командой crc32
+	inline bool	UseHardware()
+	{
+#ifdef CRC32C_X86
+		static const bool Result = HasSse42();
+		return Result;
+#else
+		return false;
+#endif
+	}
+}
+
+// CRC32C блока, Crc - сумма предыдущих блоков для продолжения
+inline unsigned	Crc32c( const void* Data, size_t Size, unsigned Crc = 0 )
+{
+	const unsigned char* p = (const unsigned char*)Data;
+#ifdef CRC32C_X86
+	if( Crc32cImpl::UseHardware() ) return ~Crc32cImpl::Hardware( ~Crc, p, Size );
+#endif
+	return ~Crc32cImpl::Software( ~Crc, p, Size );
+}
+
+// то же без SSE4.2 - для сравнения и проверки
+inline unsigned	Crc32cSoftware( const void* Data, size_t Size, unsigned Crc = 0 )
+{
+	return ~Crc32cImpl::Software( ~Crc, (const unsigned char*)Data, Size );
+}
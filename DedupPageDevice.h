@@ -0,0 +1,213 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <unordered_map>
+#include "Hash128.h"
+#include "ZeroCheck.h"
+
+using namespace std;
+/*
+	Устройство страниц в памяти с дедупликацией по содержимому: одинаковые страницы
+	(шаблонные записи, повторяющиеся снимки) хранятся одной физической копией. Save хэширует
+	страницу (PageHash, 128 бит) и ищет копию с тем же содержимым, карта пространства
+	отображает номер страницы в номер копии, у копии - счётчик ссылок.
+
+		DedupPageDevice<16,16,14,LRUCache>	DPD;
+		...
+		DPD.DedupRatio();				// страниц на одну физическую копию
+		DPD.DedupStats().HashNanoseconds / DPD.DedupStats().Saves;	// цена хэширования на сохранение
+
+		MemoryDevice<30,16,16,LRUCache,DedupPageDevice>	MD;
+
+	Совпадение хэшей проверяется сравнением содержимого - коллизия хэша даёт отдельную копию,
+	а не порчу данных. Копия, на которую ссылается одна страница, при изменении страницы
+	переписывается на месте, копия без ссылок уходит в список свободных. Нулевые страницы
+	копий не занимают вовсе: страница, которая ни разу не сохранялась или сохранена нулевой,
+	читается memset'ом.
+
+	Общая копия не может отдаваться наружу: Direct - NULL, с PassThroughCache устройство
+	не работает, только с политиками, у которых есть пул.
+	Хэш считается вне блокировки, поиск и счётчики - под одним мьютексом устройства.
+*/
+
+// счётчики дедупликации
+struct DedupStatistics
+{
+	unsigned long long	Pages;			// страниц с ненулевым содержимым
+	unsigned long long	Copies;			// физических копий у них
+	unsigned long long	Saves;			// сохранений ненулевых страниц
+	unsigned long long	Duplicates;		// из них нашли копию с тем же содержимым
+	unsigned long long	ZeroSaves;		// сохранений нулевых страниц - без хэширования
+	unsigned long long	Collisions;		// хэш совпал, содержимое - нет
+	unsigned long long	HashNanoseconds;	// время хэширования всех Saves
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						DedupPageDevice
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	unsigned PageSize = 16,
+	unsigned PoolSize = 16,
+	unsigned SpaceSize = 8,
+	template< class, unsigned, unsigned > class CachePolicy = Cache
+>
+class DedupPageDevice : public PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>
+{
+	typedef PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy> Base;
+	static const size_t PageBytes = sizeof(Page<PageSize>);
+	static const unsigned NoCopy = ~0u;
+public:
+	DedupPageDevice(): Map(Base::__PageCount, (unsigned)NoCopy)
+	{
+		memset( &Stats, 0, sizeof(Stats) );
+	}
+
+	virtual ~DedupPageDevice()
+	{
+		// сливаем кэш, пока Save этого устройства ещё доступен
+		this->Close();
+	}
+
+	DedupStatistics	DedupStats() const
+	{
+		lock_guard< mutex > Guard( Lock );
+		return Stats;
+	}
+
+	// страниц на одну физическую копию, 1 - повторов нет
+	double	DedupRatio() const
+	{
+		lock_guard< mutex > Guard( Lock );
+		return Stats.Copies ? (double)Stats.Pages / Stats.Copies : 1.0;
+	}
+
+protected:
+	virtual bool  Load( unsigned Index, Page<PageSize>& Ref )
+	{
+		if( Index >= Base::__PageCount ) return false;
+		lock_guard< mutex > Guard( Lock );
+		if( Map[Index] == NoCopy ) memset( &Ref, 0, PageBytes );
+		else memcpy( &Ref, &Copies[Map[Index]]->Data, PageBytes );
+		return true;
+	}
+
+	virtual bool  Save( unsigned Index, Page<PageSize>& Ref )
+	{
+		if( Index >= Base::__PageCount ) return false;
+		if( IsZero( &Ref, PageBytes ) )
+		{
+			lock_guard< mutex > Guard( Lock );
+			Stats.ZeroSaves++;
+			Release( Index );
+			return true;
+		}
+
+		chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+		Hash128 Hash = PageHash( &Ref, PageBytes );
+		unsigned long long Spent = (unsigned long long)chrono::duration_cast< chrono::nanoseconds >( chrono::steady_clock::now() - Start ).count();
+
+		lock_guard< mutex > Guard( Lock );
+		Stats.Saves++;
+		Stats.HashNanoseconds += Spent;
+
+		unsigned Id = Find( Hash, Ref );
+		if( Id != NoCopy )
+		{
+			Stats.Duplicates++;
+			if( Map[Index] == Id ) return true;
+			Release( Index );
+			Copies[Id]->Refs++;
+			Map[Index] = Id;
+			Stats.Pages++;
+			return true;
+		}
+
+		// новое содержимое: единственную ссылку переписываем на месте
+		Id = Map[Index];
+		if( Id != NoCopy && Copies[Id]->Refs == 1 ) Unindex( Id );
+		else
+		{
+			Release( Index );
+			Id = Allocate();
+			Copies[Id]->Refs = 1;
+			Map[Index] = Id;
+			Stats.Pages++;
+		}
+		memcpy( &Copies[Id]->Data, &Ref, PageBytes );
+		Copies[Id]->Hash = Hash;
+		ByHash.insert( make_pair( Hash.Lo, Id ) );
+		return true;
+	}
+
+private:
+	struct Copy
+	{
+		Page<PageSize>	Data;
+		Hash128			Hash;
+		unsigned		Refs;
+	};
+
+	vector< unsigned >	Map;		// номер страницы -> номер копии, NoCopy - нулевая
+	vector< unique_ptr< Copy > >	Copies;
+	vector< unsigned >	Free;		// копии без ссылок
+	unordered_multimap< unsigned long long, unsigned >	ByHash;	// младшие 64 бита хэша -> копии
+	DedupStatistics		Stats;
+	mutable mutex		Lock;
+
+	// копия с тем же содержимым или NoCopy
+	unsigned	Find( const Hash128& Hash, const Page<PageSize>& Ref )
+	{
+		typedef typename unordered_multimap< unsigned long long, unsigned >::iterator Iterator;
+		pair< Iterator, Iterator > Range = ByHash.equal_range( Hash.Lo );
+		for( Iterator It = Range.first; It != Range.second; ++It )
+		{
+			Copy& C = *Copies[It->second];
+			if( C.Hash != Hash ) continue;
+			if( memcmp( &C.Data, &Ref, PageBytes ) == 0 ) return It->second;
+			Stats.Collisions++;
+		}
+		return NoCopy;
+	}
+
+	void	Unindex( unsigned Id )
+	{
+		typedef typename unordered_multimap< unsigned long long, unsigned >::iterator Iterator;
+		pair< Iterator, Iterator > Range = ByHash.equal_range( Copies[Id]->Hash.Lo );
+		for( Iterator It = Range.first; It != Range.second; ++It )
+			if( It->second == Id )
+			{
+				ByHash.erase( It );
+				return;
+			}
+	}
+
+	unsigned	Allocate()
+	{
+		Stats.Copies++;
+		if( !Free.empty() )
+		{
+			unsigned Id = Free.back();
+			Free.pop_back();
+			return Id;
+		}
+		Copies.push_back( unique_ptr< Copy >( new Copy ) );
+		return (unsigned)Copies.size() - 1;
+	}
+
+	// страница больше не ссылается на свою копию
+	void	Release( unsigned Index )
+	{
+		unsigned Id = Map[Index];
+		if( Id == NoCopy ) return;
+		Map[Index] = NoCopy;
+		Stats.Pages--;
+		if( --Copies[Id]->Refs > 0 ) return;
+		Unindex( Id );
+		Free.push_back( Id );
+		Stats.Copies--;
+	}
+};
@@ -0,0 +1,531 @@
+#pragma once
+#include <string.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <algorithm>
+#include "PageBuffer.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#endif
+
+using namespace std;
+/*
+	Устройство страниц в файле: страница Index лежит по смещению Index << PageSize,
+	Load/Save - позиционные pread/pwrite на одном дескрипторе, открытом на всё время жизни
+	устройства (на Windows - ReadFile/WriteFile с OVERLAPPED-смещением).
+
+		FilePageDevice<16,64,14,LRUCache>	FPD;
+		if( !FPD.Open( "pages.bin" ) ) ... FPD.SystemError() ...
+
+		MemoryDevice<30,16,64,LRUCache,FilePageDevice>	MD;	// 1 ГБ поверх файла
+		MD.Device().Open( "memory.bin" );
+
+	Файл разреженный: размер не задаётся заранее, страницы, которые ни разу не сохранялись,
+	места на диске не занимают и читаются нулями - и дыры внутри файла, и всё за его концом.
+	Серии (LoadRange/SaveRange) идут одним preadv/pwritev, изменённые участки страницы
+	(SaveExtents) - отдельными pwrite только этих участков.
+
+	Когда данные доходят до диска, решает SetSync:
+		FileSyncNone	- никогда, остаётся на ОС;
+		FileSyncOnFlush	- Flush() (и закрытие устройства) после сброса кэша делает fdatasync, по умолчанию;
+		FileSyncAlways	- fdatasync после каждого сохранения.
+
+	Open( Path, Create, true ) (или DirectPageDevice) открывает файл мимо кэша ОС - O_DIRECT,
+	FILE_FLAG_NO_BUFFERING, F_NOCACHE в macOS: страница лежит в памяти один раз, в пуле,
+	а не ещё и в кэше ядра. Страница должна быть кратна 4 КБ (PageSize >= 12), иначе Open
+	откажет с EINVAL. Пулы политик лежат в PageBuffer, выровненном на размер страницы, -
+	Load/Save читают и пишут прямо в них. Только у ResizableCache слоты выделяются по одному
+	и страницы не выровнены - они идут через свой выровненный буфер устройства с лишним
+	копированием, их число - BouncedPages().
+
+		DirectPageDevice<16,64,14,Cache>	DPD;
+		DPD.Open( "pages.bin" );
+*/
+
+enum FileSyncMode
+{
+	FileSyncNone,
+	FileSyncOnFlush,
+	FileSyncAlways
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						FileIO
+///////////////////////////////////////////////////////////////////////////////
+
+// позиционный ввод-вывод без переносимой обёртки в стандартной библиотеке
+namespace FileIO
+{
+	// выравнивание для ввода-вывода мимо кэша ОС - с запасом на сектор 4 КБ
+	const size_t	DirectAlign = 4096;
+
+#ifdef _WIN32
+	typedef HANDLE	Handle;
+	inline Handle	Invalid() { return INVALID_HANDLE_VALUE; }
+	inline int		LastError() { return (int)GetLastError(); }
+
+	// Direct - мимо кэша ОС: буферы, смещения и длины должны быть кратны DirectAlign
+	inline Handle	Open( const char* Path, bool Create, bool Direct = false )
+	{
+		Handle File = CreateFileA( Path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+			Create ? OPEN_ALWAYS : OPEN_EXISTING,
+			Direct ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : FILE_ATTRIBUTE_NORMAL, NULL );
+		DWORD Bytes;
+		// без флага NTFS заполнит пропущенное нулями на диске
+		if( File != INVALID_HANDLE_VALUE ) DeviceIoControl( File, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &Bytes, NULL );
+		return File;
+	}
+
+	inline void		Close( Handle File ) { CloseHandle( File ); }
+
+	// читает до Size байт с Offset, возвращает прочитанное (меньше Size - конец файла), -1 - ошибка
+	inline long long	ReadAt( Handle File, void* Data, size_t Size, unsigned long long Offset )
+	{
+		OVERLAPPED At;
+		memset( &At, 0, sizeof(At) );
+		At.Offset = (DWORD)Offset;
+		At.OffsetHigh = (DWORD)(Offset >> 32);
+		DWORD Done = 0;
+		if( ReadFile( File, Data, (DWORD)Size, &Done, &At ) ) return Done;
+		return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+	}
+
+	inline long long	WriteAt( Handle File, const void* Data, size_t Size, unsigned long long Offset )
+	{
+		OVERLAPPED At;
+		memset( &At, 0, sizeof(At) );
+		At.Offset = (DWORD)Offset;
+		At.OffsetHigh = (DWORD)(Offset >> 32);
+		DWORD Done = 0;
+		return WriteFile( File, Data, (DWORD)Size, &Done, &At ) ? (long long)Done : -1;
+	}
+
+	inline bool		Sync( Handle File ) { return FlushFileBuffers( File ) != 0; }
+
+	inline unsigned long long	Size( Handle File )
+	{
+		LARGE_INTEGER Result;
+		return GetFileSizeEx( File, &Result ) ? (unsigned long long)Result.QuadPart : 0;
+	}
+
+	// меняет длину файла, новое место - дыра
+	inline bool		Resize( Handle File, unsigned long long Bytes )
+	{
+		FILE_END_OF_FILE_INFO Info;
+		Info.EndOfFile.QuadPart = (LONGLONG)Bytes;
+		return SetFileInformationByHandle( File, FileEndOfFileInfo, &Info, sizeof(Info) ) != 0;
+	}
+
+	inline unsigned long long	Allocated( Handle File )
+	{
+		FILE_STANDARD_INFO Info;
+		return GetFileInformationByHandleEx( File, FileStandardInfo, &Info, sizeof(Info) )
+			? (unsigned long long)Info.AllocationSize.QuadPart : 0;
+	}
+#else
+	typedef int		Handle;
+	inline Handle	Invalid() { return -1; }
+	inline int		LastError() { return errno; }
+
+	// Direct - мимо кэша ОС: буферы, смещения и длины должны быть кратны DirectAlign
+	inline Handle	Open( const char* Path, bool Create, bool Direct = false )
+	{
+		int Flags = O_RDWR | O_CLOEXEC | (Create ? O_CREAT : 0);
+#ifdef O_DIRECT
+		if( Direct ) Flags |= O_DIRECT;
+#endif
+		Handle File = open( Path, Flags, 0644 );
+#if defined(F_NOCACHE)
+		// в macOS O_DIRECT нет, кэш отключается на открытом файле
+		if( File >= 0 && Direct && fcntl( File, F_NOCACHE, 1 ) != 0 )
+		{
+			close( File );
+			return -1;
+		}
+#elif !defined(O_DIRECT)
+		if( File >= 0 && Direct )
+		{
+			close( File );
+			errno = EINVAL;
+			return -1;
+		}
+#endif
+		return File;
+	}
+
+	inline void		Close( Handle File ) { close( File ); }
+
+	// читает до Size байт с Offset, возвращает прочитанное (меньше Size - конец файла), -1 - ошибка
+	inline long long	ReadAt( Handle File, void* Data, size_t Size, unsigned long long Offset )
+	{
+		size_t Done = 0;
+		while( Done < Size )
+		{
+			ssize_t Part = pread( File, (char*)Data + Done, Size - Done, (off_t)(Offset + Done) );
+			if( Part < 0 && errno == EINTR ) continue;
+			if( Part < 0 ) return -1;
+			if( Part == 0 ) break;
+			Done += Part;
+		}
+		return (long long)Done;
+	}
+
+	inline long long	WriteAt( Handle File, const void* Data, size_t Size, unsigned long long Offset )
+	{
+		size_t Done = 0;
+		while( Done < Size )
+		{
+			ssize_t Part = pwrite( File, (const char*)Data + Done, Size - Done, (off_t)(Offset + Done) );
+			if( Part < 0 && errno == EINTR ) continue;
+			if( Part <= 0 ) return -1;
+			Done += Part;
+		}
+		return (long long)Done;
+	}
+
+	// вектор страниц одним вызовом, при частичной передаче - сколько успели
+	inline long long	ReadVectorAt( Handle File, const struct iovec* Parts, int Count, unsigned long long Offset )
+	{
+		ssize_t Done;
+		while( (Done = preadv( File, Parts, Count, (off_t)Offset )) < 0 && errno == EINTR );
+		return Done;
+	}
+
+	inline long long	WriteVectorAt( Handle File, const struct iovec* Parts, int Count, unsigned long long Offset )
+	{
+		ssize_t Done;
+		while( (Done = pwritev( File, Parts, Count, (off_t)Offset )) < 0 && errno == EINTR );
+		return Done;
+	}
+
+	inline bool		Sync( Handle File )
+	{
+#ifdef __APPLE__
+		return fsync( File ) == 0;
+#else
+		return fdatasync( File ) == 0;
+#endif
+	}
+
+	inline unsigned long long	Size( Handle File )
+	{
+		struct stat Info;
+		return fstat( File, &Info ) == 0 ? (unsigned long long)Info.st_size : 0;
+	}
+
+	// меняет длину файла, новое место - дыра
+	inline bool		Resize( Handle File, unsigned long long Bytes )
+	{
+		return ftruncate( File, (off_t)Bytes ) == 0;
+	}
+
+	inline unsigned long long	Allocated( Handle File )
+	{
+		struct stat Info;
+		return fstat( File, &Info ) == 0 ? (unsigned long long)Info.st_blocks * 512 : 0;
+	}
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//						FilePageDevice
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	unsigned PageSize = 16,
+	unsigned PoolSize = 16,
+	unsigned SpaceSize = 8,
+	template< class, unsigned, unsigned > class CachePolicy = Cache
+>
+class FilePageDevice : public PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>
+{
+	typedef PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy> Base;
+	static const size_t PageBytes = sizeof(Page<PageSize>);
+public:
+	FilePageDevice(): File(FileIO::Invalid()), SyncMode(FileSyncOnFlush), Error(0), Unbuffered(false), Bounces(0)
+	{
+	}
+
+	virtual ~FilePageDevice()
+	{
+		// сливаем кэш, пока файл открыт и Save этого устройства ещё доступен
+		this->Close();
+		if( File != FileIO::Invalid() ) FileIO::Close( File );
+	}
+
+	// открывает файл страниц, Create - создать, если его нет, Direct - мимо кэша ОС;
+	// устройство открывается один раз
+	bool	Open( const char* Path, bool Create = true, bool Direct = false )
+	{
+		if( File != FileIO::Invalid() ) return false;
+#ifdef _WIN32
+		if( Direct && PageBytes % FileIO::DirectAlign != 0 ) return Failed( ERROR_INVALID_PARAMETER );
+#else
+		if( Direct && PageBytes % FileIO::DirectAlign != 0 ) return Failed( EINVAL );
+#endif
+		if( Direct && !Bounce ) Bounce.reset( new PageBuffer< Page<PageSize> >( 1 ) );
+		File = FileIO::Open( Path, Create, Direct );
+		if( File == FileIO::Invalid() ) return Failed();
+		Unbuffered = Direct;
+		return true;
+	}
+
+	bool	IsOpen() const
+	{
+		return File != FileIO::Invalid();
+	}
+
+	// файл открыт мимо кэша ОС
+	bool	IsDirect() const
+	{
+		return IsOpen() && Unbuffered;
+	}
+
+	// сколько страниц в режиме Direct прошло через промежуточный буфер - не выровнены в пуле
+	unsigned long long	BouncedPages() const
+	{
+		return Bounces.load();
+	}
+
+	void	SetSync( FileSyncMode Mode )
+	{
+		SyncMode = Mode;
+	}
+
+	// сбрасывает кэш и, если так настроено, доводит файл до диска
+	virtual bool	Flush()
+	{
+		if( !Base::Flush() ) return false;
+		return SyncMode == FileSyncNone || Sync();
+	}
+
+	// доводит уже записанное в файл до диска
+	bool	Sync()
+	{
+		if( File == FileIO::Invalid() ) return true;
+		if( FileIO::Sync( File ) ) return true;
+		Error = FileIO::LastError();
+		return false;
+	}
+
+	// размер файла и сколько он реально занимает на диске - у разреженного файла меньше
+	unsigned long long	FileBytes() const
+	{
+		return File != FileIO::Invalid() ? FileIO::Size( File ) : 0;
+	}
+
+	unsigned long long	AllocatedBytes() const
+	{
+		return File != FileIO::Invalid() ? FileIO::Allocated( File ) : 0;
+	}
+
+	// код последней ошибки ОС (errno или GetLastError), 0 - ошибок не было
+	int		SystemError() const
+	{
+		return Error;
+	}
+
+protected:
+	virtual bool  Load( unsigned Index, Page<PageSize>& Ref )
+	{
+		if( !Valid( Index, 1 ) ) return false;
+		if( !Aligned( &Ref ) ) return Bounced( Index, Ref, false );
+		long long Done = FileIO::ReadAt( File, &Ref, PageBytes, Offset( Index ) );
+		if( Done < 0 ) return Failed();
+		// дыра за концом файла - страница ещё не сохранялась
+		memset( (char*)&Ref + Done, 0, PageBytes - (size_t)Done );
+		return true;
+	}
+
+	virtual bool  Save( unsigned Index, Page<PageSize>& Ref )
+	{
+		if( !Valid( Index, 1 ) ) return false;
+		if( !Aligned( &Ref ) ) return Bounced( Index, Ref, true );
+		if( FileIO::WriteAt( File, &Ref, PageBytes, Offset( Index ) ) != (long long)PageBytes ) return Failed();
+		return Saved();
+	}
+
+	virtual bool  SaveExtents( unsigned Index, Page<PageSize>& Ref, const PageExtent* Extents, unsigned Count )
+	{
+		if( !Valid( Index, 1 ) ) return false;
+		// участки - целые блоки от 4 КБ, без кэша ОС годятся, если выровнена сама страница
+		if( !Aligned( &Ref ) ) return Bounced( Index, Ref, true );
+		for( unsigned i = 0; i < Count; i++ )
+			if( FileIO::WriteAt( File, Ref.Data + Extents[i].Offset, Extents[i].Size,
+					Offset( Index ) + Extents[i].Offset ) != (long long)Extents[i].Size )
+				return Failed();
+		return Saved();
+	}
+
+#ifndef _WIN32
+	virtual bool  LoadRange( unsigned Index, unsigned Count, Page<PageSize>** Refs )
+	{
+		if( !Valid( Index, Count ) ) return false;
+		if( !Aligned( Count, Refs ) )
+		{
+			for( unsigned i = 0; i < Count; i++ )
+				if( !Load( Index + i, *Refs[i] ) ) return false;
+			return true;
+		}
+		vector< struct iovec > Parts;
+		for( unsigned First = 0, Part; First < Count; First += Part )
+		{
+			Part = Count - First < MaxVector ? Count - First : MaxVector;
+			long long Done = FileIO::ReadVectorAt( File, Vector( Parts, Part, Refs + First ), (int)Part, Offset( Index + First ) );
+			if( Done < 0 ) return Failed();
+
+			// целиком прочитанные страницы готовы, остаток (конец файла, короткое чтение) - постранично
+			for( unsigned i = (unsigned)(Done / PageBytes); i < Part; i++ )
+				if( !Load( Index + First + i, *Refs[First + i] ) ) return false;
+		}
+		return true;
+	}
+
+	virtual bool  SaveRange( unsigned Index, unsigned Count, Page<PageSize>** Refs )
+	{
+		if( !Valid( Index, Count ) ) return false;
+		if( !Aligned( Count, Refs ) )
+		{
+			for( unsigned i = 0; i < Count; i++ )
+				if( !Save( Index + i, *Refs[i] ) ) return false;
+			return true;
+		}
+		vector< struct iovec > Parts;
+		for( unsigned First = 0, Part; First < Count; First += Part )
+		{
+			Part = Count - First < MaxVector ? Count - First : MaxVector;
+			long long Done = FileIO::WriteVectorAt( File, Vector( Parts, Part, Refs + First ), (int)Part, Offset( Index + First ) );
+			if( Done < 0 ) return Failed();
+
+			for( unsigned i = (unsigned)(Done / PageBytes); i < Part; i++ )
+				if( FileIO::WriteAt( File, Refs[First + i], PageBytes, Offset( Index + First + i ) ) != (long long)PageBytes )
+					return Failed();
+		}
+		return Saved();
+	}
+#endif
+
+protected:
+	FileIO::Handle	Handle() const
+	{
+		return File;
+	}
+
+	static unsigned long long	Offset( unsigned Index )
+	{
+		return (unsigned long long)Index << PageSize;
+	}
+
+	bool	Valid( unsigned Index, unsigned Count ) const
+	{
+		return File != FileIO::Invalid() && Index < Base::__PageCount && Count <= Base::__PageCount - Index;
+	}
+
+	// запоминает код ошибки ОС, по умолчанию - последней
+	bool	Failed( int Code = FileIO::LastError() )
+	{
+		Error = Code;
+		return false;
+	}
+
+	// после сохранения: при FileSyncAlways - сразу на диск
+	bool	Saved()
+	{
+		return SyncMode != FileSyncAlways || Sync();
+	}
+
+	// страницу можно передавать как есть: файл открыт с кэшем ОС или она выровнена
+	bool	Aligned( const Page<PageSize>* Ref ) const
+	{
+		return !Unbuffered || ((size_t)Ref & (FileIO::DirectAlign - 1)) == 0;
+	}
+
+	bool	Aligned( unsigned Count, Page<PageSize>** Refs ) const
+	{
+		for( unsigned i = 0; i < Count; i++ )
+			if( !Aligned( Refs[i] ) ) return false;
+		return true;
+	}
+
+	// невыровненная страница через буфер устройства; вызовы невиртуальные - обёртки
+	// и асинхронные наследники не должны видеть общий буфер
+	bool	Bounced( unsigned Index, Page<PageSize>& Ref, bool Write )
+	{
+		lock_guard< mutex > Guard( BounceLock );
+		Page<PageSize>& Buffer = (*Bounce)[0];
+		Bounces++;
+		if( Write )
+		{
+			memcpy( &Buffer, &Ref, PageBytes );
+			return FilePageDevice::Save( Index, Buffer );
+		}
+		if( !FilePageDevice::Load( Index, Buffer ) ) return false;
+		memcpy( &Ref, &Buffer, PageBytes );
+		return true;
+	}
+
+#ifndef _WIN32
+	// вектор для preadv/pwritev - свой на каждый вызов, серии могут идти из разных шардов
+	static const struct iovec*	Vector( vector< struct iovec >& Parts, unsigned Count, Page<PageSize>** Refs )
+	{
+		Parts.resize( Count );
+		for( unsigned i = 0; i < Count; i++ )
+		{
+			Parts[i].iov_base = Refs[i];
+			Parts[i].iov_len = PageBytes;
+		}
+		return &Parts[0];
+	}
+#endif
+
+private:
+	FileIO::Handle	File;
+	FileSyncMode	SyncMode;
+	atomic< int >	Error;		// шарды могут сохранять одновременно
+	bool			Unbuffered;	// открыт мимо кэша ОС
+	unique_ptr< PageBuffer< Page<PageSize> > >	Bounce;	// выровненная страница для невыровненных слотов пула
+	mutex			BounceLock;
+	atomic< unsigned long long >	Bounces;
+#ifndef _WIN32
+#ifdef IOV_MAX
+	static const unsigned MaxVector = IOV_MAX;
+#else
+	static const unsigned MaxVector = 1024;
+#endif
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						DirectPageDevice
+///////////////////////////////////////////////////////////////////////////////
+
+// FilePageDevice, всегда открываемый мимо кэша ОС - и для MemoryDevice, которому
+// нужен шаблон устройства
+template
+<
+	unsigned PageSize = 16,
+	unsigned PoolSize = 16,
+	unsigned SpaceSize = 8,
+	template< class, unsigned, unsigned > class CachePolicy = Cache
+>
+class DirectPageDevice : public FilePageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>
+{
+	typedef FilePageDevice<PageSize, PoolSize, SpaceSize, CachePolicy> Base;
+	static_assert( sizeof(Page<PageSize>) % FileIO::DirectAlign == 0, "O_DIRECT needs pages of 4 KB and more" );
+public:
+	bool	Open( const char* Path, bool Create = true )
+	{
+		return Base::Open( Path, Create, true );
+	}
+};
@@ -0,0 +1,85 @@
+#pragma once
+#include <stddef.h>
+#include <string.h>
+
+/*
+	128-битный некриптографический хэш для поиска одинаковых страниц. Четыре независимые
+	64-битные дорожки (раунд умножение-сдвиг-умножение, как у xxHash64) по 32 байта за шаг,
+	в конце дорожки сводятся в две половины с перемешиванием всех битов. Совпадение хэшей
+	не гарантирует совпадения данных - сравнивать содержимое всё равно нужно, хэш лишь
+	делает сравнение редким.
+
+		Hash128 H = PageHash( &Page, sizeof(Page) );
+*/
+
+struct Hash128
+{
+	unsigned long long	Lo;
+	unsigned long long	Hi;
+
+	bool	operator==( const Hash128& Other ) const { return Lo == Other.Lo && Hi == Other.Hi; }
+	bool	operator!=( const Hash128& Other ) const { return !(*this == Other); }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						PageHash
+///////////////////////////////////////////////////////////////////////////////
+
+namespace Hash128Impl
+{
+	const unsigned long long Prime1 = 0x9E3779B185EBCA87ull;
+	const unsigned long long Prime2 = 0xC2B2AE3D27D4EB4Full;
+	const unsigned long long Prime3 = 0x165667B19E3779F9ull;
+	const unsigned long long Prime4 = 0x85EBCA77C2B2AE63ull;
+
+	inline unsigned long long	Rotate( unsigned long long x, int r )
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	inline unsigned long long	Round( unsigned long long Lane, unsigned long long v )
+	{
+		return Rotate( Lane + v * Prime2, 31 ) * Prime1;
+	}
+
+	inline unsigned long long	Avalanche( unsigned long long h )
+	{
+		h ^= h >> 33;
+		h *= Prime2;
+		h ^= h >> 29;
+		h *= Prime3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	inline unsigned long long	Read( const unsigned char* p )
+	{
+		unsigned long long v;
+		memcpy( &v, p, 8 );
+		return v;
+	}
+}
+
+// хэш Size байт с Data; Seed разводит независимые наборы хэшей
+inline Hash128	PageHash( const void* Data, size_t Size, unsigned long long Seed = 0 )
+{
+	using namespace Hash128Impl;
+	const unsigned char* p = (const unsigned char*)Data;
+	unsigned long long a = Seed + Prime1 + Prime2, b = Seed + Prime2, c = Seed, d = Seed - Prime1;
+	size_t Left = Size;
+
+	for( ; Left >= 32; Left -= 32, p += 32 )
+	{
+		a = Round( a, Read( p ) );
+		b = Round( b, Read( p + 8 ) );
+		c = Round( c, Read( p + 16 ) );
+		d = Round( d, Read( p + 24 ) );
+	}
+	// хвост короче 32 байт - побайтно в первую дорожку, страницам он не нужен
+	for( ; Left; Left--, p++ ) a = Rotate( a ^ (*p * Prime4), 11 ) * Prime1;
+
+	Hash128 Result;
+	Result.Lo = Avalanche( Rotate( a, 1 ) + Rotate( b, 7 ) + Rotate( c, 12 ) + Rotate( d, 18 ) + Size );
+	Result.Hi = Avalanche( (a ^ Rotate( c, 29 )) * Prime4 + (b ^ Rotate( d, 33 )) * Prime3 + Result.Lo );
+	return Result;
+}
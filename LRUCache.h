@@ -0,0 +1,423 @@
+#pragma once
+#include <vector>
+#include "PageDevice.h"
+
+using namespace std;
+/*
+	Политики кэширования страниц с вытеснением давно неиспользуемых страниц.
+	Подключаются вместо Cache через параметр CachePolicy у PageDevice/MemoryDevice:
+
+		StaticPageDevice<16,16,8,LRUCache>			SPD;
+		MemoryDevice<24,16,16,ClockCache,StaticPageDevice>	CSMD;
+
+	LRUCache	- точный LRU: двусвязный список слотов пула в порядке обращений,
+				  жертва - хвост списка. Все операции O(1).
+				  Страницы лежат в PageBuffer, описания слотов со связями списка - в своём массиве.
+	ClockCache	- CLOCK (second chance): у каждого слота бит обращения,
+				  стрелка обходит пул по кругу и вытесняет первый слот со сброшенным битом.
+				  Попадание стоит одной записи бита, без перестройки списка.
+				  Страницы лежат в PageBuffer, описания слотов - в параллельных массивах.
+
+	Как и Cache, обе политики поддерживают Pin/Unpin, PageHandle, Flush и GetDataForWrite:
+	закреплённые слоты при выборе жертвы пропускаются.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						LRUCache
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	class _T,
+		unsigned CacheSize = 16,
+		unsigned SpaceSize = 8
+>
+class LRUCache : public CacheBase<_T>
+{
+public:
+	typedef _T DataType;
+
+	LRUCache(): Pages(CacheSize), Pool(CacheSize), VMap(1 << SpaceSize, (int)-1)
+	{
+		// Проинициализируем пул: все слоты свободны и связаны в список по порядку
+		for( int i = 0; i < (int)CacheSize; i++ )
+		{
+			Pool[i].Index = -1;
+			Pool[i].Dirty = 0;
+			Pool[i].PinCount = 0;
+			Pool[i].Prev = i - 1;
+			Pool[i].Next = i + 1;
+		}
+		Pool[CacheSize - 1].Next = -1;
+		Head = 0;
+		Tail = CacheSize - 1;
+		Error = CacheOk;
+	}
+
+	virtual ~LRUCache()
+	{
+	}
+
+	_T*		GetData( unsigned Index, bool ForWrite )
+	{
+		if( Index >= VMap.size() )
+		{
+			Error = CacheBadIndex;
+			return NULL;
+		}
+
+		int PoolPos = VMap[Index];
+		if( PoolPos >= 0 )
+		{
+			this->Stats.Hit();
+			Pool[PoolPos].Dirty |= this->Blocks( ForWrite );
+			Touch( PoolPos );
+			return &Pages[PoolPos];
+		}
+		this->Stats.Miss();
+
+		// жертва - самый давно использованный незакреплённый слот (свободные слоты изначально в хвосте)
+		for( PoolPos = Tail; PoolPos >= 0 && Pool[PoolPos].PinCount > 0; PoolPos = Pool[PoolPos].Prev );
+		if( PoolPos < 0 )
+		{
+			Error = CacheAllPinned;
+			return NULL;
+		}
+
+		if( Pool[PoolPos].Index >= 0 )
+		{
+			if( Pool[PoolPos].Dirty )
+			{
+				if( !this->SavePage( Pool[PoolPos].Index, Pages[PoolPos], Pool[PoolPos].Dirty ) )
+				{
+					// ошибка сохранения страницы
+					Error = CacheSaveFailed;
+					return NULL;
+				}
+				Pool[PoolPos].Dirty = 0;
+			}
+			this->Retire( Pool[PoolPos].Index, Pages[PoolPos] );
+			VMap[Pool[PoolPos].Index] = -1;
+			Pool[PoolPos].Index = -1;
+			this->Stats.Eviction();
+		}
+
+		if( !this->LoadPage( Index, Pages[PoolPos] ) )
+		{
+			Error = CacheLoadFailed;
+			return NULL;
+		}
+
+		Pool[PoolPos].Index = Index;
+		Pool[PoolPos].Dirty = this->Blocks( ForWrite );
+		VMap[Index] = PoolPos;
+		Touch( PoolPos );
+		return &Pages[PoolPos];
+	}
+
+	// берёт страницу на запись, грязными помечаются только блоки, покрывающие [Offset, Offset + Size)
+	_T*		GetDataForWrite( unsigned Index, unsigned Offset, unsigned Size )
+	{
+		_T* Ptr = GetData( Index, false );
+		if( Ptr ) Pool[VMap[Index]].Dirty |= this->Blocks( Offset, Size );
+		return Ptr;
+	}
+
+	// загружает и закрепляет страницу, каждому Pin должен соответствовать Unpin
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		_T* Ptr = GetData( Index, ForWrite );
+		if( Ptr ) Pool[VMap[Index]].PinCount++;
+		return Ptr;
+	}
+
+	void	Unpin( unsigned Index )
+	{
+		if( Index < VMap.size() && VMap[Index] >= 0 && Pool[VMap[Index]].PinCount > 0 )
+			Pool[VMap[Index]].PinCount--;
+	}
+
+	// закрепляет страницы [Index, Index + Count) по одной, пакетной загрузки у политики нет
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		return this->PinEach( *this, Index, Count, ForWrite );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// помечает грязными блоки [Offset, Offset + Size) страницы Span[i]: страница закреплена,
+	// слот берётся из карты без поиска и без счёта попадания
+	void	MarkDirty( const PageSpan<_T>& Span, unsigned i, unsigned Offset, unsigned Size )
+	{
+		Pool[VMap[Span.GetIndex() + i]].Dirty |= this->Blocks( Offset, Size );
+	}
+
+	// сбрасывает все грязные страницы, страницы остаются в пуле
+	virtual bool	Flush()
+	{
+		vector< DirtyPage > Dirty;
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( Pool[i].Dirty && Pool[i].Index >= 0 )
+			{
+				DirtyPage Page = { (unsigned)Pool[i].Index, &Pages[i], &Pool[i].Dirty };
+				Dirty.push_back( Page );
+			}
+		}
+		if( this->WriteBack( Dirty ) ) return true;
+		Error = CacheSaveFailed;
+		return false;
+	}
+
+	// сбрасывает и выбрасывает все страницы пула; порядок списка не важен - все слоты свободны
+	virtual bool	Invalidate()
+	{
+		for( unsigned i = 0; i < CacheSize; i++ )
+			if( Pool[i].PinCount > 0 )
+			{
+				Error = CacheAllPinned;
+				return false;
+			}
+		if( !Flush() ) return false;
+
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( Pool[i].Index >= 0 ) VMap[Pool[i].Index] = -1;
+			Pool[i].Index = -1;
+		}
+		this->ClearTier();
+		return true;
+	}
+
+	CacheError	LastError() const { return Error; }
+
+protected:
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+private:
+	typedef typename CacheBase<_T>::DirtyPage DirtyPage;
+	typedef typename CacheBase<_T>::BlockMask BlockMask;
+
+	// описание слота пула, сама страница - Pages[номер слота]: поиск жертвы и Flush
+	// идут по плотному массиву описаний, не задевая страниц
+	struct Slot
+	{
+		int	 Index;
+		BlockMask Dirty;	// грязные блоки страницы
+		unsigned PinCount;	// сколько раз страница закреплена
+		int	 Prev;	// соседи в списке LRU (индексы в Pool, -1 - нет соседа)
+		int	 Next;
+	};
+	PageBuffer< _T >         Pages;
+	vector< Slot >           Pool;
+	vector< int >            VMap;	// индекс страницы -> позиция в Pool, -1 если не загружена
+	int           Head;	// последний использованный слот
+	int           Tail;	// кандидат на вытеснение
+	CacheError    Error;
+
+	// переносим слот в голову списка
+	void	Touch( int PoolPos )
+	{
+		if( PoolPos == Head ) return;
+
+		// вынимаем из списка
+		Pool[Pool[PoolPos].Prev].Next = Pool[PoolPos].Next;
+		if( Pool[PoolPos].Next >= 0 ) Pool[Pool[PoolPos].Next].Prev = Pool[PoolPos].Prev;
+		else Tail = Pool[PoolPos].Prev;
+
+		// вставляем в голову
+		Pool[PoolPos].Prev = -1;
+		Pool[PoolPos].Next = Head;
+		Pool[Head].Prev = PoolPos;
+		Head = PoolPos;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						ClockCache
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	class _T,
+		unsigned CacheSize = 16,
+		unsigned SpaceSize = 8
+>
+class ClockCache : public CacheBase<_T>
+{
+public:
+	typedef _T DataType;
+
+	ClockCache(): Pages(CacheSize), Indexes(CacheSize, -1), DirtyMasks(CacheSize, 0), PinCounts(CacheSize, 0),
+		Referenced(CacheSize, 0), VMap(1 << SpaceSize, (int)-1)
+	{
+		Hand = 0;
+		Error = CacheOk;
+	}
+
+	virtual ~ClockCache()
+	{
+	}
+
+	_T*		GetData( unsigned Index, bool ForWrite )
+	{
+		if( Index >= VMap.size() )
+		{
+			Error = CacheBadIndex;
+			return NULL;
+		}
+
+		int PoolPos = VMap[Index];
+		if( PoolPos >= 0 )
+		{
+			this->Stats.Hit();
+			DirtyMasks[PoolPos] |= this->Blocks( ForWrite );
+			Referenced[PoolPos] = 1;
+			return &Pages[PoolPos];
+		}
+		this->Stats.Miss();
+
+		// крутим стрелку: слоты с битом обращения получают второй шанс, закреплённые пропускаем
+		// (за два оборота бит будет сброшен у всех, так что больше двух оборотов - всё закреплено)
+		for( unsigned Steps = 0; PinCounts[Hand] > 0 || (Indexes[Hand] >= 0 && Referenced[Hand]); Steps++ )
+		{
+			if( Steps == 2 * CacheSize )
+			{
+				Error = CacheAllPinned;
+				return NULL;
+			}
+			Referenced[Hand] = 0;
+			Hand = (Hand + 1) % CacheSize;
+		}
+		PoolPos = Hand;
+
+		if( Indexes[PoolPos] >= 0 )
+		{
+			if( DirtyMasks[PoolPos] )
+			{
+				if( !this->SavePage( Indexes[PoolPos], Pages[PoolPos], DirtyMasks[PoolPos] ) )
+				{
+					// ошибка сохранения страницы
+					Error = CacheSaveFailed;
+					return NULL;
+				}
+				DirtyMasks[PoolPos] = 0;
+			}
+			this->Retire( Indexes[PoolPos], Pages[PoolPos] );
+			VMap[Indexes[PoolPos]] = -1;
+			Indexes[PoolPos] = -1;
+			this->Stats.Eviction();
+		}
+
+		if( !this->LoadPage( Index, Pages[PoolPos] ) )
+		{
+			Error = CacheLoadFailed;
+			return NULL;
+		}
+
+		Indexes[PoolPos] = Index;
+		DirtyMasks[PoolPos] = this->Blocks( ForWrite );
+		Referenced[PoolPos] = 1;
+		VMap[Index] = PoolPos;
+		Hand = (Hand + 1) % CacheSize;
+		return &Pages[PoolPos];
+	}
+
+	// берёт страницу на запись, грязными помечаются только блоки, покрывающие [Offset, Offset + Size)
+	_T*		GetDataForWrite( unsigned Index, unsigned Offset, unsigned Size )
+	{
+		_T* Ptr = GetData( Index, false );
+		if( Ptr ) DirtyMasks[VMap[Index]] |= this->Blocks( Offset, Size );
+		return Ptr;
+	}
+
+	// загружает и закрепляет страницу, каждому Pin должен соответствовать Unpin
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		_T* Ptr = GetData( Index, ForWrite );
+		if( Ptr ) PinCounts[VMap[Index]]++;
+		return Ptr;
+	}
+
+	void	Unpin( unsigned Index )
+	{
+		if( Index < VMap.size() && VMap[Index] >= 0 && PinCounts[VMap[Index]] > 0 )
+			PinCounts[VMap[Index]]--;
+	}
+
+	// закрепляет страницы [Index, Index + Count) по одной, пакетной загрузки у политики нет
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		return this->PinEach( *this, Index, Count, ForWrite );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// помечает грязными блоки [Offset, Offset + Size) страницы Span[i]: страница закреплена,
+	// слот берётся из карты без поиска и без счёта попадания
+	void	MarkDirty( const PageSpan<_T>& Span, unsigned i, unsigned Offset, unsigned Size )
+	{
+		DirtyMasks[VMap[Span.GetIndex() + i]] |= this->Blocks( Offset, Size );
+	}
+
+	// сбрасывает все грязные страницы, страницы остаются в пуле
+	virtual bool	Flush()
+	{
+		vector< DirtyPage > Dirty;
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( DirtyMasks[i] && Indexes[i] >= 0 )
+			{
+				DirtyPage Page = { (unsigned)Indexes[i], &Pages[i], &DirtyMasks[i] };
+				Dirty.push_back( Page );
+			}
+		}
+		if( this->WriteBack( Dirty ) ) return true;
+		Error = CacheSaveFailed;
+		return false;
+	}
+
+	// сбрасывает и выбрасывает все страницы пула
+	virtual bool	Invalidate()
+	{
+		for( unsigned i = 0; i < CacheSize; i++ )
+			if( PinCounts[i] > 0 )
+			{
+				Error = CacheAllPinned;
+				return false;
+			}
+		if( !Flush() ) return false;
+
+		fill( Indexes.begin(), Indexes.end(), -1 );
+		fill( Referenced.begin(), Referenced.end(), 0 );
+		fill( VMap.begin(), VMap.end(), -1 );
+		this->ClearTier();
+		return true;
+	}
+
+	CacheError	LastError() const { return Error; }
+
+protected:
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+private:
+	typedef typename CacheBase<_T>::DirtyPage DirtyPage;
+	typedef typename CacheBase<_T>::BlockMask BlockMask;
+
+	// слот пула - страница Pages[i] и её описание в параллельных массивах, как в Cache:
+	// стрелка крутится по PinCounts и Referenced, не задевая страниц
+	PageBuffer< _T >         Pages;
+	vector< int >            Indexes;		// номер страницы в слоте, -1 - слот свободен
+	vector< BlockMask >      DirtyMasks;	// грязные блоки страницы
+	vector< unsigned >       PinCounts;		// сколько раз страница закреплена
+	vector< unsigned char >  Referenced;	// бит обращения для второго шанса
+	vector< int >            VMap;	// индекс страницы -> позиция в пуле, -1 если не загружена
+	unsigned      Hand;	// стрелка часов
+	CacheError    Error;
+};
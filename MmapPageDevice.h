@@ -0,0 +1,361 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include "FilePageDevice.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+/*
+	Устройство страниц поверх отображённого в память файла: Load копирует страницу
+	из отображения, Save - в отображение, а с PassThroughCache GetData отдаёт указатели
+	прямо в него (Direct), без пула и копирования. Файл тот же, что у FilePageDevice:
+	страница Index по смещению Index << PageSize.
+
+		MmapPageDevice<16,16,14,PassThroughCache>	MPD;
+		MPD.Open( "pages.bin" );
+		MPD.Advise( MmapSequential );			// подсказки ядру о доступе
+		MPD.WillNeed( 100, 32 );				// начать чтение страниц заранее
+
+		MemoryDevice<30,16,16,PassThroughCache,MmapPageDevice>	MD;
+		MD.Device().Open( "memory.bin" );
+
+	Под всё пространство страниц сразу резервируются адреса (PROT_NONE, без памяти), а файл
+	отображается в начало резерва ровно по своему размеру - открытие длину файла не меняет.
+	Обращение к странице за концом файла на запись или через Direct удлиняет файл (разреженно,
+	не меньше чем вдвое) и отображает продолжение на своё место в резерве - адреса уже отданных
+	страниц не меняются, так что PassThroughCache не нужно делать Remap. Чтение за концом файла
+	через Load даёт нули и файл не трогает; SetDirectGrowth( false ) запрещает рост и через
+	Direct - тогда PassThroughCache за концом файла отказывает, и файл только читается как есть.
+
+	В Windows резерва без placeholder-API нет: рост создаёт отображение нового размера
+	и переотображает файл на прежний адрес. Load/Save на это время ждут на GrowLock,
+	а указатели из Direct, пока идёт рост, недействительны - PassThroughCache из нескольких
+	потоков в Windows стоит открывать с SetDirectGrowth( false ) на файле нужного размера.
+
+	SetSync как у FilePageDevice: FileSyncOnFlush (по умолчанию) - Flush() делает msync
+	всего отображения, FileSyncAlways - msync каждой сохранённой страницы, FileSyncNone -
+	сброс на диск остаётся на ОС. Записи через указатели PassThroughCache доходят до диска
+	только через Flush()/Sync() или по усмотрению ОС.
+*/
+
+// подсказка ядру о порядке доступа к отображению
+enum MmapAccess
+{
+	MmapNormal,
+	MmapSequential,		// подряд: агрессивное упреждающее чтение, прочитанное можно выбрасывать
+	MmapRandom			// вразброс: упреждающее чтение не нужно
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						MmapPageDevice
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	unsigned PageSize = 16,
+	unsigned PoolSize = 16,
+	unsigned SpaceSize = 8,
+	template< class, unsigned, unsigned > class CachePolicy = Cache
+>
+class MmapPageDevice : public PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>
+{
+	typedef PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy> Base;
+	static const size_t PageBytes = sizeof(Page<PageSize>);
+	// отображение растёт кусками по 64 КБ - это кратно странице ОС и гранулярность отображения в Windows
+	static const size_t GrowBytes = PageBytes > 65536 ? PageBytes : 65536;
+	static const size_t ReserveBytes = (((size_t)PageBytes << SpaceSize) + GrowBytes - 1) / GrowBytes * GrowBytes;
+public:
+	MmapPageDevice(): File(FileIO::Invalid()), View(NULL), Mapped(0), SyncMode(FileSyncOnFlush), Access(MmapNormal), Error(0), DirectGrowth(true)
+	{
+#ifdef _WIN32
+		Mapping = NULL;
+#endif
+	}
+
+	virtual ~MmapPageDevice()
+	{
+		// сливаем кэш, пока отображение живо и Save этого устройства ещё доступен
+		this->Close();
+		Unmap();
+		if( File != FileIO::Invalid() ) FileIO::Close( File );
+	}
+
+	// открывает и отображает файл страниц, Create - создать, если его нет; устройство открывается один раз
+	bool	Open( const char* Path, bool Create = true )
+	{
+		if( File != FileIO::Invalid() ) return false;
+		File = FileIO::Open( Path, Create );
+		if( File == FileIO::Invalid() ) return Failed();
+		if( Map() ) return true;
+
+		Unmap();
+		FileIO::Close( File );
+		File = FileIO::Invalid();
+		return false;
+	}
+
+	bool	IsOpen() const
+	{
+		return File != FileIO::Invalid();
+	}
+
+	void	SetSync( FileSyncMode Mode )
+	{
+		SyncMode = Mode;
+	}
+
+	// Direct страницы за концом файла удлиняет файл (по умолчанию) или отказывает
+	void	SetDirectGrowth( bool On )
+	{
+		DirectGrowth = On;
+	}
+
+	// порядок доступа ко всему отображению, запоминается и для его будущего продолжения
+	bool	Advise( MmapAccess Hint )
+	{
+		Access = Hint;
+		return Advise( 0, Mapped.load() );
+	}
+
+	// просит ядро начать чтение страниц [Index, Index + Count), не дожидаясь обращения
+	bool	WillNeed( unsigned Index, unsigned Count )
+	{
+#ifdef _WIN32
+		return true;
+#else
+		size_t Limit = Mapped.load();
+		size_t First = (size_t)Index * PageBytes / GrowBytes * GrowBytes;
+		size_t Last = min( ((size_t)Index + Count) * PageBytes, Limit );
+		if( First >= Last ) return true;
+		if( madvise( View + First, Last - First, MADV_WILLNEED ) == 0 ) return true;
+		return Failed();
+#endif
+	}
+
+	// сбрасывает кэш и, если так настроено, доводит отображение до диска
+	virtual bool	Flush()
+	{
+		if( !Base::Flush() ) return false;
+		return SyncMode == FileSyncNone || Sync();
+	}
+
+	// доводит изменённые страницы отображения до диска
+	bool	Sync()
+	{
+		return SyncRange( 0, Mapped.load() );
+	}
+
+	// сколько байт файла сейчас отображено - до конца файла
+	unsigned long long	MappedBytes() const
+	{
+		return Mapped.load();
+	}
+
+	// код последней ошибки ОС (errno или GetLastError), 0 - ошибок не было
+	int		SystemError() const
+	{
+		return Error;
+	}
+
+protected:
+	virtual bool  Load( unsigned Index, Page<PageSize>& Ref )
+	{
+		if( File == FileIO::Invalid() || Index >= Base::__PageCount ) return false;
+		ViewGuard Guard( GrowLock );
+		// за концом файла страница ещё не сохранялась, последняя страница может быть неполной
+		size_t Offset = (size_t)Index * PageBytes;
+		size_t Limit = Mapped.load();
+		size_t Part = Offset >= Limit ? 0 : min( Limit - Offset, (size_t)PageBytes );
+		if( Part ) memcpy( &Ref, View + Offset, Part );
+		memset( (char*)&Ref + Part, 0, PageBytes - Part );
+		return true;
+	}
+
+	virtual bool  Save( unsigned Index, Page<PageSize>& Ref )
+	{
+		ViewGuard Guard( GrowLock );
+		Page<PageSize>* Target = Reach( Index );
+		if( Target == NULL ) return false;
+		memcpy( Target, &Ref, PageBytes );
+		return Saved( Index );
+	}
+
+	// переносим только изменённые участки страницы
+	virtual bool  SaveExtents( unsigned Index, Page<PageSize>& Ref, const PageExtent* Extents, unsigned Count )
+	{
+		ViewGuard Guard( GrowLock );
+		Page<PageSize>* Target = Reach( Index );
+		if( Target == NULL ) return false;
+		for( unsigned i = 0; i < Count; i++ )
+			memcpy( Target->Data + Extents[i].Offset, Ref.Data + Extents[i].Offset, Extents[i].Size );
+		return Saved( Index );
+	}
+
+	// страница прямо в отображении - для PassThroughCache; за концом файла отображение растёт,
+	// если рост через Direct не выключен
+	virtual Page<PageSize>*  Direct( unsigned Index )
+	{
+		if( !DirectGrowth && ((size_t)Index + 1) * PageBytes > Mapped.load() ) return NULL;
+		return Reach( Index );
+	}
+
+private:
+#ifdef _WIN32
+	// рост переотображает файл - обращения к отображению его ждут
+	typedef lock_guard< recursive_mutex >	ViewGuard;
+#else
+	// отображение только дополняется - обращения не ждут
+	struct ViewGuard { ViewGuard( recursive_mutex& ) {} };
+#endif
+
+	FileIO::Handle	File;
+	char*			View;		// начало резерва адресов под всё пространство
+	atomic< size_t >	Mapped;	// отображённое начало файла, до его конца; растёт под GrowLock
+	recursive_mutex	GrowLock;	// в Windows его держат и Load/Save, а Save растит отображение
+	FileSyncMode	SyncMode;
+	MmapAccess		Access;
+	atomic< int >	Error;
+	bool			DirectGrowth;
+#ifdef _WIN32
+	HANDLE			Mapping;
+#endif
+
+	bool	Failed()
+	{
+		Error = FileIO::LastError();
+		return false;
+	}
+
+	bool	Saved( unsigned Index )
+	{
+		if( SyncMode != FileSyncAlways ) return true;
+		return SyncRange( (size_t)Index * PageBytes, PageBytes );
+	}
+
+	// страница в отображении, если нужно - с ростом файла; NULL - индекс вне пространства или отказ ОС
+	Page<PageSize>*	Reach( unsigned Index )
+	{
+		if( File == FileIO::Invalid() || Index >= Base::__PageCount ) return NULL;
+		size_t End = ((size_t)Index + 1) * PageBytes;
+		if( End > Mapped.load() && !Grow( End ) ) return NULL;
+		return (Page<PageSize>*)(View + (size_t)Index * PageBytes);
+	}
+
+	// отображает файл как есть, его длина не меняется; пустой файл отобразится при росте
+	bool	Map()
+	{
+		size_t Bytes = (size_t)min( FileIO::Size( File ), (unsigned long long)ReserveBytes );
+#ifdef _WIN32
+		// отображение больше файла удлинило бы его - отображаем ровно файл
+		if( Bytes == 0 ) return true;
+		Mapping = CreateFileMappingA( File, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)Bytes >> 32), (DWORD)Bytes, NULL );
+		if( Mapping == NULL ) return Failed();
+		View = (char*)MapViewOfFile( Mapping, FILE_MAP_ALL_ACCESS, 0, 0, Bytes );
+		if( View == NULL ) return Failed();
+#else
+		void* Area = mmap( NULL, ReserveBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+		if( Area == MAP_FAILED ) return Failed();
+		View = (char*)Area;
+		// хвост последней страницы ОС за концом файла читается нулями и в файл не попадает
+		if( Bytes && mmap( View, Bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, File, 0 ) == MAP_FAILED ) return Failed();
+#endif
+		Mapped = Bytes;
+		return Access == MmapNormal || Advise( 0, Bytes );
+	}
+
+	void	Unmap()
+	{
+#ifdef _WIN32
+		if( View ) UnmapViewOfFile( View );
+		if( Mapping ) CloseHandle( Mapping );
+		Mapping = NULL;
+#else
+		if( View ) munmap( View, ReserveBytes );
+#endif
+		View = NULL;
+		Mapped = 0;
+	}
+
+	// отображает файл хотя бы до Bytes, удлиняя его; вызывается, только когда запись или Direct
+	// обращается за конец файла
+	bool	Grow( size_t Bytes )
+	{
+		lock_guard< recursive_mutex > Guard( GrowLock );
+		size_t Current = Mapped.load();
+		if( Bytes <= Current ) return true;
+
+		size_t Target = max( Bytes, Current * 2 );
+		Target = min( (Target + GrowBytes - 1) / GrowBytes * GrowBytes, (size_t)ReserveBytes );
+#ifdef _WIN32
+		// отображение нового размера само удлиняет файл; view переносим на прежний адрес,
+		// чтобы отданные Direct указатели остались верны
+		HANDLE Next = CreateFileMappingA( File, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)Target >> 32), (DWORD)Target, NULL );
+		if( Next == NULL ) return Failed();
+		if( View ) UnmapViewOfFile( View );
+		char* Moved = (char*)MapViewOfFileEx( Next, FILE_MAP_ALL_ACCESS, 0, 0, Target, View );
+		if( Moved == NULL )
+		{
+			// адрес успели занять - возвращаем прежнее отображение
+			Failed();
+			CloseHandle( Next );
+			if( View && MapViewOfFileEx( Mapping, FILE_MAP_ALL_ACCESS, 0, 0, Current, View ) == NULL )
+			{
+				View = NULL;
+				Mapped = 0;
+			}
+			return false;
+		}
+		if( Mapping ) CloseHandle( Mapping );
+		Mapping = Next;
+		View = Moved;
+		Mapped = Target;
+		return true;
+#else
+		// отображение у старого конца файла кончается на странице ОС, продолжение - сразу за ней
+		size_t From = (Current + SystemPage() - 1) / SystemPage() * SystemPage();
+		if( FileIO::Size( File ) < Target && !FileIO::Resize( File, Target ) ) return Failed();
+		if( Target > From && mmap( View + From, Target - From, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, File, (off_t)From ) == MAP_FAILED )
+			return Failed();
+
+		Mapped = Target;
+		return Access == MmapNormal || Advise( From, Target - From );
+#endif
+	}
+
+#ifndef _WIN32
+	static size_t	SystemPage()
+	{
+		static const size_t Size = (size_t)sysconf( _SC_PAGESIZE );
+		return Size;
+	}
+#endif
+
+	bool	Advise( size_t Offset, size_t Bytes )
+	{
+#ifdef _WIN32
+		return true;
+#else
+		if( Bytes == 0 ) return true;
+		int Flag = Access == MmapSequential ? MADV_SEQUENTIAL : Access == MmapRandom ? MADV_RANDOM : MADV_NORMAL;
+		if( madvise( View + Offset, Bytes, Flag ) == 0 ) return true;
+		return Failed();
+#endif
+	}
+
+	bool	SyncRange( size_t Offset, size_t Bytes )
+	{
+		ViewGuard Guard( GrowLock );
+		if( View == NULL ) return true;
+		size_t First = Offset / GrowBytes * GrowBytes;
+		Bytes += Offset - First;
+		if( Bytes == 0 ) return true;
+#ifdef _WIN32
+		if( FlushViewOfFile( View + First, Bytes ) && FileIO::Sync( File ) ) return true;
+#else
+		if( msync( View + First, Bytes, MS_SYNC ) == 0 ) return true;
+#endif
+		return Failed();
+	}
+};
@@ -0,0 +1,432 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string.h>
+#include "PageDevice.h"
+
+using namespace std;
+/*
+	Шардированная политика кэширования с чтением без блокировок.
+	Устройство как у ShardedCache (шард = Index % ShardCount, свой мьютекс, пул и карта,
+	страницы всех шардов - участками одного PageBuffer), но попадание на чтение мьютекс
+	не берёт и в общую память ничего не пишет:
+
+		1. атомарно читаем слот страницы из карты шарда;
+		2. читаем версию слота - чётная версия значит, что слот сейчас не перезагружается;
+		3. проверяем, что в слоте по-прежнему наша страница, и перечитываем версию.
+
+	Вытеснение (под мьютексом шарда) делает версию нечётной на время Save/Load и снова
+	чётной после, поэтому читатель, попавший на перезагрузку, уходит на путь с блокировкой.
+	Запись, промахи, Pin/Unpin и Flush идут под мьютексом шарда.
+	При CACHE_STATS попадание всё же увеличивает атомарный счётчик своего шарда,
+	для замеров без этой записи собирайте без CACHE_STATS.
+
+	Указатель из GetData без Pin может быть отдан другой странице промахом соседнего потока.
+	Read() копирует данные страницы оптимистично: копирует, сверяет версию и при гонке
+	повторяет копирование под мьютексом - это безопасное чтение без закрепления.
+	Версию меняют только перезагрузка слота и Write(), поэтому целую страницу Read() видит
+	лишь при записи через Write(). Запись через указатель из GetData/GetDataForWrite/Pin версию
+	не трогает: читатель, который копирует страницу одновременно с ней, может получить часть
+	старых и часть новых байт.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						OptimisticCacheN
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	class _T,
+		unsigned CacheSize = 16,
+		unsigned SpaceSize = 8,
+		unsigned ShardCount = 8
+>
+class OptimisticCacheN : public CacheBase<_T>
+{
+public:
+	typedef _T DataType;
+
+	// слотов в шарде; остаток CacheSize % ShardCount достаётся первым шардам по одному слоту
+	static const unsigned ShardSize = CacheSize / ShardCount;
+	static const unsigned ShardSpace = ((1 << SpaceSize) + ShardCount - 1) / ShardCount;
+
+	OptimisticCacheN(): Pages(CacheSize)
+	{
+		static_assert( ShardSize > 0, "CacheSize must be at least ShardCount" );
+		for( unsigned s = 0, First = 0; s < ShardCount; s++ )
+		{
+			Shards[s].Size = ShardSize + (s < CacheSize % ShardCount ? 1 : 0);
+			Shards[s].Pages = &Pages[First];
+			First += Shards[s].Size;
+			Shards[s].Pool.reset( new Slot[Shards[s].Size] );
+			Shards[s].VMap.reset( new atomic<int>[ShardSpace] );
+			Shards[s].LastLoadedIndex = -1;
+			Shards[s].Error = CacheOk;
+			// Проинициализируем пул и карту шарда
+			for( unsigned i = 0; i < Shards[s].Size; i++ )
+			{
+				Shards[s].Pool[i].Index.store( -1 );
+				Shards[s].Pool[i].Version.store( 0 );
+				Shards[s].Pool[i].Dirty = 0;
+				Shards[s].Pool[i].PinCount = 0;
+			}
+			for( unsigned i = 0; i < ShardSpace; i++ )
+				Shards[s].VMap[i].store( -1 );
+		}
+	}
+
+	virtual ~OptimisticCacheN()
+	{
+		// сливает кэш деструктор устройства через Close()
+	}
+
+	_T*		GetData( unsigned Index, bool ForWrite )
+	{
+		if( Index >= (1u << SpaceSize) )
+		{
+			ThreadError = CacheBadIndex;
+			return NULL;
+		}
+		Shard& S = Shards[Index % ShardCount];
+
+		if( !ForWrite )
+		{
+			unsigned Version;
+			int PoolPos = Lookup( S, Index, Version );
+			if( PoolPos >= 0 )
+			{
+				S.Stats.Hit();
+				return &S.Pages[PoolPos];
+			}
+		}
+
+		lock_guard< mutex > Guard( S.Lock );
+		return Fetch( S, Index, this->Blocks( ForWrite ) );
+	}
+
+	// берёт страницу на запись, грязными помечаются только блоки, покрывающие [Offset, Offset + Size)
+	_T*		GetDataForWrite( unsigned Index, unsigned Offset, unsigned Size )
+	{
+		if( Index >= (1u << SpaceSize) )
+		{
+			ThreadError = CacheBadIndex;
+			return NULL;
+		}
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		return Fetch( S, Index, this->Blocks( Offset, Size ) );
+	}
+
+	// копирует Size байт страницы Index со смещения Offset без закрепления страницы
+	bool	Read( unsigned Index, unsigned Offset, void* Data, unsigned Size )
+	{
+		if( Index >= (1u << SpaceSize) || Offset + Size > sizeof(_T) ) return false;
+		Shard& S = Shards[Index % ShardCount];
+
+		unsigned Version;
+		int PoolPos = Lookup( S, Index, Version );
+		if( PoolPos >= 0 )
+		{
+			memcpy( Data, (unsigned char*)&S.Pages[PoolPos] + Offset, Size );
+			atomic_thread_fence( memory_order_acquire );
+			if( S.Pool[PoolPos].Version.load( memory_order_relaxed ) == Version )
+			{
+				S.Stats.Hit();
+				return true;
+			}
+		}
+
+		// промах или слот перезагрузили во время копирования
+		lock_guard< mutex > Guard( S.Lock );
+		_T* Ptr = Fetch( S, Index, 0 );
+		if( !Ptr ) return false;
+		memcpy( Data, (unsigned char*)Ptr + Offset, Size );
+		return true;
+	}
+
+	// копирует Size байт в страницу Index со смещения Offset; на время копирования версия
+	// слота нечётная, так что Read() не вернёт наполовину записанных данных
+	bool	Write( unsigned Index, unsigned Offset, const void* Data, unsigned Size )
+	{
+		if( Index >= (1u << SpaceSize) || Offset + Size > sizeof(_T) ) return false;
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		_T* Ptr = Fetch( S, Index, this->Blocks( Offset, Size ) );
+		if( !Ptr ) return false;
+
+		Slot& Written = S.Pool[S.VMap[Index / ShardCount].load( memory_order_relaxed )];
+		Written.Version.fetch_add( 1, memory_order_acq_rel );
+		atomic_thread_fence( memory_order_release );
+		memcpy( (unsigned char*)Ptr + Offset, Data, Size );
+		Written.Version.fetch_add( 1, memory_order_release );
+		return true;
+	}
+
+	// загружает и закрепляет страницу, каждому Pin должен соответствовать Unpin
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		if( Index >= (1u << SpaceSize) )
+		{
+			ThreadError = CacheBadIndex;
+			return NULL;
+		}
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		_T* Ptr = Fetch( S, Index, this->Blocks( ForWrite ) );
+		if( Ptr ) S.Pool[S.VMap[Index / ShardCount].load( memory_order_relaxed )].PinCount++;
+		return Ptr;
+	}
+
+	void	Unpin( unsigned Index )
+	{
+		if( Index >= (1u << SpaceSize) ) return;
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		int PoolPos = S.VMap[Index / ShardCount].load( memory_order_relaxed );
+		if( PoolPos >= 0 && S.Pool[PoolPos].PinCount > 0 ) S.Pool[PoolPos].PinCount--;
+	}
+
+	// закрепляет страницы [Index, Index + Count) по одной, пакетной загрузки у политики нет
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		return this->PinEach( *this, Index, Count, ForWrite );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// помечает грязными блоки [Offset, Offset + Size) страницы Span[i]: страница закреплена,
+	// слот берётся из карты без поиска и без счёта попадания
+	void	MarkDirty( const PageSpan<_T>& Span, unsigned i, unsigned Offset, unsigned Size )
+	{
+		unsigned Index = Span.GetIndex() + i;
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		S.Pool[S.VMap[Index / ShardCount].load( memory_order_relaxed )].Dirty |= this->Blocks( Offset, Size );
+	}
+
+	virtual bool	Flush()
+	{
+		// все шарды сразу и всегда в одном порядке, как в ShardedCache
+		unsigned s;
+		for( s = 0; s < ShardCount; s++ ) Shards[s].Lock.lock();
+		bool Result = WriteBackAll();
+		for( s = ShardCount; s-- > 0; ) Shards[s].Lock.unlock();
+		return Result;
+	}
+
+	// сбрасывает и выбрасывает все страницы всех шардов; версия слота на это время нечётная,
+	// так что читатель без блокировки уходит на путь с мьютексом
+	virtual bool	Invalidate()
+	{
+		unsigned s, i;
+		for( s = 0; s < ShardCount; s++ ) Shards[s].Lock.lock();
+
+		bool Result = true;
+		for( s = 0; s < ShardCount && Result; s++ )
+			for( i = 0; i < Shards[s].Size && Result; i++ )
+				if( Shards[s].Pool[i].PinCount > 0 )
+				{
+					ThreadError = CacheAllPinned;
+					Result = false;
+				}
+		if( Result && !WriteBackAll() )
+		{
+			ThreadError = CacheSaveFailed;
+			Result = false;
+		}
+
+		if( Result )
+		{
+			for( s = 0; s < ShardCount; s++ )
+			{
+				for( i = 0; i < Shards[s].Size; i++ )
+				{
+					Slot& Held = Shards[s].Pool[i];
+					int Index = Held.Index.load( memory_order_relaxed );
+					if( Index < 0 ) continue;
+					Held.Version.fetch_add( 1, memory_order_acq_rel );
+					Shards[s].VMap[Index / ShardCount].store( -1, memory_order_relaxed );
+					Held.Index.store( -1, memory_order_relaxed );
+					Held.Version.fetch_add( 1, memory_order_release );
+				}
+				Shards[s].LastLoadedIndex = -1;
+			}
+			this->ClearTier();
+		}
+
+		for( s = ShardCount; s-- > 0; ) Shards[s].Lock.unlock();
+		return Result;
+	}
+
+	virtual CacheStatistics	Statistics() const
+	{
+		CacheStatistics Result = CacheBase<_T>::Statistics();
+		for( unsigned s = 0; s < ShardCount; s++ ) Shards[s].Stats.AddTo( Result );
+		return Result;
+	}
+
+	virtual void	ResetStatistics()
+	{
+		CacheBase<_T>::ResetStatistics();
+		for( unsigned s = 0; s < ShardCount; s++ ) Shards[s].Stats.Reset();
+	}
+
+	// ошибка последнего отказа в шарде страницы Index
+	CacheError	LastError( unsigned Index ) const
+	{
+		return Index < (1u << SpaceSize) ? Shards[Index % ShardCount].Error : CacheBadIndex;
+	}
+
+	// ошибка последнего отказа в этом потоке - у серии GetDataRange страницы в разных шардах
+	CacheError	LastError() const
+	{
+		return ThreadError;
+	}
+
+protected:
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+private:
+	typedef typename CacheBase<_T>::DirtyPage DirtyPage;
+	typedef typename CacheBase<_T>::BlockMask BlockMask;
+
+	// описание слота пула, сама страница - Pages[номер слота] шарда
+	struct Slot
+	{
+		atomic<int>      Index;
+		atomic<unsigned> Version;	// нечётная - слот перезагружается
+		BlockMask Dirty;	// грязные блоки страницы
+		unsigned PinCount;	// сколько раз страница закреплена
+	};
+
+	// шарды не делят строку кэша с соседями: между ними Pad в целую строку. Не alignas -
+	// до C++17 new не обязан выравнивать объект устройства сильнее, чем на 16 байт
+	struct Shard
+	{
+		mutex         Lock;
+		unsigned      Size;	// слотов в пуле шарда
+		_T*           Pages;	// страницы шарда - его участок общего буфера
+		unique_ptr< Slot[] >           Pool;
+		unique_ptr< atomic<int>[] >    VMap;	// Index / ShardCount -> позиция в пуле шарда, -1 если не загружена
+		int           LastLoadedIndex;
+		CacheError    Error;
+		CacheCounters< sizeof(_T) >	Stats;	// попадания, промахи и вытеснения шарда
+		char          Pad[64];
+	};
+	PageBuffer< _T >         Pages;	// страницы всех шардов подряд, по участку на шард
+	Shard         Shards[ShardCount];
+	static thread_local CacheError	ThreadError;
+
+	// грязные страницы всех шардов одним WriteBack, вызывается под всеми мьютексами
+	bool	WriteBackAll()
+	{
+		vector< DirtyPage > Dirty;
+		for( unsigned s = 0; s < ShardCount; s++ )
+		{
+			for( unsigned i = 0; i < Shards[s].Size; i++ )
+			{
+				Slot& Held = Shards[s].Pool[i];
+				if( !Held.Dirty ) continue;
+				int Index = Held.Index.load( memory_order_relaxed );
+				if( Index >= 0 )
+				{
+					DirtyPage Page = { (unsigned)Index, &Shards[s].Pages[i], &Held.Dirty };
+					Dirty.push_back( Page );
+				}
+			}
+		}
+		return this->WriteBack( Dirty );
+	}
+
+	// попадание без блокировки: только атомарные чтения; позиция в пуле шарда,
+	// -1 - идти на путь с мьютексом
+	int		Lookup( Shard& S, unsigned Index, unsigned& Version )
+	{
+		int PoolPos = S.VMap[Index / ShardCount].load( memory_order_acquire );
+		if( PoolPos < 0 ) return -1;
+
+		Slot& Held = S.Pool[PoolPos];
+		Version = Held.Version.load( memory_order_acquire );
+		if( Version & 1 ) return -1;
+		if( Held.Index.load( memory_order_acquire ) != (int)Index ) return -1;
+		if( Held.Version.load( memory_order_acquire ) != Version ) return -1;
+		return PoolPos;
+	}
+
+	// то же, что Cache::GetData, в пределах шарда и под его мьютексом; Written - блоки под запись
+	_T*		Fetch( Shard& S, unsigned Index, BlockMask Written )
+	{
+		atomic<int>& Mapped = S.VMap[Index / ShardCount];
+		int PoolPos = Mapped.load( memory_order_relaxed );
+		if( PoolPos >= 0 )
+		{
+			S.Stats.Hit();
+			S.Pool[PoolPos].Dirty |= Written;
+			return &S.Pages[PoolPos];
+		}
+		S.Stats.Miss();
+
+		// найдём место для загрузки, закреплённые слоты пропускаем
+		PoolPos = (S.LastLoadedIndex + 1) % S.Size;
+		for( unsigned Tries = 1; S.Pool[PoolPos].PinCount > 0; Tries++ )
+		{
+			if( Tries == S.Size )
+			{
+				S.Error = ThreadError = CacheAllPinned;
+				return NULL;
+			}
+			PoolPos = (PoolPos + 1) % S.Size;
+		}
+
+		Slot& Victim = S.Pool[PoolPos];
+		_T& Page = S.Pages[PoolPos];
+		int OldIndex = Victim.Index.load( memory_order_relaxed );
+		if( OldIndex >= 0 && Victim.Dirty )
+		{
+			if( !this->SavePage( OldIndex, Page, Victim.Dirty ) )
+			{
+				// ошибка сохранения страницы
+				S.Error = ThreadError = CacheSaveFailed;
+				return NULL;
+			}
+			Victim.Dirty = 0;
+		}
+
+		// дальше данные слота меняются - читатели без блокировки должны это увидеть
+		Victim.Version.fetch_add( 1, memory_order_acq_rel );
+		if( OldIndex >= 0 )
+		{
+			this->Retire( OldIndex, Page );
+			S.VMap[OldIndex / ShardCount].store( -1, memory_order_relaxed );
+			S.Stats.Eviction();
+		}
+		Victim.Index.store( -1, memory_order_relaxed );
+		atomic_thread_fence( memory_order_release );
+
+		if( !this->LoadPage( Index, Page ) )
+		{
+			Victim.Version.fetch_add( 1, memory_order_release );
+			S.Error = ThreadError = CacheLoadFailed;
+			return NULL;
+		}
+
+		Victim.Index.store( Index, memory_order_relaxed );
+		Victim.Dirty = Written;
+		Victim.Version.fetch_add( 1, memory_order_release );
+		S.LastLoadedIndex = PoolPos;
+		Mapped.store( PoolPos, memory_order_release );
+		return &Page;
+	}
+};
+
+template< class _T, unsigned CacheSize, unsigned SpaceSize, unsigned ShardCount >
+thread_local CacheError OptimisticCacheN<_T, CacheSize, SpaceSize, ShardCount>::ThreadError = CacheOk;
+
+// политика с 8 шардами для параметра CachePolicy
+template< class _T, unsigned CacheSize = 16, unsigned SpaceSize = 8 >
+using OptimisticCache = OptimisticCacheN< _T, CacheSize, SpaceSize, 8 >;
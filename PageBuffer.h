@@ -0,0 +1,111 @@
+#pragma once
+#include <stddef.h>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+/*
+	Память под страницы пула: PageCount объектов _T подряд. Страница размером в степень двойки
+	выровнена на свой размер (от 4 КБ до 2 МБ), так что она не пересекает лишних страниц TLB
+	и годится как буфер для O_DIRECT; страницы другого размера - только начало буфера на 4 КБ.
+
+	В Linux память берётся через mmap. Если буфер не меньше 2 МБ, он выравнивается на 2 МБ
+	и помечается madvise( MADV_HUGEPAGE ) - ядро может отдать его прозрачными большими страницами.
+	При определённом CACHE_HUGE_PAGES сначала пробуется MAP_HUGETLB (нужны выделенные
+	в системе большие страницы), при отказе - обычный путь.
+	В Windows - _aligned_malloc, большие страницы там требуют привилегии и не используются.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						PageBuffer
+///////////////////////////////////////////////////////////////////////////////
+
+template< class _T >
+class PageBuffer
+{
+public:
+	static const size_t HugePage = 2 << 20;
+
+	explicit PageBuffer( size_t PageCount ): Base(NULL), Mapped(0), Count(0), Data(NULL)
+	{
+		size_t Bytes = PageCount * sizeof(_T);
+		size_t Align = Alignment();
+		if( Bytes >= HugePage ) Align = HugePage;
+		Bytes = (Bytes + Align - 1) / Align * Align;
+
+		Data = (_T*)Allocate( Bytes, Align );
+		if( Data == NULL ) throw bad_alloc();
+		Count = PageCount;
+		for( size_t i = 0; i < Count; i++ ) new( &Data[i] ) _T;
+	}
+
+	~PageBuffer()
+	{
+		for( size_t i = 0; i < Count; i++ ) Data[i].~_T();
+#ifdef _WIN32
+		_aligned_free( Base );
+#else
+		munmap( Base, Mapped );
+#endif
+	}
+
+	_T&		operator[]( size_t i ) { return Data[i]; }
+	const _T&	operator[]( size_t i ) const { return Data[i]; }
+	size_t	Size() const { return Count; }
+
+	// выравнивание начала буфера и страниц в нём
+	static size_t	Alignment()
+	{
+		size_t Align = 4096;
+		while( Align < sizeof(_T) && Align < HugePage ) Align <<= 1;
+		return sizeof(_T) % Align == 0 ? Align : 4096;
+	}
+
+private:
+	void*		Base;		// начало выделенной области
+	size_t		Mapped;		// её размер
+	size_t		Count;
+	_T*			Data;
+
+	PageBuffer( const PageBuffer& );
+	PageBuffer& operator=( const PageBuffer& );
+
+	void*	Allocate( size_t Bytes, size_t Align )
+	{
+#ifdef _WIN32
+		Base = _aligned_malloc( Bytes, Align );
+		Mapped = Bytes;
+		return Base;
+#else
+#if defined(CACHE_HUGE_PAGES) && defined(MAP_HUGETLB)
+		if( Align == HugePage )
+		{
+			Base = mmap( NULL, Bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+			if( Base != MAP_FAILED )
+			{
+				Mapped = Bytes;
+				return Base;
+			}
+		}
+#endif
+		// mmap выравнивает только на 4 КБ - берём с запасом и обрезаем края
+		size_t Extra = Align > 4096 ? Align : 0;
+		char* Area = (char*)mmap( NULL, Bytes + Extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if( Area == (char*)MAP_FAILED ) return NULL;
+
+		char* Aligned = (char*)(((size_t)Area + Align - 1) / Align * Align);
+		if( Aligned > Area ) munmap( Area, Aligned - Area );
+		if( Area + Bytes + Extra > Aligned + Bytes ) munmap( Aligned + Bytes, Area + Bytes + Extra - (Aligned + Bytes) );
+		Base = Aligned;
+		Mapped = Bytes;
+#ifdef MADV_HUGEPAGE
+		if( Align == HugePage ) madvise( Base, Mapped, MADV_HUGEPAGE );
+#endif
+		return Base;
+#endif
+	}
+};
@@ -0,0 +1,171 @@
+#pragma once
+#include <string.h>
+
+/*
+	Быстрое LZ-сжатие страниц для сжатого второго уровня кэша (CompressedTier).
+	Формат как у блока LZ4: последовательности «литералы + совпадение»,
+
+		токен		- старшие 4 бита: длина литералов, младшие: длина совпадения - 4
+					  (15 в поле - длина продолжается байтами до первого байта меньше 255);
+		литералы;
+		смещение	- 2 байта, младший первым, совпадение не дальше 64 КБ назад;
+		продолжение длины совпадения.
+
+	Последняя последовательность - только литералы. Совпадения ищутся по хешу четырёх байт
+	без цепочек: степень сжатия ниже, чем у zlib, зато сжатие - сотни МБ/с, а распаковка
+	ещё в несколько раз быстрее.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						LZCompress / LZDecompress
+///////////////////////////////////////////////////////////////////////////////
+
+namespace PageCodec
+{
+	const unsigned MinMatch = 4;
+	const unsigned LastLiterals = 5;	// хвост, который всегда идёт литералами
+	const unsigned HashBits = 12;
+	const unsigned MaxOffset = 65535;
+
+	inline unsigned	Read32( const unsigned char* p )
+	{
+		unsigned v;
+		memcpy( &v, p, 4 );
+		return v;
+	}
+
+	inline unsigned	Hash( unsigned Sequence )
+	{
+		return (Sequence * 2654435761u) >> (32 - HashBits);
+	}
+
+	// длина в формате токена: Value уже уменьшено на то, что влезло в поле
+	inline bool	PutLength( unsigned char*& Out, unsigned char* End, unsigned Value )
+	{
+		for( ; Value >= 255; Value -= 255 )
+		{
+			if( Out == End ) return false;
+			*Out++ = 255;
+		}
+		if( Out == End ) return false;
+		*Out++ = (unsigned char)Value;
+		return true;
+	}
+
+	inline bool	PutSequence( unsigned char*& Out, unsigned char* End, const unsigned char* Literals,
+		unsigned LiteralCount, unsigned Offset, unsigned MatchLength )
+	{
+		if( Out == End ) return false;
+		unsigned char* Token = Out++;
+		*Token = (unsigned char)((LiteralCount < 15 ? LiteralCount : 15) << 4);
+		if( LiteralCount >= 15 && !PutLength( Out, End, LiteralCount - 15 ) ) return false;
+
+		if( (unsigned)(End - Out) < LiteralCount ) return false;
+		memcpy( Out, Literals, LiteralCount );
+		Out += LiteralCount;
+		if( MatchLength == 0 ) return true;
+
+		if( End - Out < 2 ) return false;
+		*Out++ = (unsigned char)Offset;
+		*Out++ = (unsigned char)(Offset >> 8);
+		MatchLength -= MinMatch;
+		*Token |= (unsigned char)(MatchLength < 15 ? MatchLength : 15);
+		return MatchLength < 15 || PutLength( Out, End, MatchLength - 15 );
+	}
+}
+
+// сжимает Size байт из In в Out, возвращает размер сжатых данных или 0, если в Capacity байт не влезло
+inline unsigned	LZCompress( const unsigned char* In, unsigned Size, unsigned char* Out, unsigned Capacity )
+{
+	using namespace PageCodec;
+	unsigned Table[1 << HashBits];	// позиция + 1 последней четвёрки байт с этим хешем, 0 - не было
+	memset( Table, 0, sizeof(Table) );
+
+	unsigned char* Op = Out;
+	unsigned char* End = Out + Capacity;
+	unsigned Anchor = 0;
+	unsigned Limit = Size > MinMatch + LastLiterals ? Size - LastLiterals - MinMatch : 0;
+
+	for( unsigned Ip = 0; Ip < Limit; )
+	{
+		unsigned Sequence = Read32( In + Ip );
+		unsigned h = Hash( Sequence );
+		unsigned Ref = Table[h];
+		Table[h] = Ip + 1;
+
+		if( Ref == 0 || Ip - (Ref - 1) > MaxOffset || Read32( In + Ref - 1 ) != Sequence )
+		{
+			Ip++;
+			continue;
+		}
+		Ref--;
+
+		unsigned Length = MinMatch;
+		while( Ip + Length < Size - LastLiterals && In[Ref + Length] == In[Ip + Length] ) Length++;
+
+		if( !PutSequence( Op, End, In + Anchor, Ip - Anchor, Ip - Ref, Length ) ) return 0;
+		Ip += Length;
+		Anchor = Ip;
+	}
+
+	if( !PutSequence( Op, End, In + Anchor, Size - Anchor, 0, 0 ) ) return 0;
+	return (unsigned)(Op - Out);
+}
+
+// распаковывает ровно Size байт в Out, false - данные повреждены
+inline bool	LZDecompress( const unsigned char* In, unsigned InSize, unsigned char* Out, unsigned Size )
+{
+	using namespace PageCodec;
+	const unsigned char* Ip = In;
+	const unsigned char* InEnd = In + InSize;
+	unsigned char* Op = Out;
+	unsigned char* OutEnd = Out + Size;
+
+	while( Ip < InEnd )
+	{
+		unsigned Token = *Ip++;
+		size_t Literals = Token >> 4;
+		if( Literals == 15 )
+		{
+			unsigned char b;
+			do
+			{
+				if( Ip == InEnd ) return false;
+				b = *Ip++;
+				Literals += b;
+			} while( b == 255 );
+		}
+		if( (size_t)(InEnd - Ip) < Literals || (size_t)(OutEnd - Op) < Literals ) return false;
+		memcpy( Op, Ip, Literals );
+		Ip += Literals;
+		Op += Literals;
+		if( Ip == InEnd ) break;
+
+		if( InEnd - Ip < 2 ) return false;
+		size_t Offset = Ip[0] | (Ip[1] << 8);
+		Ip += 2;
+		if( Offset == 0 || Offset > (size_t)(Op - Out) ) return false;
+
+		size_t Length = (Token & 15) + MinMatch;
+		if( (Token & 15) == 15 )
+		{
+			unsigned char b;
+			do
+			{
+				if( Ip == InEnd ) return false;
+				b = *Ip++;
+				Length += b;
+			} while( b == 255 );
+		}
+		if( (size_t)(OutEnd - Op) < Length ) return false;
+
+		// совпадение может перекрывать само себя - короткие смещения копируем побайтно
+		const unsigned char* Match = Op - Offset;
+		if( Offset >= 8 )
+		{
+			for( ; Length >= 8; Length -= 8, Op += 8, Match += 8 ) memcpy( Op, Match, 8 );
+		}
+		while( Length-- ) *Op++ = *Match++;
+	}
+	return Op == OutEnd;
+}
@@ -1,5 +1,12 @@
 #pragma once 
 #include <vector>
+#include <algorithm>
+#ifdef CACHE_STATS
+#include <atomic>
+#endif
+#include <memory>
+#include "PageBuffer.h"
+#include "CompressedTier.h"
 
 using namespace std;
 /*
@@ -10,91 +17,911 @@ using namespace std;
 		3. Управление пулом закэшированных страниц
 */
 
+// причина последнего отказа GetData/Pin
+enum CacheError
+{
+	CacheOk = 0,
+	CacheBadIndex,		// номер страницы вне адресного пространства
+	CacheAllPinned,		// все слоты пула закреплены, вытеснять некого
+	CacheSaveFailed,	// не удалось сохранить вытесняемую страницу
+	CacheLoadFailed		// не удалось загрузить страницу
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						CacheCounters
+///////////////////////////////////////////////////////////////////////////////
+
+// снимок счётчиков кэша
+struct CacheStatistics
+{
+	unsigned long long	Hits;
+	unsigned long long	Misses;
+	unsigned long long	Evictions;		// страниц вытеснено из пула
+	unsigned long long	WriteBacks;		// грязных страниц сохранено (при вытеснении, Flush, фоновом сбросе)
+	unsigned long long	LoadFailures;
+	unsigned long long	SaveFailures;
+	unsigned long long	BytesLoaded;
+	unsigned long long	BytesSaved;		// только грязные участки страниц, см. CacheBase::SaveExtents
+};
+
+// изменённый участок страницы для CacheBase::SaveExtents
+struct PageExtent
+{
+	unsigned	Offset;
+	unsigned	Size;
+};
+
+/*
+	Счётчики политики кэширования. Собираются только при определённом CACHE_STATS
+	(в проекте - в Debug), иначе все методы пустые и компилятор их выбрасывает.
+	Счётчики - атомики с memory_order_relaxed: из разных потоков их можно увеличивать
+	без блокировок, а порядок между ними не важен.
+*/
+template< unsigned PageBytes >
+class CacheCounters
+{
+#ifdef CACHE_STATS
+	enum { HitCount, MissCount, EvictionCount, LoadedPages, SavedPages, SavedBytes, LoadFailures, SaveFailures, CounterCount };
+	atomic<unsigned long long>	Counts[CounterCount];
+
+	void	Add( int Which, unsigned long long N ) { Counts[Which].fetch_add( N, memory_order_relaxed ); }
+	unsigned long long	Get( int Which ) const { return Counts[Which].load( memory_order_relaxed ); }
+public:
+	CacheCounters() { Reset(); }
+
+	void	Hit() { Add( HitCount, 1 ); }
+	void	Miss() { Add( MissCount, 1 ); }
+	void	Eviction() { Add( EvictionCount, 1 ); }
+	void	Loaded( unsigned Pages ) { Add( LoadedPages, Pages ); }
+	void	Saved( unsigned Pages ) { Saved( Pages, (unsigned long long)Pages * PageBytes ); }
+	void	Saved( unsigned Pages, unsigned long long Bytes ) { Add( SavedPages, Pages ); Add( SavedBytes, Bytes ); }
+	void	LoadFailed() { Add( LoadFailures, 1 ); }
+	void	SaveFailed() { Add( SaveFailures, 1 ); }
+
+	void	Reset()
+	{
+		for( int i = 0; i < CounterCount; i++ ) Counts[i].store( 0, memory_order_relaxed );
+	}
+
+	// прибавляет счётчики к снимку (политики с несколькими наборами счётчиков их суммируют)
+	void	AddTo( CacheStatistics& Stats ) const
+	{
+		Stats.Hits += Get( HitCount );
+		Stats.Misses += Get( MissCount );
+		Stats.Evictions += Get( EvictionCount );
+		Stats.WriteBacks += Get( SavedPages );
+		Stats.LoadFailures += Get( LoadFailures );
+		Stats.SaveFailures += Get( SaveFailures );
+		Stats.BytesLoaded += Get( LoadedPages ) * PageBytes;
+		Stats.BytesSaved += Get( SavedBytes );
+	}
+#else
+public:
+	void	Hit() {}
+	void	Miss() {}
+	void	Eviction() {}
+	void	Loaded( unsigned ) {}
+	void	Saved( unsigned ) {}
+	void	Saved( unsigned, unsigned long long ) {}
+	void	LoadFailed() {}
+	void	SaveFailed() {}
+	void	Reset() {}
+	void	AddTo( CacheStatistics& ) const {}
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						PageSpan
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+	Закреплённые подряд идущие страницы [GetIndex(), GetIndex() + Size()) из GetDataRange.
+	Пустой span - отказ, причина в LastError(). Страницы остаются закреплёнными,
+	пока span не отдан обратно в UnpinRange того же кэша.
+
+		PageSpan< Page<16> > Span = SPD.GetDataRange( 10, 4, false );
+		for( unsigned i = 0; i < Span.Size(); i++ ) Use( Span[i]->Data );
+		memcpy( Span[1]->Data + 100, Data, 8 );
+		SPD.MarkDirty( Span, 1, 100, 8 );		// грязными - только блоки записанного
+		SPD.UnpinRange( Span );
+*/
+template< class _T >
+class PageSpan
+{
+public:
+	PageSpan(): First(0) {}
+
+	// забирает указатели из Refs
+	PageSpan( unsigned Index, vector< _T* >& Refs ): First(Index)
+	{
+		Pages.swap( Refs );
+	}
+
+	_T*			operator[]( unsigned i ) const { return Pages[i]; }
+	unsigned	Size() const { return (unsigned)Pages.size(); }
+	unsigned	GetIndex() const { return First; }
+	bool		Empty() const { return Pages.empty(); }
+	operator	bool() const { return !Pages.empty(); }
+
+	_T* const*	begin() const { return Pages.empty() ? NULL : &Pages[0]; }
+	_T* const*	end() const { return begin() + Pages.size(); }
+
+private:
+	vector< _T* >	Pages;
+	unsigned		First;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						CacheBase
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+	Общая часть всех политик кэширования: интерфейс хранилища, счётчики и сброс грязных страниц.
+	Политика собирает свои грязные слоты в DirtyPage и отдаёт их WriteBack, который
+	пишет их по возрастанию номеров, склеивая соседние номера в один вызов SaveRange.
+	Одиночные страницы политики грузят и сохраняют через LoadPage/SavePage - они ведут счётчики.
+
+	Грязной страница бывает не целиком: слот хранит маску грязных блоков по BlockBytes байт
+	(4 КБ, для страниц больше 256 КБ - 1/64 страницы). GetData( Index, true ) помечает всю
+	страницу, GetDataForWrite( Index, Offset, Size ) - только блоки, покрывающие запись.
+	Целиком грязные страницы сохраняются через Save/SaveRange, остальные - через SaveExtents
+	списком изменённых участков.
+
+	SetSecondTier включает под пулом сжатый второй уровень (CompressedTier): политика отдаёт
+	ему вытесненные страницы через Retire, а LoadPage/LoadPages сначала ищут страницу там.
+
+	Асинхронное хранилище (UringPageDevice) получает обращения пакетами: между BeginBatch
+	и EndBatch оно может только ставить их в очередь и выполнить все вместе в EndBatch.
+	Пакетами идут WriteBack, упреждающее чтение и GetDataRange у Cache, сброс у WritebackCache -
+	там десятки обращений одновременно в полёте. Одиночные LoadPage/SavePage и вытеснение
+	по-прежнему синхронны.
+*/
+template< class _T >
+class CacheBase
+{
+public:
+	// маска грязных блоков страницы, 0 - страница чистая
+	typedef unsigned long long BlockMask;
+
+	static const unsigned BlockBytes = sizeof(_T) / 64 > 4096 ? sizeof(_T) / 64 : 4096;
+	static const unsigned BlockCount = (sizeof(_T) + BlockBytes - 1) / BlockBytes;
+	static const BlockMask AllBlocks = BlockCount == 64 ? ~0ull : (1ull << BlockCount) - 1;
+
+	virtual ~CacheBase()
+	{
+	}
+
+	// сбрасывает все грязные страницы, страницы остаются в пуле
+	virtual bool	Flush() = 0;
+
+	// сбрасывает грязные страницы и выбрасывает все страницы из пула и второго уровня:
+	// следующее обращение перечитает их из устройства. false - сброс не удался или в пуле
+	// есть закреплённые страницы (LastError() == CacheAllPinned), тогда пул не тронут
+	virtual bool	Invalidate() = 0;
+
+	// останавливает фоновую работу политики и сливает кэш,
+	// вызывается из деструктора конкретного устройства
+	virtual bool	Close()
+	{
+		return Flush();
+	}
+
+	// счётчики с момента создания или ResetStatistics(), без CACHE_STATS - нули
+	virtual CacheStatistics	Statistics() const
+	{
+		CacheStatistics Result = { 0, 0, 0, 0, 0, 0, 0, 0 };
+		Stats.AddTo( Result );
+		return Result;
+	}
+
+	virtual void	ResetStatistics()
+	{
+		Stats.Reset();
+	}
+
+	// сжатый второй уровень на Budget байт, 0 - выключить; включайте до начала работы с кэшем
+	void	SetSecondTier( size_t Budget )
+	{
+		Tier.reset( Budget ? new CompressedTier<_T>( Budget ) : NULL );
+	}
+
+	TierStatistics	SecondTierStatistics() const
+	{
+		if( Tier ) return Tier->Statistics();
+		TierStatistics Result = { 0, 0, 0, 0, 0, 0, 0, 0 };
+		return Result;
+	}
+
+protected:
+	CacheCounters< sizeof(_T) >	Stats;
+	unique_ptr< CompressedTier<_T> >	Tier;
+
+	// грязная страница пула, подготовленная к сбросу
+	struct DirtyPage
+	{
+		unsigned Index;
+		_T*		 Obj;
+		BlockMask* Dirty;	// маска слота, снимается после успешного сохранения
+
+		bool operator<( const DirtyPage& Other ) const { return Index < Other.Index; }
+	};
+
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+
+	// маска блоков, покрывающих [Offset, Offset + Size)
+	static BlockMask	Blocks( unsigned Offset, unsigned Size )
+	{
+		if( Size == 0 ) return 0;
+		unsigned First = Offset / BlockBytes;
+		unsigned Last = (Offset + Size - 1) / BlockBytes;
+		return ((2ull << Last) - 1) & ~((1ull << First) - 1);
+	}
+
+	// маска для GetData( Index, ForWrite )
+	static BlockMask	Blocks( bool ForWrite )
+	{
+		return ForWrite ? AllBlocks : 0;
+	}
+
+	// GetDataRange для политик без пакетной загрузки: закрепляет страницы по одной через Pin,
+	// при отказе снимает уже поставленные закрепления
+	template< class _Policy >
+	static PageSpan<_T>	PinEach( _Policy& Policy, unsigned Index, unsigned Count, bool ForWrite )
+	{
+		vector< _T* > Refs;
+		Refs.reserve( Count );
+		for( unsigned i = 0; i < Count; i++ )
+		{
+			_T* Ptr = Policy.Pin( Index + i, ForWrite );
+			if( Ptr == NULL )
+			{
+				while( i-- > 0 ) Policy.Unpin( Index + i );
+				return PageSpan<_T>();
+			}
+			Refs.push_back( Ptr );
+		}
+		return PageSpan<_T>( Index, Refs );
+	}
+
+	template< class _Policy >
+	static void	UnpinEach( _Policy& Policy, const PageSpan<_T>& Span )
+	{
+		for( unsigned i = 0; i < Span.Size(); i++ ) Policy.Unpin( Span.GetIndex() + i );
+	}
+
+	// загружает Count подряд идущих страниц начиная с Index одним обращением к хранилищу,
+	// по умолчанию - постранично
+	virtual bool  LoadRange( unsigned Index, unsigned Count, _T** Refs )
+	{
+		for( unsigned i = 0; i < Count; i++ )
+			if( !Load( Index + i, *Refs[i] ) ) return false;
+		return true;
+	}
+
+	// сохраняет Count подряд идущих страниц начиная с Index одним обращением к хранилищу,
+	// по умолчанию - постранично
+	virtual bool  SaveRange( unsigned Index, unsigned Count, _T** Refs )
+	{
+		for( unsigned i = 0; i < Count; i++ )
+			if( !Save( Index + i, *Refs[i] ) ) return false;
+		return true;
+	}
+
+	// сохраняет изменённые участки страницы (по возрастанию смещений, не пересекаются),
+	// по умолчанию - всю страницу
+	virtual bool  SaveExtents( unsigned Index, _T& Ref, const PageExtent* /*Extents*/, unsigned /*Count*/ )
+	{
+		return Save( Index, Ref );
+	}
+
+	// страница прямо в памяти хранилища, если оно её так держит (RAM, mmap), иначе NULL;
+	// через него PassThroughCache отдаёт страницы без копирования
+	virtual _T*  Direct( unsigned /*Index*/ )
+	{
+		return NULL;
+	}
+
+	// пакет обращений: до EndBatch хранилище может лишь ставить LoadRange/SaveRange/SaveExtents/Save
+	// в очередь, а политика не трогает их страниц; false из EndBatch - не удалось хоть одно обращение
+	// пакета. Пакеты не вкладываются, по умолчанию обращения выполняются сразу
+	virtual void  BeginBatch()
+	{
+	}
+
+	virtual bool  EndBatch()
+	{
+		return true;
+	}
+
+	bool	LoadPage( unsigned Index, _T& Ref )
+	{
+		if( Tier && Tier->Take( Index, Ref ) ) return true;
+		if( Load( Index, Ref ) )
+		{
+			Stats.Loaded( 1 );
+			return true;
+		}
+		Stats.LoadFailed();
+		return false;
+	}
+
+	// сохраняет блоки Dirty страницы: целиком грязную - через Save, остальные - через SaveExtents
+	bool	SavePage( unsigned Index, _T& Ref, BlockMask Dirty )
+	{
+		if( Tier ) Tier->Forget( Index, 1 );
+		if( Dirty == AllBlocks )
+		{
+			if( Save( Index, Ref ) )
+			{
+				Stats.Saved( 1 );
+				return true;
+			}
+			Stats.SaveFailed();
+			return false;
+		}
+
+		// серии соседних грязных блоков склеиваем в участки
+		PageExtent Extents[(BlockCount + 1) / 2];
+		unsigned Count = 0;
+		unsigned long long Bytes = 0;
+		for( unsigned b = 0; b < BlockCount; )
+		{
+			if( !(Dirty >> b & 1) ) { b++; continue; }
+			unsigned End = b;
+			while( End < BlockCount && (Dirty >> End & 1) ) End++;
+			Extents[Count].Offset = b * BlockBytes;
+			Extents[Count].Size = (unsigned)min( (size_t)End * BlockBytes, sizeof(_T) ) - b * BlockBytes;
+			Bytes += Extents[Count++].Size;
+			b = End;
+		}
+
+		if( SaveExtents( Index, Ref, Extents, Count ) )
+		{
+			Stats.Saved( 1, Bytes );
+			return true;
+		}
+		Stats.SaveFailed();
+		return false;
+	}
+
+	// загружает Count подряд идущих страниц: найденные во втором уровне - распаковкой,
+	// остальные - сериями через LoadRange
+	bool	LoadPages( unsigned Index, unsigned Count, _T** Refs )
+	{
+		vector< bool > Taken( Count, false );
+		if( Tier )
+			for( unsigned i = 0; i < Count; i++ ) Taken[i] = Tier->Take( Index + i, *Refs[i] );
+
+		for( unsigned First = 0, Last; First < Count; First = Last )
+		{
+			for( Last = First; Last < Count && !Taken[Last]; Last++ );
+			if( Last > First )
+			{
+				if( !LoadRange( Index + First, Last - First, &Refs[First] ) )
+				{
+					Stats.LoadFailed();
+					return false;
+				}
+				Stats.Loaded( Last - First );
+			}
+			for( ; Last < Count && Taken[Last]; Last++ );
+		}
+		return true;
+	}
+
+	// страница уходит из пула (грязная уже сохранена) - её копия может остаться во втором уровне
+	void	Retire( unsigned Index, _T& Ref )
+	{
+		if( Tier ) Tier->Put( Index, Ref );
+	}
+
+	// пул выброшен целиком - копии второго уровня тоже
+	void	ClearTier()
+	{
+		if( Tier ) Tier->Clear();
+	}
+
+	// все серии уходят в хранилище одним пакетом, маски снимаются, когда пакет выполнен
+	bool	WriteBack( vector< DirtyPage >& Pages )
+	{
+		bool Result = true;
+		vector< _T* > Refs;
+		vector< size_t > Written;
+		sort( Pages.begin(), Pages.end() );
+
+		BeginBatch();
+		for( size_t First = 0, Last; First < Pages.size(); First = Last )
+		{
+			// не целиком грязная страница пишется отдельно, своими участками
+			if( *Pages[First].Dirty != AllBlocks )
+			{
+				Last = First + 1;
+				if( SavePage( Pages[First].Index, *Pages[First].Obj, *Pages[First].Dirty ) ) Written.push_back( First );
+				else Result = false;
+				continue;
+			}
+
+			Refs.clear();
+			Refs.push_back( Pages[First].Obj );
+			for( Last = First + 1; Last < Pages.size() && Pages[Last].Index == Pages[Last - 1].Index + 1
+					&& *Pages[Last].Dirty == AllBlocks; Last++ )
+				Refs.push_back( Pages[Last].Obj );
+
+			if( Tier ) Tier->Forget( Pages[First].Index, (unsigned)Refs.size() );
+			if( SaveRange( Pages[First].Index, (unsigned)Refs.size(), &Refs[0] ) )
+			{
+				for( size_t i = First; i < Last; i++ ) Written.push_back( i );
+				Stats.Saved( (unsigned)Refs.size() );
+			}
+			else
+			{
+				Stats.SaveFailed();
+				Result = false;
+			}
+		}
+
+		// какое обращение пакета не удалось, неизвестно - грязными остаются все страницы
+		if( !EndBatch() )
+		{
+			Stats.SaveFailed();
+			return false;
+		}
+		for( size_t i = 0; i < Written.size(); i++ ) *Pages[Written[i]].Dirty = 0;
+		return Result;
+	}
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 //						Cache
 ///////////////////////////////////////////////////////////////////////////////
 
+/*
+	Указатель из GetData действителен только до следующего промаха (с включённым упреждающим
+	чтением - до следующего обращения): слот может быть отдан другой странице. Pin/Unpin
+	(или PageHandle) закрепляют страницу в пуле, закреплённые слоты вытеснение пропускает.
+
+	Страницы пула лежат в отдельном выровненном буфере PageBuffer (с большими страницами,
+	если пул не меньше 2 МБ), описания слотов - в параллельных массивах, так что обход
+	слотов при вытеснении и Flush не ходит по страницам.
+
+	Flush() сбрасывает грязные страницы, не вытесняя их. Из деструктора Cache сбрасывать
+	поздно - Save производного устройства к этому моменту уже уничтожен, поэтому Close()
+	вызывает деструктор конкретного устройства.
+
+	Упреждающее чтение по умолчанию выключено, SetReadAhead( N ) включает его с окном до N страниц.
+	Промах после обращений к двум предыдущим по номеру страницам считается последовательным
+	потоком, и за ним одним LoadRange подгружается окно из RaWindow страниц. Попадание в первую
+	страницу окна (RaMark) подгружает следующее окно, каждое новое окно вдвое больше прежнего,
+	но не больше ReadAheadMax. Непоследовательный промах сбрасывает окно, так что при случайном
+	доступе лишних загрузок нет. Подгрузка окна вытесняет страницы, поэтому с упреждающим чтением
+	и попадание может отдать другие незакреплённые слоты - держать два указателя без Pin нельзя.
+
+	GetDataRange( Index, Count, ForWrite ) отдаёт серию страниц закреплёнными (PageSpan):
+	попадания разрешаются сразу, под промахи заранее освобождаются слоты, и подряд идущие
+	промахи уходят в хранилище одним LoadRange, а все серии - одним пакетом (BeginBatch/EndBatch),
+	как и окно упреждающего чтения. Остальные политики закрепляют серию
+	постранично (CacheBase::PinEach) с тем же интерфейсом.
+*/
 template
 <
 	class _T,
 		unsigned CacheSize = 16,
 		unsigned SpaceSize = 8
 >
-class Cache
+class Cache : public CacheBase<_T>
 {
 public:
-	Cache(): Pool(CacheSize), VMap(1 << SpaceSize)
+	typedef _T DataType;
+
+	Cache(): Pages(CacheSize), Indexes(CacheSize, -1), DirtyMasks(CacheSize, 0), PinCounts(CacheSize, 0), VMap(1 << SpaceSize, (int)-1)
 	{
 		LastLoadedIndex = -1;
-		// Проинициализируем пул
-		for( int i = 0; i < CacheSize; i++ )
-		{
-			Pool[i].Index = -1;
-			Pool[i].Dirty = false;
-		}
+		Error = CacheOk;
+		PrevIndex = (unsigned)-1;
+		SeqRun = 0;
+		RaWindow = RaNext = RaMark = 0;
+		SetReadAhead( 0 );
 	}
 
 	virtual ~Cache()
 	{
-		// сливаем кэш
+		// сливает кэш деструктор устройства через Close()
 	}
 
 	_T*		GetData( unsigned Index, bool ForWrite )
 	{
-		if( VMap[Index] != NULL )
+		if( Index >= VMap.size() )
+		{
+			Error = CacheBadIndex;
+			return NULL;
+		}
+
+		// повторные обращения к той же странице поток не прерывают
+		if( Index == PrevIndex + 1 ) SeqRun++;
+		else if( Index != PrevIndex ) SeqRun = 0;
+		PrevIndex = Index;
+
+		int PoolPos = VMap[Index];
+		if( PoolPos >= 0 )
 		{
-			VMap[Index]->Dirty |= ForWrite;
-			return &VMap[Index]->Obj;
+			this->Stats.Hit();
+			DirtyMasks[PoolPos] |= this->Blocks( ForWrite );
+			// поток дошёл до начала окна - пора читать следующее
+			if( RaWindow && Index == RaMark )
+			{
+				RaWindow = min( RaWindow * 2, ReadAheadMax );
+				ReadAhead( Index );
+			}
+			return &Pages[PoolPos];
 		}
 		else
 		{
 			// найдём место для загрузки
-			unsigned PoolPos = (LastLoadedIndex + 1) % CacheSize;
+			this->Stats.Miss();
+			PoolPos = Evict();
+			if( PoolPos < 0 ) return NULL;
 
-			if( Pool[PoolPos].Index >= 0 )
-			{
-				if( Pool[PoolPos].Dirty )
+			if( this->LoadPage( Index, Pages[PoolPos] ) )
+			{	//	если загрузили страницу
+				Indexes[PoolPos] = Index;
+				DirtyMasks[PoolPos] = this->Blocks( ForWrite );
+				VMap[Index] = PoolPos;
+
+				if( SeqRun >= 2 && ReadAheadMax )
 				{
-					if( !Save( Pool[PoolPos].Index, Pool[PoolPos].Obj ) )
-					{
-						// ошибка сохранения страницы
-						return NULL;
-					}
-					Pool[PoolPos].Dirty = false;
+					RaWindow = RaWindow ? min( RaWindow * 2, ReadAheadMax ) : min( 4u, ReadAheadMax );
+					RaNext = Index + 1;
+					ReadAhead( Index );
 				}
-				VMap[Pool[PoolPos].Index] = NULL;
-			}
+				else RaWindow = 0;
 
-			Pool[PoolPos].Index = Index;
-
-			if( Load( Index, Pool[PoolPos].Obj ) )
-			{	//	если загрузили страницу
-				LastLoadedIndex = PoolPos;
-				VMap[Index] = &Pool[PoolPos];
-				VMap[Index]->Dirty = ForWrite;
-				return &Pool[PoolPos].Obj;
+				return &Pages[PoolPos];
 			}
 			else
 			{
+				Error = CacheLoadFailed;
 				return NULL;
 			}
 		}
 	}
 
+	// берёт страницу на запись, грязными помечаются только блоки, покрывающие [Offset, Offset + Size)
+	_T*		GetDataForWrite( unsigned Index, unsigned Offset, unsigned Size )
+	{
+		_T* Ptr = GetData( Index, false );
+		if( Ptr ) DirtyMasks[VMap[Index]] |= this->Blocks( Offset, Size );
+		return Ptr;
+	}
+
+	// наибольшее окно упреждающего чтения в страницах, 0 - выключить;
+	// больше четверти пула окно не бывает, иначе следующее окно вытеснит ещё не прочитанное
+	void	SetReadAhead( unsigned MaxWindow )
+	{
+		ReadAheadMax = min( MaxWindow, CacheSize / 4 );
+		RaWindow = 0;
+	}
+
+	// загружает и закрепляет страницу, каждому Pin должен соответствовать Unpin
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		_T* Ptr = GetData( Index, ForWrite );
+		if( Ptr ) PinCounts[VMap[Index]]++;
+		return Ptr;
+	}
+
+	void	Unpin( unsigned Index )
+	{
+		if( Index < VMap.size() && VMap[Index] >= 0 && PinCounts[VMap[Index]] > 0 )
+			PinCounts[VMap[Index]]--;
+	}
+
+	// загружает и закрепляет страницы [Index, Index + Count): попадания закрепляются сразу,
+	// под все промахи сначала освобождаются слоты, и подряд идущие промахи грузятся одним LoadPages;
+	// каждому успешному вызову должен соответствовать UnpinRange
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		if( Count == 0 || Index >= VMap.size() || Count > VMap.size() - Index )
+		{
+			Error = CacheBadIndex;
+			return PageSpan<_T>();
+		}
+
+		vector< _T* > Refs( Count, (_T*)NULL );
+		for( unsigned i = 0; i < Count; i++ )
+		{
+			int PoolPos = VMap[Index + i];
+			if( PoolPos < 0 ) continue;
+			this->Stats.Hit();
+			DirtyMasks[PoolPos] |= this->Blocks( ForWrite );
+			PinCounts[PoolPos]++;
+			Refs[i] = &Pages[PoolPos];
+		}
+
+		// под все промахи сначала освобождаем и закрепляем слоты: вытеснение сохраняет грязные
+		// жертвы синхронно, и до загрузок в эти слоты оно должно закончиться
+		vector< int > Slots( Count, -1 );
+		bool Loaded = true;
+		for( unsigned i = 0; i < Count; i++ )
+		{
+			if( Refs[i] ) continue;
+			this->Stats.Miss();
+			Slots[i] = Evict();
+			if( Slots[i] < 0 )
+			{
+				Loaded = false;		// причина уже в Error
+				break;
+			}
+			PinCounts[Slots[i]]++;
+			Refs[i] = &Pages[Slots[i]];
+		}
+
+		// подряд идущие промахи - одной серией, все серии - одним пакетом
+		if( Loaded )
+		{
+			this->BeginBatch();
+			for( unsigned First = 0, Last; First < Count; First = Last )
+			{
+				for( ; First < Count && Slots[First] < 0; First++ );
+				for( Last = First; Last < Count && Slots[Last] >= 0; Last++ );
+				if( Last > First && !this->LoadPages( Index + First, Last - First, &Refs[First] ) ) Loaded = false;
+			}
+			if( !this->EndBatch() ) Loaded = false;
+			if( !Loaded ) Error = CacheLoadFailed;
+		}
+
+		if( !Loaded )
+		{
+			for( unsigned i = 0; i < Count; i++ )
+			{
+				if( Slots[i] >= 0 ) PinCounts[Slots[i]]--;
+				else if( Refs[i] ) PinCounts[VMap[Index + i]]--;
+			}
+			return PageSpan<_T>();
+		}
+
+		for( unsigned i = 0; i < Count; i++ )
+		{
+			if( Slots[i] < 0 ) continue;
+			Indexes[Slots[i]] = Index + i;
+			DirtyMasks[Slots[i]] = this->Blocks( ForWrite );
+			VMap[Index + i] = Slots[i];
+		}
+
+		// для упреждающего чтения серия выглядит как последовательный проход
+		SeqRun = Index == PrevIndex + 1 ? SeqRun + Count : Count - 1;
+		PrevIndex = Index + Count - 1;
+		return PageSpan<_T>( Index, Refs );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// помечает грязными блоки [Offset, Offset + Size) страницы Span[i]: страница закреплена,
+	// слот берётся из карты без поиска и без счёта попадания
+	void	MarkDirty( const PageSpan<_T>& Span, unsigned i, unsigned Offset, unsigned Size )
+	{
+		DirtyMasks[VMap[Span.GetIndex() + i]] |= this->Blocks( Offset, Size );
+	}
+
+	// сбрасывает все грязные страницы, страницы остаются в пуле
+	virtual bool	Flush()
+	{
+		vector< DirtyPage > Dirty;
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( DirtyMasks[i] && Indexes[i] >= 0 )
+			{
+				DirtyPage Page = { (unsigned)Indexes[i], &Pages[i], &DirtyMasks[i] };
+				Dirty.push_back( Page );
+			}
+		}
+		if( this->WriteBack( Dirty ) ) return true;
+		Error = CacheSaveFailed;
+		return false;
+	}
+
+	// сбрасывает и выбрасывает все страницы пула, окно упреждающего чтения начинается заново
+	virtual bool	Invalidate()
+	{
+		for( unsigned i = 0; i < CacheSize; i++ )
+			if( PinCounts[i] > 0 )
+			{
+				Error = CacheAllPinned;
+				return false;
+			}
+		if( !Flush() ) return false;
+
+		fill( Indexes.begin(), Indexes.end(), -1 );
+		fill( VMap.begin(), VMap.end(), -1 );
+		LastLoadedIndex = -1;
+		PrevIndex = (unsigned)-1;
+		SeqRun = 0;
+		RaWindow = 0;
+		this->ClearTier();
+		return true;
+	}
+
+	CacheError	LastError() const { return Error; }
+
 protected:
 	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
 	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
 private:
-	template<class __T> 
-	struct Container
-	{
-		__T	 Obj;
-		int	 Index;
-		bool Dirty;
-	};
-	vector< Container<_T> >  Pool;
-	vector< Container<_T> * > VMap;
+	typedef typename CacheBase<_T>::DirtyPage DirtyPage;
+	typedef typename CacheBase<_T>::BlockMask BlockMask;
+
+	// слот пула - страница Pages[i] и её описание в параллельных массивах:
+	// обход описаний при вытеснении и Flush идёт по нескольким плотным строкам кэша
+	PageBuffer< _T >         Pages;
+	vector< int >            Indexes;		// номер страницы в слоте, -1 - слот свободен
+	vector< BlockMask >      DirtyMasks;	// грязные блоки страницы
+	vector< unsigned >       PinCounts;		// сколько раз страница закреплена
+	vector< int >            VMap;	// индекс страницы -> позиция в пуле, -1 если не загружена
 	int           LastLoadedIndex;
+	CacheError    Error;
+
+	// состояние упреждающего чтения
+	unsigned      ReadAheadMax;
+	unsigned      PrevIndex;	// страница предыдущего обращения
+	unsigned      SeqRun;		// сколько раз подряд обращались к следующей странице
+	unsigned      RaWindow;		// текущее окно, 0 - поток не последовательный
+	unsigned      RaNext;		// первая страница за прочитанными окнами
+	unsigned      RaMark;		// первая страница последнего окна
+
+	// освобождает слот пула для новой страницы, закреплённые слоты пропускает
+	int		Evict()
+	{
+		unsigned PoolPos = (LastLoadedIndex + 1) % CacheSize;
+		for( unsigned Tries = 1; PinCounts[PoolPos] > 0; Tries++ )
+		{
+			if( Tries == CacheSize )
+			{
+				Error = CacheAllPinned;
+				return -1;
+			}
+			PoolPos = (PoolPos + 1) % CacheSize;
+		}
+
+		if( Indexes[PoolPos] >= 0 )
+		{
+			if( DirtyMasks[PoolPos] )
+			{
+				if( !this->SavePage( Indexes[PoolPos], Pages[PoolPos], DirtyMasks[PoolPos] ) )
+				{
+					// ошибка сохранения страницы
+					Error = CacheSaveFailed;
+					return -1;
+				}
+				DirtyMasks[PoolPos] = 0;
+			}
+			this->Retire( Indexes[PoolPos], Pages[PoolPos] );
+			VMap[Indexes[PoolPos]] = -1;
+			Indexes[PoolPos] = -1;
+			this->Stats.Eviction();
+		}
+		LastLoadedIndex = PoolPos;
+		return PoolPos;
+	}
+
+	// подгружает окно [RaNext, RaNext + RaWindow): слоты под отсутствующие в пуле страницы
+	// освобождаются заранее, подряд идущие страницы грузятся сериями через LoadRange, все серии
+	// окна - одним пакетом; страница Current на это время закрепляется, чтобы окно её не вытеснило
+	void	ReadAhead( unsigned Current )
+	{
+		unsigned First = RaNext;
+		unsigned Last = (unsigned)min( (size_t)RaNext + RaWindow, VMap.size() );
+		RaMark = First;
+		RaNext = Last;
+		if( First >= Last ) return;
+
+		vector< int > Slots( Last - First, -1 );
+		vector< _T* > Refs( Last - First, (_T*)NULL );
+		PinCounts[VMap[Current]]++;
+		unsigned End = First;
+		for( ; End < Last; End++ )
+		{
+			if( VMap[End] >= 0 ) continue;
+			int PoolPos = Evict();
+			// места нет (всё закреплено или не сохранить) - окно обрезаем
+			if( PoolPos < 0 ) break;
+			PinCounts[PoolPos]++;
+			Slots[End - First] = PoolPos;
+			Refs[End - First] = &Pages[PoolPos];
+		}
+
+		bool Loaded = true;
+		this->BeginBatch();
+		for( unsigned Run = First, RunEnd; Run < End; Run = RunEnd )
+		{
+			for( ; Run < End && Slots[Run - First] < 0; Run++ );
+			for( RunEnd = Run; RunEnd < End && Slots[RunEnd - First] >= 0; RunEnd++ );
+			if( RunEnd > Run && !this->LoadPages( Run, RunEnd - Run, &Refs[Run - First] ) ) Loaded = false;
+		}
+		if( !this->EndBatch() ) Loaded = false;
+
+		// окно упреждающее - при отказе его просто не будет, слоты остаются свободными
+		for( unsigned i = First; i < End; i++ )
+		{
+			int PoolPos = Slots[i - First];
+			if( PoolPos < 0 ) continue;
+			PinCounts[PoolPos]--;
+			if( !Loaded ) continue;
+			Indexes[PoolPos] = i;
+			DirtyMasks[PoolPos] = 0;
+			VMap[i] = PoolPos;
+		}
+		PinCounts[VMap[Current]]--;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						PageHandle
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+	Закреплённая страница: пока объект жив, слот пула не будет вытеснен и указатель
+	можно отдавать парсерам и сетевым писателям без копирования.
+	Работает с любой политикой кэширования, у которой есть Pin/Unpin и DataType.
+
+		PageHandle< StaticPageDevice<> > Page( SPD, 5, false );
+		if( !Page ) ... SPD.LastError() == CacheAllPinned ...
+*/
+template< class _Cache >
+class PageHandle
+{
+public:
+	typedef typename _Cache::DataType DataType;
+
+	PageHandle(): Owner(NULL), Index(0), Ptr(NULL) {}
+
+	PageHandle( _Cache& Dev, unsigned PageIndex, bool ForWrite ): Owner(&Dev), Index(PageIndex)
+	{
+		Ptr = Dev.Pin( PageIndex, ForWrite );
+	}
+
+	PageHandle( const PageHandle& Other ): Owner(Other.Owner), Index(Other.Index), Ptr(Other.Ptr)
+	{
+		if( Ptr ) Owner->Pin( Index, false );
+	}
+
+	PageHandle& operator=( const PageHandle& Other )
+	{
+		if( this != &Other )
+		{
+			Release();
+			Owner = Other.Owner;
+			Index = Other.Index;
+			Ptr = Other.Ptr;
+			if( Ptr ) Owner->Pin( Index, false );
+		}
+		return *this;
+	}
+
+	~PageHandle()
+	{
+		Release();
+	}
+
+	// снимает закрепление, после этого указатель недействителен
+	void	Release()
+	{
+		if( Ptr ) Owner->Unpin( Index );
+		Ptr = NULL;
+	}
+
+	DataType*	Get() const { return Ptr; }
+	DataType*	operator->() const { return Ptr; }
+	DataType&	operator*() const { return *Ptr; }
+	operator	bool() const { return Ptr != NULL; }
+	unsigned	GetIndex() const { return Index; }
+
+private:
+	_Cache*		Owner;
+	unsigned	Index;
+	DataType*	Ptr;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -126,6 +953,7 @@ public:
 
 	virtual ~PageDevice()
 	{
+		// Close() вызывает деструктор конкретного устройства, здесь его Save уже недоступен
 	}
 
 protected:
@@ -150,49 +978,86 @@ class MemoryDevice
 {
 	static const unsigned OffsetMask = (1 << PageSize) - 1;
 	static const unsigned PageMask = ((1 << (MemorySize - PageSize)) - 1) << PageSize;
-	_PageDevice< PageSize, PoolSize, MemorySize - PageSize, CachePolicy > PageDev;
-
 public:
-	__forceinline	bool	Read( unsigned Address, unsigned char* Data, unsigned Size )
+	typedef _PageDevice< PageSize, PoolSize, MemorySize - PageSize, CachePolicy > DeviceType;
+
+	// устройство страниц - для настроек политики (SetReadAhead, SetBudget и т.п.)
+	DeviceType&	Device()
 	{
-		unsigned char*	PagePtr;
-		unsigned Index = (Address & PageMask) > PageSize;
-		unsigned Offset = Address & OffsetMask;
-		unsigned Step = (1 << PageSize) - Offset;
-		if( Step > Size ) Step = Size;
+		return PageDev;
+	}
 
-		while( PagePtr = PageDev.GetData( Index++, false )->Data )
-		{ 
-			memcpy( Data, &PagePtr[Offset], Step );
-			Size -= Step;
-			if( Size == 0 ) return true;
-			if( Size < (1 << PageSize) ) Step = Size;
-			else Step = 1 << PageSize;
-			Data += 1 << PageSize;
-			Offset = 0;
-		}
+	// сбрасывает все изменённые страницы в хранилище
+	bool	Flush()
+	{
+		return PageDev.Flush();
+	}
 
-		return false;
+	// счётчики кэша страниц (собираются при CACHE_STATS)
+	CacheStatistics	Statistics() const
+	{
+		return PageDev.Statistics();
+	}
+
+	void	ResetStatistics()
+	{
+		PageDev.ResetStatistics();
 	}
+
+	__forceinline	bool	Read( unsigned Address, unsigned char* Data, unsigned Size )
+	{
+		return Transfer( Address, Data, Size, false );
+	}
+
+	// грязными станут только блоки страниц, в которые действительно пишем
 	__forceinline	bool	Write( unsigned Address, unsigned char* Data, unsigned Size )
 	{
-		unsigned char*	PagePtr;
-		unsigned Index = (Address & PageMask) > PageSize;
+		return Transfer( Address, Data, Size, true );
+	}
+
+private:
+	// страниц в одной серии GetDataRange: не больше половины пула, чтобы не упереться в закреплённые
+	static const unsigned RangePages = PoolSize / 2 ? PoolSize / 2 : 1;
+
+	DeviceType	PageDev;
+
+	// копирует Size байт между Data и памятью с адреса Address: страницы берутся сериями
+	// через GetDataRange, так что промахи серии политика грузит вместе
+	bool	Transfer( unsigned Address, unsigned char* Data, unsigned Size, bool ToPages )
+	{
+		unsigned Index = (Address & PageMask) >> PageSize;
 		unsigned Offset = Address & OffsetMask;
-		unsigned Step = (1 << PageSize) - Offset;
-		if( Step > Size ) Step = Size;
+		unsigned Batch = RangePages;
 
-		while( PagePtr = PageDev.GetData( Index++, true )->Data )
-		{ 
-			memcpy( &PagePtr[Offset], Data, Step );
-			Size -= Step;
-			if( Size == 0 ) return true;
-			if( Size < (1 << PageSize) ) Step = Size;
-			else Step = 1 << PageSize;
-			Data += 1 << PageSize;
-			Offset = 0;
-		}
+		while( Size > 0 )
+		{
+			unsigned Count = (unsigned)min( ((size_t)Offset + Size + OffsetMask) >> PageSize, (size_t)Batch );
+			PageSpan< Page<PageSize> > Span = PageDev.GetDataRange( Index, Count, false );
+			if( !Span )
+			{
+				// не хватило незакреплённых слотов - пробуем серию поменьше; остальные отказы
+				// (не загрузилась страница, адрес за концом) повтор не исправит
+				if( Count == 1 || PageDev.LastError() != CacheAllPinned ) return false;
+				Batch = Count / 2;
+				continue;
+			}
 
-		return false;
+			for( unsigned i = 0; i < Count; i++ )
+			{
+				unsigned Step = min( Size, (1u << PageSize) - Offset );
+				if( ToPages )
+				{
+					PageDev.MarkDirty( Span, i, Offset, Step );
+					memcpy( &Span[i]->Data[Offset], Data, Step );
+				}
+				else memcpy( Data, &Span[i]->Data[Offset], Step );
+				Data += Step;
+				Size -= Step;
+				Offset = 0;
+			}
+			PageDev.UnpinRange( Span );
+			Index += Count;
+		}
+		return true;
 	}
 };
\ No newline at end of file
@@ -0,0 +1,125 @@
+#pragma once
+#include <vector>
+#include "PageDevice.h"
+
+using namespace std;
+/*
+	Политика без пула для устройств, которые и так держат страницы в памяти
+	(StaticPageDevice, отображённые в память файлы): GetData отдаёт указатель прямо
+	в хранилище устройства через CacheBase::Direct, без копирования страницы в пул
+	при загрузке и обратно при сохранении.
+
+		StaticPageDevice<16,16,8,PassThroughCache>	SPD;
+		MemoryDevice<24,16,16,PassThroughCache,StaticPageDevice>	CSMD;
+
+	Указатель на страницу запоминается в карте при первом обращении (это считается промахом),
+	дальше попадание стоит одного чтения карты. Указатели не меняются, пока устройство
+	не вызовет Remap(), так что Pin/Unpin ничего не закрепляют, а Flush нечего сбрасывать.
+	Load/Save устройства не вызываются; если устройство не умеет Direct, GetData отказывает
+	с CacheLoadFailed.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						PassThroughCache
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	class _T,
+		unsigned CacheSize = 16,
+		unsigned SpaceSize = 8
+>
+class PassThroughCache : public CacheBase<_T>
+{
+public:
+	typedef _T DataType;
+
+	PassThroughCache(): VMap(1 << SpaceSize, NULL)
+	{
+		Error = CacheOk;
+	}
+
+	virtual ~PassThroughCache()
+	{
+	}
+
+	_T*		GetData( unsigned Index, bool /*ForWrite*/ )
+	{
+		if( Index >= VMap.size() )
+		{
+			Error = CacheBadIndex;
+			return NULL;
+		}
+
+		if( VMap[Index] != NULL )
+		{
+			this->Stats.Hit();
+			return VMap[Index];
+		}
+		this->Stats.Miss();
+
+		VMap[Index] = this->Direct( Index );
+		if( VMap[Index] == NULL ) Error = CacheLoadFailed;
+		return VMap[Index];
+	}
+
+	// запись идёт прямо в хранилище, помечать нечего
+	_T*		GetDataForWrite( unsigned Index, unsigned /*Offset*/, unsigned /*Size*/ )
+	{
+		return GetData( Index, true );
+	}
+
+	// страницы не вытесняются, закреплять нечего
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		return GetData( Index, ForWrite );
+	}
+
+	void	Unpin( unsigned /*Index*/ )
+	{
+	}
+
+	// страницы и так в памяти устройства - загружать пакетом нечего
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		return this->PinEach( *this, Index, Count, ForWrite );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// запись идёт прямо в хранилище, помечать нечего
+	void	MarkDirty( const PageSpan<_T>& /*Span*/, unsigned /*i*/, unsigned /*Offset*/, unsigned /*Size*/ )
+	{
+	}
+
+	virtual bool	Flush()
+	{
+		return true;
+	}
+
+	// указатели берутся у устройства заново
+	virtual bool	Invalidate()
+	{
+		Remap();
+		return true;
+	}
+
+	CacheError	LastError() const { return Error; }
+
+protected:
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+
+	// хранилище переехало (например, отображение файла выросло) - указатели надо взять заново
+	void	Remap()
+	{
+		fill( VMap.begin(), VMap.end(), (_T*)NULL );
+	}
+
+private:
+	vector< _T * >  VMap;	// индекс страницы -> страница в хранилище, NULL - ещё не спрашивали
+	CacheError    Error;
+};
@@ -0,0 +1,54 @@
+#pragma once
+#include <map>
+
+using namespace std;
+/*
+	Состояние объекта, своё в каждом потоке: обёртки устройств держат в нём глубину вложенных
+	вызовов и открытый пакет. Ключ - адрес объекта, поэтому у двух устройств одного типа,
+	которыми пользуется один поток, состояния раздельные. Запись создаётся первым Enter
+	и убирается Leave, как только опустеет (_State::Idle()); пустое состояние - нет записи.
+
+		ThreadState& State = PerThread< ThreadState >::Enter( this );
+		State.Nested++;
+		...
+		State.Nested--;
+		PerThread< ThreadState >::Leave( this );
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						PerThread
+///////////////////////////////////////////////////////////////////////////////
+
+template< class _State >
+class PerThread
+{
+public:
+	// состояние Owner в этом потоке, NULL - пустое
+	static _State*	Find( const void* Owner )
+	{
+		map< const void*, _State >& All = States();
+		typename map< const void*, _State >::iterator It = All.find( Owner );
+		return It == All.end() ? NULL : &It->second;
+	}
+
+	// состояние Owner в этом потоке, при необходимости новое пустое; ссылка живёт до Leave
+	static _State&	Enter( const void* Owner )
+	{
+		return States()[Owner];
+	}
+
+	// убирает опустевшее состояние Owner
+	static void	Leave( const void* Owner )
+	{
+		map< const void*, _State >& All = States();
+		typename map< const void*, _State >::iterator It = All.find( Owner );
+		if( It != All.end() && It->second.Idle() ) All.erase( It );
+	}
+
+private:
+	static map< const void*, _State >&	States()
+	{
+		static thread_local map< const void*, _State >	All;
+		return All;
+	}
+};
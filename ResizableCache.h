@@ -0,0 +1,336 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <new>
+#include "PageDevice.h"
+
+using namespace std;
+/*
+	Политика кэширования с размером пула, меняющимся во время работы.
+	Вытеснение как у Cache (по кругу), но CacheSize - только начальная ёмкость пула:
+
+		StaticPageDevice<16,16,8,ResizableCache>	SPD;
+		SPD.SetBudget( 256 << 20 );		// пул не больше 256 МБ
+		SPD.Resize( 1024 );				// ёмкость 1024 слота, но не больше бюджета
+		...
+		SPD.ReleaseMemory( 64 << 20 );	// из обработчика нехватки памяти
+
+	Слоты выделяются по одному при промахах, пока пул не дорос до ёмкости, так что память
+	занимают только действительно использованные слоты. Уменьшение происходит сразу:
+	лишние слоты (сначала чистые) освобождаются, грязные страницы перед этим сохраняются
+	одним WriteBack. Закреплённые слоты не освобождаются.
+
+	Каждый слот выделен отдельно и не двигается при изменении пула, поэтому карта хранит
+	указатели на слоты и попадание стоит столько же, сколько в Cache.
+	Политика однопоточная, как Cache: ReleaseMemory зовите из того же потока, что и GetData.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						ResizableCache
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	class _T,
+		unsigned CacheSize = 16,
+		unsigned SpaceSize = 8
+>
+class ResizableCache : public CacheBase<_T>
+{
+public:
+	typedef _T DataType;
+
+	ResizableCache(): VMap(1 << SpaceSize, NULL)
+	{
+		Hand = 0;
+		Capacity = CacheSize > 0 ? CacheSize : 1;
+		Budget = 0;
+		Error = CacheOk;
+	}
+
+	virtual ~ResizableCache()
+	{
+		// сливает кэш деструктор устройства через Close()
+	}
+
+	_T*		GetData( unsigned Index, bool ForWrite )
+	{
+		if( Index >= VMap.size() )
+		{
+			Error = CacheBadIndex;
+			return NULL;
+		}
+
+		if( VMap[Index] != NULL )
+		{
+			this->Stats.Hit();
+			VMap[Index]->Dirty |= this->Blocks( ForWrite );
+			return &VMap[Index]->Obj;
+		}
+		this->Stats.Miss();
+
+		// пока пул меньше ёмкости - растим, иначе вытесняем
+		Container<_T>* Slot = Slots.size() < Capacity ? Grow() : NULL;
+		if( Slot == NULL ) Slot = Evict();
+		if( Slot == NULL ) return NULL;
+
+		if( !this->LoadPage( Index, Slot->Obj ) )
+		{
+			Error = CacheLoadFailed;
+			return NULL;
+		}
+
+		Slot->Index = Index;
+		Slot->Dirty = this->Blocks( ForWrite );
+		VMap[Index] = Slot;
+		return &Slot->Obj;
+	}
+
+	// берёт страницу на запись, грязными помечаются только блоки, покрывающие [Offset, Offset + Size)
+	_T*		GetDataForWrite( unsigned Index, unsigned Offset, unsigned Size )
+	{
+		_T* Ptr = GetData( Index, false );
+		if( Ptr ) VMap[Index]->Dirty |= this->Blocks( Offset, Size );
+		return Ptr;
+	}
+
+	// загружает и закрепляет страницу, каждому Pin должен соответствовать Unpin
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		_T* Ptr = GetData( Index, ForWrite );
+		if( Ptr ) VMap[Index]->PinCount++;
+		return Ptr;
+	}
+
+	void	Unpin( unsigned Index )
+	{
+		if( Index < VMap.size() && VMap[Index] != NULL && VMap[Index]->PinCount > 0 )
+			VMap[Index]->PinCount--;
+	}
+
+	// закрепляет страницы [Index, Index + Count) по одной, пакетной загрузки у политики нет
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		return this->PinEach( *this, Index, Count, ForWrite );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// помечает грязными блоки [Offset, Offset + Size) страницы Span[i]: страница закреплена,
+	// слот берётся из карты без поиска и без счёта попадания
+	void	MarkDirty( const PageSpan<_T>& Span, unsigned i, unsigned Offset, unsigned Size )
+	{
+		VMap[Span.GetIndex() + i]->Dirty |= this->Blocks( Offset, Size );
+	}
+
+	// сбрасывает все грязные страницы, страницы остаются в пуле
+	virtual bool	Flush()
+	{
+		vector< DirtyPage > Pages;
+		for( size_t i = 0; i < Slots.size(); i++ )
+		{
+			if( Slots[i]->Index >= 0 && Slots[i]->Dirty )
+			{
+				DirtyPage Page = { (unsigned)Slots[i]->Index, &Slots[i]->Obj, &Slots[i]->Dirty };
+				Pages.push_back( Page );
+			}
+		}
+		if( this->WriteBack( Pages ) ) return true;
+		Error = CacheSaveFailed;
+		return false;
+	}
+
+	// сбрасывает и выбрасывает все страницы пула, выделенные слоты остаются
+	virtual bool	Invalidate()
+	{
+		for( size_t i = 0; i < Slots.size(); i++ )
+			if( Slots[i]->PinCount > 0 )
+			{
+				Error = CacheAllPinned;
+				return false;
+			}
+		if( !Flush() ) return false;
+
+		for( size_t i = 0; i < Slots.size(); i++ ) Slots[i]->Index = -1;
+		fill( VMap.begin(), VMap.end(), (Container<_T>*)NULL );
+		this->ClearTier();
+		return true;
+	}
+
+	// память одного слота пула
+	static size_t	SlotBytes()
+	{
+		return sizeof( Container<_T> );
+	}
+
+	// новая ёмкость пула в слотах (не меньше одного и не больше бюджета):
+	// рост - по мере промахов, уменьшение - сразу; false - освободить все лишние слоты не удалось
+	bool	Resize( unsigned NewCapacity )
+	{
+		Capacity = NewCapacity > 0 ? NewCapacity : 1;
+		if( Budget && Capacity > MaxSlots() ) Capacity = MaxSlots();
+		return Shrink( Capacity );
+	}
+
+	// бюджет памяти пула в байтах, 0 - без ограничения; уменьшает пул, если он уже больше
+	bool	SetBudget( size_t Bytes )
+	{
+		Budget = Bytes;
+		return Resize( Capacity );
+	}
+
+	// обработчик нехватки памяти: уменьшает ёмкость не меньше чем на Bytes байт (до одного слота)
+	// и освобождает слоты, возвращает сколько байт освобождено
+	size_t	ReleaseMemory( size_t Bytes )
+	{
+		size_t Before = Slots.size();
+		size_t Drop = (Bytes + SlotBytes() - 1) / SlotBytes();
+		Capacity = Before > Drop ? (unsigned)(Before - Drop) : 1;
+		Shrink( Capacity );
+		return (Before - Slots.size()) * SlotBytes();
+	}
+
+	unsigned	Size() const { return (unsigned)Slots.size(); }		// слотов выделено
+	unsigned	GetCapacity() const { return Capacity; }
+	size_t		MemoryUsage() const { return Slots.size() * SlotBytes(); }
+
+	CacheError	LastError() const { return Error; }
+
+protected:
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+private:
+	typedef typename CacheBase<_T>::DirtyPage DirtyPage;
+	typedef typename CacheBase<_T>::BlockMask BlockMask;
+
+	template<class __T>
+	struct Container
+	{
+		__T	 Obj;
+		int	 Index;
+		BlockMask Dirty;	// грязные блоки страницы
+		unsigned PinCount;	// сколько раз страница закреплена
+	};
+	vector< unique_ptr< Container<_T> > >  Slots;	// слоты в порядке обхода вытеснения
+	vector< Container<_T> * > VMap;
+	unsigned      Hand;		// следующий кандидат на вытеснение
+	unsigned      Capacity;	// до скольких слотов пул растёт
+	size_t        Budget;
+	CacheError    Error;
+
+	unsigned	MaxSlots() const
+	{
+		size_t Max = Budget / SlotBytes();
+		return Max > 0 ? (unsigned)min( Max, (size_t)~0u ) : 1;
+	}
+
+	// новый пустой слот, NULL - памяти нет, придётся вытеснять
+	Container<_T>*	Grow()
+	{
+		Container<_T>* Slot = new (nothrow) Container<_T>;
+		if( Slot == NULL ) return NULL;
+		Slot->Index = -1;
+		Slot->Dirty = 0;
+		Slot->PinCount = 0;
+		Slots.push_back( unique_ptr< Container<_T> >( Slot ) );
+		return Slot;
+	}
+
+	// освобождает слот пула для новой страницы, закреплённые слоты пропускает
+	Container<_T>*	Evict()
+	{
+		if( Slots.empty() )
+		{
+			Error = CacheAllPinned;
+			return NULL;
+		}
+
+		unsigned Count = (unsigned)Slots.size();
+		unsigned PoolPos = Hand % Count;
+		for( unsigned Tries = 1; Slots[PoolPos]->PinCount > 0; Tries++ )
+		{
+			if( Tries == Count )
+			{
+				Error = CacheAllPinned;
+				return NULL;
+			}
+			PoolPos = (PoolPos + 1) % Count;
+		}
+
+		Container<_T>* Slot = Slots[PoolPos].get();
+		if( Slot->Index >= 0 )
+		{
+			if( Slot->Dirty )
+			{
+				if( !this->SavePage( Slot->Index, Slot->Obj, Slot->Dirty ) )
+				{
+					// ошибка сохранения страницы
+					Error = CacheSaveFailed;
+					return NULL;
+				}
+				Slot->Dirty = 0;
+			}
+			this->Retire( Slot->Index, Slot->Obj );
+			VMap[Slot->Index] = NULL;
+			Slot->Index = -1;
+			this->Stats.Eviction();
+		}
+		Hand = PoolPos + 1;
+		return Slot;
+	}
+
+	// освобождает слоты сверх Target: сначала чистые, потом грязные после общего сброса
+	bool	Shrink( unsigned Target )
+	{
+		if( Slots.size() <= Target ) return true;
+		size_t Excess = Slots.size() - Target;
+
+		vector< Container<_T>* > Victims;
+		for( int Pass = 0; Pass < 2 && Victims.size() < Excess; Pass++ )
+			for( size_t i = 0; i < Slots.size() && Victims.size() < Excess; i++ )
+			{
+				Container<_T>* Slot = Slots[i].get();
+				if( Slot->PinCount == 0 && (Slot->Index >= 0 && Slot->Dirty) == (Pass == 1) )
+					Victims.push_back( Slot );
+			}
+
+		vector< DirtyPage > Pages;
+		for( size_t i = 0; i < Victims.size(); i++ )
+		{
+			if( Victims[i]->Index >= 0 && Victims[i]->Dirty )
+			{
+				DirtyPage Page = { (unsigned)Victims[i]->Index, &Victims[i]->Obj, &Victims[i]->Dirty };
+				Pages.push_back( Page );
+			}
+		}
+		bool Result = this->WriteBack( Pages );
+		if( !Result ) Error = CacheSaveFailed;
+
+		// несохранённые страницы остаются в пуле
+		sort( Victims.begin(), Victims.end() );
+		size_t Kept = 0;
+		for( size_t i = 0; i < Slots.size(); i++ )
+		{
+			Container<_T>* Slot = Slots[i].get();
+			if( !Slot->Dirty && binary_search( Victims.begin(), Victims.end(), Slot ) )
+			{
+				if( Slot->Index >= 0 )
+				{
+					this->Retire( Slot->Index, Slot->Obj );
+					VMap[Slot->Index] = NULL;
+					this->Stats.Eviction();
+				}
+				Slots[i].reset();
+			}
+			else Slots[Kept++].swap( Slots[i] );
+		}
+		Slots.resize( Kept );
+		Hand = Kept > 0 ? Hand % (unsigned)Kept : 0;
+
+		if( Slots.size() > Target && Result ) Error = CacheAllPinned;
+		return Slots.size() <= Target;
+	}
+};
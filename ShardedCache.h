@@ -0,0 +1,330 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include "PageDevice.h"
+
+using namespace std;
+/*
+	Потокобезопасная политика кэширования, разбитая на независимые шарды.
+	Страница Index живёт в шарде Index % ShardCount (соседние страницы в разных шардах,
+	поэтому последовательный проход нагружает все шарды равномерно). У каждого шарда свой
+	мьютекс, свой пул из CacheSize / ShardCount слотов (остаток от деления - по слоту первым
+	шардам), своя карта и свой указатель вытеснения,
+	так что потоки, работающие с разными шардами, друг другу не мешают. Страницы всех шардов
+	лежат в одном PageBuffer, по участку на шард, описания слотов - в массивах шардов.
+
+		StaticPageDevice<16,64,8,ShardedCache>	SPD;				// 8 шардов
+		MemoryDevice<24,16,64,ShardedCache,StaticPageDevice>	CSMD;
+
+	Из нескольких потоков страницы берутся через Pin/PageHandle: указатель из GetData
+	может быть отдан другой странице промахом соседнего потока в любой момент.
+
+	Save/Load устройства вызываются параллельно из разных шардов (для разных страниц).
+	Попадания, промахи и вытеснения считаются в счётчиках шарда, чтобы при CACHE_STATS
+	потоки разных шардов не писали в одну строку кэша.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						ShardedCacheN
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	class _T,
+		unsigned CacheSize = 16,
+		unsigned SpaceSize = 8,
+		unsigned ShardCount = 8
+>
+class ShardedCacheN : public CacheBase<_T>
+{
+public:
+	typedef _T DataType;
+
+	// слотов в шарде; остаток CacheSize % ShardCount достаётся первым шардам по одному слоту
+	static const unsigned ShardSize = CacheSize / ShardCount;
+	static const unsigned ShardSpace = ((1 << SpaceSize) + ShardCount - 1) / ShardCount;
+
+	ShardedCacheN(): Pages(CacheSize)
+	{
+		static_assert( ShardSize > 0, "CacheSize must be at least ShardCount" );
+		for( unsigned s = 0, First = 0; s < ShardCount; s++ )
+		{
+			Shards[s].Size = ShardSize + (s < CacheSize % ShardCount ? 1 : 0);
+			Shards[s].Pages = &Pages[First];
+			First += Shards[s].Size;
+			Shards[s].Pool.resize( Shards[s].Size );
+			Shards[s].VMap.resize( ShardSpace, -1 );
+			Shards[s].LastLoadedIndex = -1;
+			Shards[s].Error = CacheOk;
+			// Проинициализируем пул шарда
+			for( unsigned i = 0; i < Shards[s].Size; i++ )
+			{
+				Shards[s].Pool[i].Index = -1;
+				Shards[s].Pool[i].Dirty = 0;
+				Shards[s].Pool[i].PinCount = 0;
+			}
+		}
+	}
+
+	virtual ~ShardedCacheN()
+	{
+		// сливает кэш деструктор устройства через Close()
+	}
+
+	_T*		GetData( unsigned Index, bool ForWrite )
+	{
+		if( Index >= (1u << SpaceSize) )
+		{
+			ThreadError = CacheBadIndex;
+			return NULL;
+		}
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		return Fetch( S, Index, this->Blocks( ForWrite ) );
+	}
+
+	// берёт страницу на запись, грязными помечаются только блоки, покрывающие [Offset, Offset + Size)
+	_T*		GetDataForWrite( unsigned Index, unsigned Offset, unsigned Size )
+	{
+		if( Index >= (1u << SpaceSize) )
+		{
+			ThreadError = CacheBadIndex;
+			return NULL;
+		}
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		return Fetch( S, Index, this->Blocks( Offset, Size ) );
+	}
+
+	// загружает и закрепляет страницу, каждому Pin должен соответствовать Unpin
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		if( Index >= (1u << SpaceSize) )
+		{
+			ThreadError = CacheBadIndex;
+			return NULL;
+		}
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		_T* Ptr = Fetch( S, Index, this->Blocks( ForWrite ) );
+		if( Ptr ) S.Pool[S.VMap[Index / ShardCount]].PinCount++;
+		return Ptr;
+	}
+
+	void	Unpin( unsigned Index )
+	{
+		if( Index >= (1u << SpaceSize) ) return;
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		int PoolPos = S.VMap[Index / ShardCount];
+		if( PoolPos >= 0 && S.Pool[PoolPos].PinCount > 0 ) S.Pool[PoolPos].PinCount--;
+	}
+
+	// закрепляет страницы [Index, Index + Count) по одной, пакетной загрузки у политики нет
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		return this->PinEach( *this, Index, Count, ForWrite );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// помечает грязными блоки [Offset, Offset + Size) страницы Span[i]: страница закреплена,
+	// слот берётся из карты без поиска и без счёта попадания
+	void	MarkDirty( const PageSpan<_T>& Span, unsigned i, unsigned Offset, unsigned Size )
+	{
+		unsigned Index = Span.GetIndex() + i;
+		Shard& S = Shards[Index % ShardCount];
+		lock_guard< mutex > Guard( S.Lock );
+		S.Pool[S.VMap[Index / ShardCount]].Dirty |= this->Blocks( Offset, Size );
+	}
+
+	virtual bool	Flush()
+	{
+		// соседние страницы лежат в разных шардах, поэтому для склейки берём все шарды сразу
+		// (всегда в одном порядке, чтобы не было взаимоблокировок)
+		unsigned s;
+		for( s = 0; s < ShardCount; s++ ) Shards[s].Lock.lock();
+		bool Result = WriteBackAll();
+		for( s = ShardCount; s-- > 0; ) Shards[s].Lock.unlock();
+		return Result;
+	}
+
+	// сбрасывает и выбрасывает все страницы всех шардов - под всеми мьютексами сразу
+	virtual bool	Invalidate()
+	{
+		unsigned s, i;
+		for( s = 0; s < ShardCount; s++ ) Shards[s].Lock.lock();
+
+		bool Result = true;
+		for( s = 0; s < ShardCount && Result; s++ )
+			for( i = 0; i < Shards[s].Size && Result; i++ )
+				if( Shards[s].Pool[i].PinCount > 0 )
+				{
+					ThreadError = CacheAllPinned;
+					Result = false;
+				}
+		if( Result && !WriteBackAll() )
+		{
+			ThreadError = CacheSaveFailed;
+			Result = false;
+		}
+
+		if( Result )
+		{
+			for( s = 0; s < ShardCount; s++ )
+			{
+				for( i = 0; i < Shards[s].Size; i++ ) Shards[s].Pool[i].Index = -1;
+				fill( Shards[s].VMap.begin(), Shards[s].VMap.end(), -1 );
+				Shards[s].LastLoadedIndex = -1;
+			}
+			this->ClearTier();
+		}
+
+		for( s = ShardCount; s-- > 0; ) Shards[s].Lock.unlock();
+		return Result;
+	}
+
+	virtual CacheStatistics	Statistics() const
+	{
+		CacheStatistics Result = CacheBase<_T>::Statistics();
+		for( unsigned s = 0; s < ShardCount; s++ ) Shards[s].Stats.AddTo( Result );
+		return Result;
+	}
+
+	virtual void	ResetStatistics()
+	{
+		CacheBase<_T>::ResetStatistics();
+		for( unsigned s = 0; s < ShardCount; s++ ) Shards[s].Stats.Reset();
+	}
+
+	// ошибка последнего отказа в шарде страницы Index
+	CacheError	LastError( unsigned Index ) const
+	{
+		return Index < (1u << SpaceSize) ? Shards[Index % ShardCount].Error : CacheBadIndex;
+	}
+
+	// ошибка последнего отказа в этом потоке - у серии GetDataRange страницы в разных шардах
+	CacheError	LastError() const
+	{
+		return ThreadError;
+	}
+
+protected:
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+private:
+	typedef typename CacheBase<_T>::DirtyPage DirtyPage;
+	typedef typename CacheBase<_T>::BlockMask BlockMask;
+
+	// описание слота пула, сама страница - Pages[номер слота] шарда
+	struct Slot
+	{
+		int	 Index;
+		BlockMask Dirty;	// грязные блоки страницы
+		unsigned PinCount;	// сколько раз страница закреплена
+	};
+
+	// шарды не делят строку кэша с соседями: между ними Pad в целую строку. Не alignas -
+	// до C++17 new не обязан выравнивать объект устройства сильнее, чем на 16 байт
+	struct Shard
+	{
+		mutex         Lock;
+		unsigned      Size;	// слотов в пуле шарда
+		_T*           Pages;	// страницы шарда - его участок общего буфера
+		vector< Slot >           Pool;
+		vector< int >            VMap;	// Index / ShardCount -> позиция в пуле шарда, -1 если не загружена
+		int           LastLoadedIndex;
+		CacheError    Error;
+		CacheCounters< sizeof(_T) >	Stats;	// попадания, промахи и вытеснения шарда
+		char          Pad[64];
+	};
+	PageBuffer< _T >         Pages;	// страницы всех шардов подряд, по участку на шард
+	Shard         Shards[ShardCount];
+	static thread_local CacheError	ThreadError;
+
+	// грязные страницы всех шардов одним WriteBack, вызывается под всеми мьютексами
+	bool	WriteBackAll()
+	{
+		vector< DirtyPage > Dirty;
+		for( unsigned s = 0; s < ShardCount; s++ )
+		{
+			for( unsigned i = 0; i < Shards[s].Size; i++ )
+			{
+				Slot& Held = Shards[s].Pool[i];
+				if( Held.Dirty && Held.Index >= 0 )
+				{
+					DirtyPage Page = { (unsigned)Held.Index, &Shards[s].Pages[i], &Held.Dirty };
+					Dirty.push_back( Page );
+				}
+			}
+		}
+		return this->WriteBack( Dirty );
+	}
+
+	// то же, что Cache::GetData, в пределах шарда и под его мьютексом; Written - блоки под запись
+	_T*		Fetch( Shard& S, unsigned Index, BlockMask Written )
+	{
+		int& Mapped = S.VMap[Index / ShardCount];
+		if( Mapped >= 0 )
+		{
+			S.Stats.Hit();
+			S.Pool[Mapped].Dirty |= Written;
+			return &S.Pages[Mapped];
+		}
+		S.Stats.Miss();
+
+		// найдём место для загрузки, закреплённые слоты пропускаем
+		unsigned PoolPos = (S.LastLoadedIndex + 1) % S.Size;
+		for( unsigned Tries = 1; S.Pool[PoolPos].PinCount > 0; Tries++ )
+		{
+			if( Tries == S.Size )
+			{
+				S.Error = ThreadError = CacheAllPinned;
+				return NULL;
+			}
+			PoolPos = (PoolPos + 1) % S.Size;
+		}
+
+		Slot& Victim = S.Pool[PoolPos];
+		_T& Page = S.Pages[PoolPos];
+		if( Victim.Index >= 0 )
+		{
+			if( Victim.Dirty )
+			{
+				if( !this->SavePage( Victim.Index, Page, Victim.Dirty ) )
+				{
+					// ошибка сохранения страницы
+					S.Error = ThreadError = CacheSaveFailed;
+					return NULL;
+				}
+				Victim.Dirty = 0;
+			}
+			this->Retire( Victim.Index, Page );
+			S.VMap[Victim.Index / ShardCount] = -1;
+			Victim.Index = -1;
+			S.Stats.Eviction();
+		}
+
+		if( !this->LoadPage( Index, Page ) )
+		{
+			S.Error = ThreadError = CacheLoadFailed;
+			return NULL;
+		}
+
+		Victim.Index = Index;
+		Victim.Dirty = Written;
+		S.LastLoadedIndex = PoolPos;
+		Mapped = PoolPos;
+		return &Page;
+	}
+};
+
+template< class _T, unsigned CacheSize, unsigned SpaceSize, unsigned ShardCount >
+thread_local CacheError ShardedCacheN<_T, CacheSize, SpaceSize, ShardCount>::ThreadError = CacheOk;
+
+// политика с 8 шардами для параметра CachePolicy
+template< class _T, unsigned CacheSize = 16, unsigned SpaceSize = 8 >
+using ShardedCache = ShardedCacheN< _T, CacheSize, SpaceSize, 8 >;
@@ -0,0 +1,296 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <memory>
+#include "ZeroCheck.h"
+
+using namespace std;
+/*
+	Устройство страниц в памяти со снимками копированием при записи. Физические страницы
+	лежат в общем хранилище со счётчиками ссылок, устройство держит только карту
+	"номер страницы -> физическая страница". Снимок - замороженная копия карты: создание
+	стоит прохода по карте и увеличения счётчиков, данные не копируются. Save страницы,
+	на которую ссылается кто-то ещё (снимок, другое устройство), кладёт её в новую физическую
+	страницу, единственная ссылка переписывается на месте.
+
+		MemoryDevice<30,16,16,ShardedCache,SnapshotPageDevice>	MD;
+		...
+		MD.Device().Snapshot()		// сбрасывает кэш и замораживает карту
+
+		MemoryDevice<30,16,16,LRUCache,SnapshotPageDevice>	Backup;
+		Backup.Device().Open( Image );	// пул сбрасывается и выбрасывается, дальше читаем снимок
+
+	Устройство, открытое на снимке, - независимая копия: его записи снимку не видны, как
+	и снимку - записи исходного устройства. Снимок живёт, пока на него есть shared_ptr,
+	его страницы освобождаются вместе с последней ссылкой. Страницы, которые ни разу
+	не сохранялись или сохранены нулевыми, места в хранилище не занимают.
+
+	Snapshot() начинается с Flush() кэша, и на время сброса писатели ждут: у ShardedCache
+	Flush берёт мьютексы всех шардов. Дёшево только само замораживание карты - без копирования
+	данных. Снимок видит страницы, сохранённые в устройство; то, что после Flush успели изменить
+	в пуле, в него не попадёт. Карта меняется и копируется под мьютексом устройства, так что
+	каждая страница снимка - целиком одно из её сохранений.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						PageStore
+///////////////////////////////////////////////////////////////////////////////
+
+// физические страницы со счётчиками ссылок, общие для устройства, его снимков и копий
+template< class _T >
+class PageStore
+{
+public:
+	static const unsigned NoPage = ~0u;
+
+	PageStore(): Used(0)
+	{
+	}
+
+	// новая страница с одной ссылкой
+	unsigned	Allocate()
+	{
+		lock_guard< mutex > Guard( Lock );
+		unsigned Id;
+		if( !Free.empty() )
+		{
+			Id = Free.back();
+			Free.pop_back();
+		}
+		else
+		{
+			Slots.push_back( unique_ptr< Slot >( new Slot ) );
+			Id = (unsigned)Slots.size() - 1;
+		}
+		Slots[Id]->Refs = 1;
+		Used++;
+		return Id;
+	}
+
+	void	AddRef( unsigned Id )
+	{
+		if( Id == NoPage ) return;
+		lock_guard< mutex > Guard( Lock );
+		Slots[Id]->Refs++;
+	}
+
+	void	Release( unsigned Id )
+	{
+		if( Id == NoPage ) return;
+		lock_guard< mutex > Guard( Lock );
+		Drop( Id );
+	}
+
+	// по ссылке на каждую страницу карты - одной блокировкой
+	void	AddRef( const vector< unsigned >& Ids )
+	{
+		lock_guard< mutex > Guard( Lock );
+		for( size_t i = 0; i < Ids.size(); i++ )
+			if( Ids[i] != NoPage ) Slots[Ids[i]]->Refs++;
+	}
+
+	void	Release( const vector< unsigned >& Ids )
+	{
+		lock_guard< mutex > Guard( Lock );
+		for( size_t i = 0; i < Ids.size(); i++ )
+			if( Ids[i] != NoPage ) Drop( Ids[i] );
+	}
+
+	// ссылка единственная - страницу можно менять на месте
+	bool	Unique( unsigned Id ) const
+	{
+		lock_guard< mutex > Guard( Lock );
+		return Slots[Id]->Refs == 1;
+	}
+
+	// данные страницы не переезжают, пока на неё есть ссылка
+	_T*		Data( unsigned Id ) const
+	{
+		lock_guard< mutex > Guard( Lock );
+		return &Slots[Id]->Data;
+	}
+
+	// занятых физических страниц
+	size_t	Pages() const
+	{
+		lock_guard< mutex > Guard( Lock );
+		return Used;
+	}
+
+private:
+	struct Slot
+	{
+		_T			Data;
+		unsigned	Refs;
+	};
+
+	mutable mutex	Lock;
+	vector< unique_ptr< Slot > >	Slots;
+	vector< unsigned >	Free;
+	size_t			Used;
+
+	void	Drop( unsigned Id )
+	{
+		if( --Slots[Id]->Refs > 0 ) return;
+		Free.push_back( Id );
+		Used--;
+	}
+
+	PageStore( const PageStore& );
+	PageStore& operator=( const PageStore& );
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						PageSnapshot
+///////////////////////////////////////////////////////////////////////////////
+
+// замороженная карта страниц; создаётся SnapshotPageDevice::Snapshot
+template< class _T >
+class PageSnapshot
+{
+public:
+	PageSnapshot( const shared_ptr< PageStore< _T > >& From, const vector< unsigned >& Pages ): Store(From), Map(Pages)
+	{
+	}
+
+	~PageSnapshot()
+	{
+		Store->Release( Map );
+	}
+
+	// страниц с ненулевым содержимым
+	size_t	Pages() const
+	{
+		size_t Count = 0;
+		for( size_t i = 0; i < Map.size(); i++ )
+			if( Map[i] != PageStore< _T >::NoPage ) Count++;
+		return Count;
+	}
+
+	const shared_ptr< PageStore< _T > >&	GetStore() const { return Store; }
+	const vector< unsigned >&	GetMap() const { return Map; }
+
+private:
+	shared_ptr< PageStore< _T > >	Store;
+	vector< unsigned >	Map;		// ссылки на страницы Store взяты создателем
+
+	PageSnapshot( const PageSnapshot& );
+	PageSnapshot& operator=( const PageSnapshot& );
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//						SnapshotPageDevice
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	unsigned PageSize = 16,
+	unsigned PoolSize = 16,
+	unsigned SpaceSize = 8,
+	template< class, unsigned, unsigned > class CachePolicy = Cache
+>
+class SnapshotPageDevice : public PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>
+{
+	typedef PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy> Base;
+	typedef PageStore< Page<PageSize> > StoreType;
+	static const size_t PageBytes = sizeof(Page<PageSize>);
+public:
+	typedef shared_ptr< const PageSnapshot< Page<PageSize> > >	SnapshotType;
+
+	SnapshotPageDevice(): Store(new StoreType), Map(Base::__PageCount, (unsigned)StoreType::NoPage)
+	{
+	}
+
+	virtual ~SnapshotPageDevice()
+	{
+		// сливаем кэш, пока Save этого устройства ещё доступен
+		this->Close();
+		Store->Release( Map );
+	}
+
+	// сбрасывает кэш и замораживает карту; NULL - сброс не удался
+	SnapshotType	Snapshot()
+	{
+		if( !this->Flush() ) return SnapshotType();
+		lock_guard< mutex > Guard( Lock );
+		Store->AddRef( Map );
+		return SnapshotType( new PageSnapshot< Page<PageSize> >( Store, Map ) );
+	}
+
+	// делает устройство копией снимка: прежние страницы пула сбрасываются в старую карту
+	// и выбрасываются вместе со вторым уровнем; false - страница закреплена или сброс не удался,
+	// устройство остаётся прежним. Одновременных обращений к устройству быть не должно
+	bool	Open( const SnapshotType& From )
+	{
+		if( !From || From->GetMap().size() != Map.size() ) return false;
+		if( !this->Invalidate() ) return false;
+		lock_guard< mutex > Guard( Lock );
+		Store->Release( Map );
+		Store = From->GetStore();
+		Map = From->GetMap();
+		Store->AddRef( Map );
+		return true;
+	}
+
+	// физических страниц в хранилище - вместе со снимками и копиями, которые его делят
+	size_t	StorePages() const
+	{
+		lock_guard< mutex > Guard( Lock );
+		return Store->Pages();
+	}
+
+protected:
+	virtual bool  Load( unsigned Index, Page<PageSize>& Ref )
+	{
+		if( Index >= Base::__PageCount ) return false;
+		lock_guard< mutex > Guard( Lock );
+		if( Map[Index] == StoreType::NoPage ) memset( &Ref, 0, PageBytes );
+		else memcpy( &Ref, Store->Data( Map[Index] ), PageBytes );
+		return true;
+	}
+
+	virtual bool  Save( unsigned Index, Page<PageSize>& Ref )
+	{
+		if( Index >= Base::__PageCount ) return false;
+		bool Zeroed = IsZero( &Ref, PageBytes );
+		lock_guard< mutex > Guard( Lock );
+		unsigned Id = Map[Index];
+		if( Zeroed )
+		{
+			Store->Release( Id );
+			Map[Index] = StoreType::NoPage;
+			return true;
+		}
+		// страницу делит снимок - пишем в новую
+		if( Id == StoreType::NoPage || !Store->Unique( Id ) )
+		{
+			Store->Release( Id );
+			Id = Map[Index] = Store->Allocate();
+		}
+		memcpy( Store->Data( Id ), &Ref, PageBytes );
+		return true;
+	}
+
+	// переносим только изменённые участки, если страница не общая
+	virtual bool  SaveExtents( unsigned Index, Page<PageSize>& Ref, const PageExtent* Extents, unsigned Count )
+	{
+		if( Index >= Base::__PageCount ) return false;
+		{
+			lock_guard< mutex > Guard( Lock );
+			unsigned Id = Map[Index];
+			if( Id != StoreType::NoPage && Store->Unique( Id ) )
+			{
+				Page<PageSize>* Target = Store->Data( Id );
+				for( unsigned i = 0; i < Count; i++ )
+					memcpy( Target->Data + Extents[i].Offset, Ref.Data + Extents[i].Offset, Extents[i].Size );
+				return true;
+			}
+		}
+		return Save( Index, Ref );
+	}
+
+private:
+	shared_ptr< StoreType >	Store;
+	vector< unsigned >	Map;		// номер страницы -> страница Store, NoPage - нулевая
+	mutable mutex		Lock;		// карта и запись в свои страницы; Snapshot копирует карту под ним же
+};
@@ -1,35 +1,92 @@
 #pragma once
 #include <memory.h>
+#include <atomic>
+#include <memory>
+#include <bitset>
+#include <new>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#include "ZeroCheck.h"
 
+using namespace std;
+/*
+	Устройство страниц в оперативной памяти. Адреса под всё пространство только резервируются,
+	память страница получает при первом сохранении ненулевых данных (или при первой выдаче
+	через Direct) - большое разреженное пространство стоит столько, сколько в нём записано.
+	В Linux это анонимное отображение MAP_NORESERVE, заполняемое ядром нулями по требованию,
+	в Windows - VirtualAlloc( MEM_RESERVE ) и MEM_COMMIT страницы при первой записи.
+
+	Страница, которая ни разу не сохранялась, читается memset'ом, без обращения к резерву.
+	Сохранение нулевой страницы поверх несохранённой ничего не делает.
+*/
 
 template
-< 
-	unsigned PageSize = 16, 
+<
+	unsigned PageSize = 16,
 	unsigned PoolSize = 16,
 	unsigned SpaceSize = 8,
 	template< class, unsigned, unsigned > class CachePolicy = Cache
 >
 class StaticPageDevice : public PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>
 {
-	// собственно сама статическая память
-	Page<PageSize>	Pages[__PageCount];
-	
+	typedef PageDevice<PageSize, PoolSize, SpaceSize, CachePolicy> Base;
+	static const size_t PageBytes = sizeof(Page<PageSize>);
+	static const size_t SpaceBytes = PageBytes * Base::__PageCount;
+	static const size_t Words = (Base::__PageCount + 63) / 64;
+
+	// собственно сама память - резерв под всё пространство
+	Page<PageSize>*	Pages;
+	// бит на страницу: страница сохранялась и лежит в резерве (шарды пишут одновременно)
+	unique_ptr< atomic< unsigned long long >[] >	Stored;
+
 public:
-	StaticPageDevice()
+	StaticPageDevice(): Pages(NULL), Stored(new atomic< unsigned long long >[Words])
 	{
+#ifdef _WIN32
+		Pages = (Page<PageSize>*)VirtualAlloc( NULL, SpaceBytes, MEM_RESERVE, PAGE_NOACCESS );
+#else
+		void* Area = mmap( NULL, SpaceBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+		if( Area != MAP_FAILED ) Pages = (Page<PageSize>*)Area;
+#ifdef MADV_NOHUGEPAGE
+		// большая страница на одну записанную сделала бы пространство плотным
+		if( Pages ) madvise( Pages, SpaceBytes, MADV_NOHUGEPAGE );
+#endif
+#endif
+		if( Pages == NULL ) throw bad_alloc();
 		// Проинициализирум карту памяти
-		for( int a = 0; a < __PageCount; a++ )
-			memset( Pages[a].Data, 0, sizeof(Page<PageSize>) );
+		for( size_t a = 0; a < Words; a++ )
+			Stored[a].store( 0 );
 	};
 
-	virtual ~StaticPageDevice()	{};
+	virtual ~StaticPageDevice()
+	{
+		// сливаем кэш, пока Save этого устройства ещё доступен
+		this->Close();
+#ifdef _WIN32
+		VirtualFree( Pages, 0, MEM_RELEASE );
+#else
+		munmap( Pages, SpaceBytes );
+#endif
+	};
+
+	// сколько страниц получили память
+	unsigned long long	StoredPages() const
+	{
+		unsigned long long Count = 0;
+		for( size_t a = 0; a < Words; a++ ) Count += bitset< 64 >( Stored[a].load() ).count();
+		return Count;
+	};
 
 protected:
 	virtual bool  Load( unsigned Index, Page<PageSize>& Ref )
 	{
-		if( Index < __PageCount )
+		if( Index < Base::__PageCount )
 		{
-			memcpy( &Ref, Pages[Index].Data, sizeof(Page<PageSize>) );
+			if( IsStored( Index ) ) memcpy( &Ref, Pages[Index].Data, PageBytes );
+			else memset( &Ref, 0, PageBytes );
 			return true;
 		}
 		return false;
@@ -37,13 +94,53 @@ protected:
 
 	virtual bool  Save( unsigned Index, Page<PageSize>& Ref )
 	{
-		if( Index < __PageCount )
+		if( Index < Base::__PageCount )
 		{
-			memcpy( Pages[Index].Data, &Ref, sizeof(Page<PageSize>) );
+			if( !IsStored( Index ) && IsZero( &Ref, PageBytes ) ) return true;
+			if( !Commit( Index ) ) return false;
+			memcpy( Pages[Index].Data, &Ref, PageBytes );
 			return true;
 		}
 		return false;
 	};
-};
 
+	// страницы и так лежат в памяти - PassThroughCache отдаёт их без копирования
+	virtual Page<PageSize>*  Direct( unsigned Index )
+	{
+		return Index < Base::__PageCount && Commit( Index ) ? &Pages[Index] : NULL;
+	};
+
+	// переносим только изменённые участки страницы; несохранённая страница в резерве нулевая,
+	// как и неизменённые участки в пуле
+	virtual bool  SaveExtents( unsigned Index, Page<PageSize>& Ref, const PageExtent* Extents, unsigned Count )
+	{
+		if( Index < Base::__PageCount )
+		{
+			if( !IsStored( Index ) && IsZero( &Ref, PageBytes ) ) return true;
+			if( !Commit( Index ) ) return false;
+			for( unsigned i = 0; i < Count; i++ )
+				memcpy( Pages[Index].Data + Extents[i].Offset, Ref.Data + Extents[i].Offset, Extents[i].Size );
+			return true;
+		}
+		return false;
+	};
+
+private:
+	bool	IsStored( unsigned Index ) const
+	{
+		return (Stored[Index / 64].load() >> (Index % 64) & 1) != 0;
+	};
+
+	// даёт странице память; в Windows повторный MEM_COMMIT безвреден, так что гонки за соседние
+	// страницы одной страницы ОС не страшны
+	bool	Commit( unsigned Index )
+	{
+		if( IsStored( Index ) ) return true;
+#ifdef _WIN32
+		if( VirtualAlloc( &Pages[Index], PageBytes, MEM_COMMIT, PAGE_READWRITE ) == NULL ) return false;
+#endif
+		Stored[Index / 64] |= 1ull << (Index % 64);
+		return true;
+	};
+};
 
@@ -0,0 +1,343 @@
+#pragma once
+#include <vector>
+#include "PageDevice.h"
+
+using namespace std;
+/*
+	Политика кэширования 2Q (Johnson, Shasha), устойчивая к последовательным проходам.
+	Подключается вместо Cache через параметр CachePolicy у PageDevice/MemoryDevice.
+
+	Пул делится на две очереди:
+		A1in	- FIFO впервые загруженных страниц, не больше InSize слотов;
+		Am		- LRU страниц, к которым обратились повторно.
+	Вытесненные из A1in страницы запоминаются в призрачной очереди A1out
+	(только номера, без данных, не больше OutSize номеров). Промах по странице из A1out
+	означает повторное обращение - страница загружается сразу в Am.
+
+	Длинный последовательный проход проходит через A1in и A1out и не трогает Am,
+	поэтому рабочий набор переживает полный обход MemoryDevice.
+
+	Призрак живёт до первого повторного обращения: страница, поднятая из A1out в Am и потом
+	забытая Am, снова начинает с A1in.
+
+	Закреплённые через Pin/PageHandle слоты при выборе жертвы пропускаются. Страницы лежат
+	в PageBuffer, описания слотов с очередями - в своём массиве.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						TwoQCache
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	class _T,
+		unsigned CacheSize = 16,
+		unsigned SpaceSize = 8
+>
+class TwoQCache : public CacheBase<_T>
+{
+public:
+	typedef _T DataType;
+
+	static const unsigned InSize = CacheSize / 4 > 0 ? CacheSize / 4 : 1;
+	static const unsigned OutSize = CacheSize;
+
+	TwoQCache(): Pages(CacheSize), Pool(CacheSize), VMap(1 << SpaceSize, (int)-1), Ghosts(1 << SpaceSize, 0), GhostRing(OutSize)
+	{
+		Used = 0;
+		Error = CacheOk;
+		GhostHead = GhostCount = 0;
+		// Проинициализируем пул
+		for( int i = 0; i < (int)CacheSize; i++ )
+		{
+			Pool[i].Index = -1;
+			Pool[i].Dirty = 0;
+			Pool[i].PinCount = 0;
+			Pool[i].Queue = None;
+			Pool[i].Prev = Pool[i].Next = -1;
+		}
+	}
+
+	virtual ~TwoQCache()
+	{
+	}
+
+	_T*		GetData( unsigned Index, bool ForWrite )
+	{
+		if( Index >= VMap.size() )
+		{
+			Error = CacheBadIndex;
+			return NULL;
+		}
+
+		int PoolPos = VMap[Index];
+		if( PoolPos >= 0 )
+		{
+			this->Stats.Hit();
+			Pool[PoolPos].Dirty |= this->Blocks( ForWrite );
+			// попадание в A1in очередь не меняет: это защищает Am от коротких всплесков
+			if( Pool[PoolPos].Queue == Am )
+			{
+				Unlink( PoolPos );
+				PushHead( Am, PoolPos );
+			}
+			return &Pages[PoolPos];
+		}
+
+		// найдём место для загрузки
+		this->Stats.Miss();
+		if( Used < CacheSize )
+		{
+			PoolPos = Used++;
+		}
+		else
+		{
+			// пустой слот после неудачной загрузки стоит в хвосте A1in - занимаем его первым
+			QueueId From = Queues[A1in].Count > InSize || Queues[Am].Count == 0 ? A1in : Am;
+			if( Queues[A1in].Tail >= 0 && Pool[Queues[A1in].Tail].Index < 0 ) From = A1in;
+
+			PoolPos = Victim( From );
+			if( PoolPos < 0 ) PoolPos = Victim( From == A1in ? Am : A1in );
+			if( PoolPos < 0 )
+			{
+				Error = CacheAllPinned;
+				return NULL;
+			}
+
+			if( Pool[PoolPos].Index >= 0 )
+			{
+				if( Pool[PoolPos].Dirty )
+				{
+					if( !this->SavePage( Pool[PoolPos].Index, Pages[PoolPos], Pool[PoolPos].Dirty ) )
+					{
+						// ошибка сохранения страницы
+						Error = CacheSaveFailed;
+						return NULL;
+					}
+					Pool[PoolPos].Dirty = 0;
+				}
+				// из A1in страница уходит в призраки, из Am - забывается
+				if( Pool[PoolPos].Queue == A1in ) PushGhost( Pool[PoolPos].Index );
+				this->Retire( Pool[PoolPos].Index, Pages[PoolPos] );
+				VMap[Pool[PoolPos].Index] = -1;
+				Pool[PoolPos].Index = -1;
+				this->Stats.Eviction();
+			}
+			Unlink( PoolPos );
+		}
+
+		if( !this->LoadPage( Index, Pages[PoolPos] ) )
+		{
+			// слот остаётся пустым, вернём его в A1in хвостом, чтобы занять первым
+			PushTail( A1in, PoolPos );
+			Error = CacheLoadFailed;
+			return NULL;
+		}
+
+		Pool[PoolPos].Index = Index;
+		Pool[PoolPos].Dirty = this->Blocks( ForWrite );
+		VMap[Index] = PoolPos;
+		if( Ghosts[Index] )
+		{
+			// повторное обращение использовало призрака - его запись в кольце больше не действует
+			DropGhost( Index );
+			PushHead( Am, PoolPos );
+		}
+		else PushHead( A1in, PoolPos );
+		return &Pages[PoolPos];
+	}
+
+	// берёт страницу на запись, грязными помечаются только блоки, покрывающие [Offset, Offset + Size)
+	_T*		GetDataForWrite( unsigned Index, unsigned Offset, unsigned Size )
+	{
+		_T* Ptr = GetData( Index, false );
+		if( Ptr ) Pool[VMap[Index]].Dirty |= this->Blocks( Offset, Size );
+		return Ptr;
+	}
+
+	// загружает и закрепляет страницу, каждому Pin должен соответствовать Unpin
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		_T* Ptr = GetData( Index, ForWrite );
+		if( Ptr ) Pool[VMap[Index]].PinCount++;
+		return Ptr;
+	}
+
+	void	Unpin( unsigned Index )
+	{
+		if( Index < VMap.size() && VMap[Index] >= 0 && Pool[VMap[Index]].PinCount > 0 )
+			Pool[VMap[Index]].PinCount--;
+	}
+
+	// закрепляет страницы [Index, Index + Count) по одной, пакетной загрузки у политики нет
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		return this->PinEach( *this, Index, Count, ForWrite );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// помечает грязными блоки [Offset, Offset + Size) страницы Span[i]: страница закреплена,
+	// слот берётся из карты без поиска и без счёта попадания
+	void	MarkDirty( const PageSpan<_T>& Span, unsigned i, unsigned Offset, unsigned Size )
+	{
+		Pool[VMap[Span.GetIndex() + i]].Dirty |= this->Blocks( Offset, Size );
+	}
+
+	// сбрасывает все грязные страницы, страницы остаются в пуле
+	virtual bool	Flush()
+	{
+		vector< DirtyPage > Dirty;
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( Pool[i].Dirty && Pool[i].Index >= 0 )
+			{
+				DirtyPage Page = { (unsigned)Pool[i].Index, &Pages[i], &Pool[i].Dirty };
+				Dirty.push_back( Page );
+			}
+		}
+		if( this->WriteBack( Dirty ) ) return true;
+		Error = CacheSaveFailed;
+		return false;
+	}
+
+	// сбрасывает и выбрасывает все страницы пула и призраков: очереди заполняются заново
+	virtual bool	Invalidate()
+	{
+		for( unsigned i = 0; i < CacheSize; i++ )
+			if( Pool[i].PinCount > 0 )
+			{
+				Error = CacheAllPinned;
+				return false;
+			}
+		if( !Flush() ) return false;
+
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( Pool[i].Index >= 0 ) VMap[Pool[i].Index] = -1;
+			Pool[i].Index = -1;
+			Unlink( i );
+		}
+		Used = 0;
+		fill( Ghosts.begin(), Ghosts.end(), 0u );
+		GhostHead = GhostCount = 0;
+		this->ClearTier();
+		return true;
+	}
+
+	CacheError	LastError() const { return Error; }
+
+protected:
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+private:
+	typedef typename CacheBase<_T>::DirtyPage DirtyPage;
+	typedef typename CacheBase<_T>::BlockMask BlockMask;
+
+	enum QueueId { A1in = 0, Am = 1, None = 2 };
+
+	// описание слота пула, сама страница - Pages[номер слота]: поиск жертвы и Flush
+	// идут по плотному массиву описаний, не задевая страниц
+	struct Slot
+	{
+		int	 Index;
+		BlockMask Dirty;	// грязные блоки страницы
+		unsigned PinCount;	// сколько раз страница закреплена
+		QueueId Queue;	// очередь, в которой стоит слот
+		int	 Prev;		// соседи в очереди (индексы в Pool, -1 - нет соседа)
+		int	 Next;
+	};
+
+	struct QueueList
+	{
+		int		 Head;
+		int		 Tail;
+		unsigned Count;
+		QueueList(): Head(-1), Tail(-1), Count(0) {}
+	};
+
+	PageBuffer< _T >         Pages;
+	vector< Slot >           Pool;
+	vector< int >            VMap;	// индекс страницы -> позиция в Pool, -1 если не загружена
+	QueueList     Queues[2];
+	unsigned      Used;			// сколько слотов пула уже занималось
+	CacheError    Error;
+
+	// A1out: кольцо номеров страниц и для каждой страницы её позиция в кольце + 1 (0 - не призрак);
+	// записи забытых призраков остаются в кольце с номером NoGhost и выталкиваются по очереди
+	static const unsigned NoGhost = ~0u;
+	vector< unsigned >       Ghosts;
+	vector< unsigned >       GhostRing;
+	unsigned      GhostHead;
+	unsigned      GhostCount;
+
+	// ближайший к хвосту очереди незакреплённый слот, -1 если таких нет
+	int		Victim( QueueId Id )
+	{
+		int PoolPos = Queues[Id].Tail;
+		while( PoolPos >= 0 && Pool[PoolPos].PinCount > 0 ) PoolPos = Pool[PoolPos].Prev;
+		return PoolPos;
+	}
+
+	void	Unlink( int PoolPos )
+	{
+		if( Pool[PoolPos].Queue == None ) return;
+		QueueList& Q = Queues[Pool[PoolPos].Queue];
+		if( Pool[PoolPos].Prev >= 0 ) Pool[Pool[PoolPos].Prev].Next = Pool[PoolPos].Next;
+		else Q.Head = Pool[PoolPos].Next;
+		if( Pool[PoolPos].Next >= 0 ) Pool[Pool[PoolPos].Next].Prev = Pool[PoolPos].Prev;
+		else Q.Tail = Pool[PoolPos].Prev;
+		Q.Count--;
+		Pool[PoolPos].Queue = None;
+		Pool[PoolPos].Prev = Pool[PoolPos].Next = -1;
+	}
+
+	void	PushHead( QueueId Id, int PoolPos )
+	{
+		QueueList& Q = Queues[Id];
+		Pool[PoolPos].Queue = Id;
+		Pool[PoolPos].Prev = -1;
+		Pool[PoolPos].Next = Q.Head;
+		if( Q.Head >= 0 ) Pool[Q.Head].Prev = PoolPos;
+		else Q.Tail = PoolPos;
+		Q.Head = PoolPos;
+		Q.Count++;
+	}
+
+	void	PushTail( QueueId Id, int PoolPos )
+	{
+		QueueList& Q = Queues[Id];
+		Pool[PoolPos].Queue = Id;
+		Pool[PoolPos].Next = -1;
+		Pool[PoolPos].Prev = Q.Tail;
+		if( Q.Tail >= 0 ) Pool[Q.Tail].Next = PoolPos;
+		else Q.Head = PoolPos;
+		Q.Tail = PoolPos;
+		Q.Count++;
+	}
+
+	void	PushGhost( unsigned Index )
+	{
+		if( GhostCount == OutSize )
+		{	// выталкиваем самый старый номер
+			if( GhostRing[GhostHead] != NoGhost ) Ghosts[GhostRing[GhostHead]] = 0;
+			GhostHead = (GhostHead + 1) % OutSize;
+			GhostCount--;
+		}
+		DropGhost( Index );
+		unsigned Slot = (GhostHead + GhostCount) % OutSize;
+		GhostRing[Slot] = Index;
+		GhostCount++;
+		Ghosts[Index] = Slot + 1;
+	}
+
+	void	DropGhost( unsigned Index )
+	{
+		if( Ghosts[Index] == 0 ) return;
+		GhostRing[Ghosts[Index] - 1] = NoGhost;
+		Ghosts[Index] = 0;
+	}
+};
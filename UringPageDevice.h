@@ -0,0 +1,493 @@
+#pragma once
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <utility>
+#include "FilePageDevice.h"
+#if defined(__linux__) && !defined(CACHE_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CACHE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+#endif
+
+using namespace std;
+/*
+	Файловое устройство страниц с асинхронными пакетами через io_uring. Формат файла, Open,
+	SetSync и одиночные Load/Save - как у FilePageDevice. Отличаются пакеты: между BeginBatch
+	и EndBatch (WriteBack, упреждающее чтение и GetDataRange у Cache, сброс у WritebackCache)
+	LoadRange/SaveRange/SaveExtents/Save только ставят readv/writev в кольцо, EndBatch отдаёт
+	их ядру одним io_uring_enter и ждёт завершения всех. В полёте одновременно до QueueDepth
+	запросов - очередь NVMe не простаивает, пока поток ждёт одну страницу.
+
+		UringPageDevice<16,256,14,Cache>	UPD;
+		UPD.Open( "pages.bin" );
+		UPD.Async();		// false - кольцо не создалось, работаем синхронно
+
+	Кольцо поднимается сырыми системными вызовами, без liburing: нужны ядро 5.4+
+	(IORING_FEAT_SINGLE_MMAP) и заголовок <linux/io_uring.h>. Без них (другая ОС, старое ядро,
+	io_uring запрещён seccomp'ом, CACHE_NO_IO_URING) устройство ведёт себя как FilePageDevice.
+	Короткие передачи дописываются синхронно, чтение за концом файла даёт нули, как у FilePageDevice.
+
+	Пакеты разных потоков (шарды, поток сброса) выполняются по очереди под одной блокировкой,
+	обращения вне пакета идут синхронно и её не берут. Отказ io_uring_enter проваливает пакет,
+	но EndBatch возвращается только после того, как ядро завершило всё, что уже получило.
+
+	С Open( Path, Create, true ) кольцо читает и пишет мимо кэша ОС прямо в выровненный пул;
+	невыровненные страницы (см. FilePageDevice) и в пакете идут синхронно через буфер устройства.
+
+	Последний параметр шаблона - кольцо, по умолчанию IoRing; тесты подставляют обёртку
+	с отказами io_uring_enter.
+*/
+
+#ifdef CACHE_IO_URING
+
+///////////////////////////////////////////////////////////////////////////////
+//						IoRing
+///////////////////////////////////////////////////////////////////////////////
+
+// минимальная обёртка кольца io_uring: очередь подачи, io_uring_enter и разбор завершений
+class IoRing
+{
+public:
+	IoRing(): Fd(-1), Ring(NULL), RingBytes(0), Entries(NULL), EntriesBytes(0)
+	{
+	}
+
+	~IoRing()
+	{
+		Release();
+	}
+
+	// создаёт кольцо на Depth запросов, false - ядро не умеет или не разрешает
+	bool	Setup( unsigned Depth )
+	{
+		struct io_uring_params Params;
+		memset( &Params, 0, sizeof(Params) );
+		Fd = (int)syscall( __NR_io_uring_setup, Depth, &Params );
+		if( Fd < 0 ) return false;
+		if( !(Params.features & IORING_FEAT_SINGLE_MMAP) ) return Release();
+
+		// кольцо подачи и кольцо завершений - одним отображением
+		size_t SqBytes = Params.sq_off.array + Params.sq_entries * sizeof(unsigned);
+		size_t CqBytes = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+		RingBytes = SqBytes > CqBytes ? SqBytes : CqBytes;
+		void* Area = mmap( NULL, RingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQ_RING );
+		if( Area == MAP_FAILED ) return Release();
+		Ring = (char*)Area;
+
+		EntriesBytes = Params.sq_entries * sizeof(struct io_uring_sqe);
+		Area = mmap( NULL, EntriesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Fd, IORING_OFF_SQES );
+		if( Area == MAP_FAILED ) return Release();
+		Entries = (struct io_uring_sqe*)Area;
+
+		SqHead = (unsigned*)(Ring + Params.sq_off.head);
+		SqTail = (unsigned*)(Ring + Params.sq_off.tail);
+		SqMask = *(unsigned*)(Ring + Params.sq_off.ring_mask);
+		SqArray = (unsigned*)(Ring + Params.sq_off.array);
+		SqSize = Params.sq_entries;
+		CqHead = (unsigned*)(Ring + Params.cq_off.head);
+		CqTail = (unsigned*)(Ring + Params.cq_off.tail);
+		CqMask = *(unsigned*)(Ring + Params.cq_off.ring_mask);
+		Cqes = (struct io_uring_cqe*)(Ring + Params.cq_off.cqes);
+		return true;
+	}
+
+	bool		Ready() const { return Fd >= 0; }
+	unsigned	Depth() const { return SqSize; }
+
+	// ставит readv/writev в очередь подачи, false - очередь полна
+	bool	Queue( unsigned char Opcode, int File, const struct iovec* Parts, unsigned Count,
+		unsigned long long Offset, unsigned long long UserData )
+	{
+		unsigned Tail = *SqTail;
+		if( Tail - __atomic_load_n( SqHead, __ATOMIC_ACQUIRE ) >= SqSize ) return false;
+
+		unsigned Slot = Tail & SqMask;
+		struct io_uring_sqe& Entry = Entries[Slot];
+		memset( &Entry, 0, sizeof(Entry) );
+		Entry.opcode = Opcode;
+		Entry.fd = File;
+		Entry.addr = (unsigned long long)(size_t)Parts;
+		Entry.len = Count;
+		Entry.off = Offset;
+		Entry.user_data = UserData;
+		SqArray[Slot] = Slot;
+		__atomic_store_n( SqTail, Tail + 1, __ATOMIC_RELEASE );
+		return true;
+	}
+
+	// отдаёт ядру поставленные запросы и ждёт, пока в кольце завершений будет хотя бы Wait записей;
+	// false - ошибка, код в errno
+	bool	Submit( unsigned Wait )
+	{
+		return Enter( true, Wait );
+	}
+
+	// только ждёт Wait записей в кольце завершений, ничего не отдавая
+	bool	Await( unsigned Wait )
+	{
+		return Enter( false, Wait );
+	}
+
+	// поставлено в очередь подачи, но ещё не отдано ядру
+	unsigned	Unsubmitted() const
+	{
+		return *SqTail - __atomic_load_n( SqHead, __ATOMIC_ACQUIRE );
+	}
+
+	// снимает поставленные, но ещё не отданные ядру запросы, возвращает их число; без SQPOLL
+	// ядро читает очередь подачи только в io_uring_enter, так что они ему уже не попадутся
+	unsigned	Retract()
+	{
+		unsigned Head = __atomic_load_n( SqHead, __ATOMIC_ACQUIRE );
+		unsigned Count = *SqTail - Head;
+		__atomic_store_n( SqTail, Head, __ATOMIC_RELEASE );
+		return Count;
+	}
+
+	// закрывает кольцо, что ещё в полёте - ядро отменяет при его разборе
+	void	Shutdown()
+	{
+		Release();
+	}
+
+	// забирает одно завершение, false - завершений нет
+	bool	Reap( unsigned long long& UserData, int& Result )
+	{
+		unsigned Head = *CqHead;
+		if( Head == __atomic_load_n( CqTail, __ATOMIC_ACQUIRE ) ) return false;
+		const struct io_uring_cqe& Entry = Cqes[Head & CqMask];
+		UserData = Entry.user_data;
+		Result = Entry.res;
+		__atomic_store_n( CqHead, Head + 1, __ATOMIC_RELEASE );
+		return true;
+	}
+
+private:
+	int				Fd;
+	char*			Ring;
+	size_t			RingBytes;
+	struct io_uring_sqe*	Entries;
+	size_t			EntriesBytes;
+	unsigned*		SqHead;
+	unsigned*		SqTail;
+	unsigned*		SqArray;
+	unsigned		SqMask;
+	unsigned		SqSize;
+	unsigned*		CqHead;
+	unsigned*		CqTail;
+	unsigned		CqMask;
+	struct io_uring_cqe*	Cqes;
+
+	IoRing( const IoRing& );
+	IoRing& operator=( const IoRing& );
+
+	bool	Enter( bool Submit, unsigned Wait )
+	{
+		for( ;; )
+		{
+			unsigned Pending = Submit ? *SqTail - __atomic_load_n( SqHead, __ATOMIC_ACQUIRE ) : 0;
+			if( syscall( __NR_io_uring_enter, Fd, Pending, Wait, Wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 ) >= 0 )
+				return true;
+			if( errno != EINTR ) return false;
+		}
+	}
+
+	bool	Release()
+	{
+		if( Entries ) munmap( Entries, EntriesBytes );
+		if( Ring ) munmap( Ring, RingBytes );
+		if( Fd >= 0 ) close( Fd );
+		Entries = NULL;
+		Ring = NULL;
+		Fd = -1;
+		return false;
+	}
+};
+
+#else
+
+class IoRing;
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//						UringPageDevice
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	unsigned PageSize = 16,
+	unsigned PoolSize = 16,
+	unsigned SpaceSize = 8,
+	template< class, unsigned, unsigned > class CachePolicy = Cache,
+	class _Ring = IoRing
+>
+class UringPageDevice : public FilePageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>
+{
+	typedef FilePageDevice<PageSize, PoolSize, SpaceSize, CachePolicy> Base;
+	static const size_t PageBytes = sizeof(Page<PageSize>);
+public:
+	// запросов в полёте одновременно, не больше глубины кольца
+	static const unsigned QueueDepth = 64;
+
+	UringPageDevice()
+	{
+#ifdef CACHE_IO_URING
+		InFlight = 0;
+		BatchFailed = Wrote = false;
+#endif
+	}
+
+	virtual ~UringPageDevice()
+	{
+		// сливаем кэш, пока кольцо живо
+		this->Close();
+	}
+
+	// открывает файл и, если ядро позволяет, кольцо io_uring; Direct - как у FilePageDevice
+	bool	Open( const char* Path, bool Create = true, bool Direct = false )
+	{
+		if( !Base::Open( Path, Create, Direct ) ) return false;
+#ifdef CACHE_IO_URING
+		Ring.Setup( QueueDepth );
+#endif
+		return true;
+	}
+
+	// пакеты идут через io_uring; false - устройство работает синхронно, как FilePageDevice
+	bool	Async() const
+	{
+#ifdef CACHE_IO_URING
+		return Ring.Ready();
+#else
+		return false;
+#endif
+	}
+
+#ifdef CACHE_IO_URING
+protected:
+	virtual bool  Save( unsigned Index, Page<PageSize>& Ref )
+	{
+		if( Batching != this || !this->Aligned( &Ref ) ) return Base::Save( Index, Ref );
+		Page<PageSize>* One = &Ref;
+		return Enqueue( true, Index, 1, &One );
+	}
+
+	virtual bool  LoadRange( unsigned Index, unsigned Count, Page<PageSize>** Refs )
+	{
+		if( Batching != this || !this->Aligned( Count, Refs ) ) return Base::LoadRange( Index, Count, Refs );
+		return Enqueue( false, Index, Count, Refs );
+	}
+
+	virtual bool  SaveRange( unsigned Index, unsigned Count, Page<PageSize>** Refs )
+	{
+		if( Batching != this || !this->Aligned( Count, Refs ) ) return Base::SaveRange( Index, Count, Refs );
+		return Enqueue( true, Index, Count, Refs );
+	}
+
+	// каждый изменённый участок - отдельный запрос
+	virtual bool  SaveExtents( unsigned Index, Page<PageSize>& Ref, const PageExtent* Extents, unsigned Count )
+	{
+		if( Batching != this || !this->Aligned( &Ref ) ) return Base::SaveExtents( Index, Ref, Extents, Count );
+		if( !this->Valid( Index, 1 ) ) return false;
+		for( unsigned i = 0; i < Count; i++ )
+		{
+			Request Next;
+			Next.Write = true;
+			Next.Offset = this->Offset( Index ) + Extents[i].Offset;
+			Next.Parts.resize( 1 );
+			Next.Parts[0].iov_base = Ref.Data + Extents[i].Offset;
+			Next.Parts[0].iov_len = Extents[i].Size;
+			if( !Push( Next ) ) return false;
+		}
+		return true;
+	}
+
+	virtual void  BeginBatch()
+	{
+		Base::BeginBatch();
+		if( !Ring.Ready() ) return;
+		BatchLock.lock();
+		Batching = this;
+		BatchFailed = Wrote = false;
+	}
+
+	// отдаёт ядру весь пакет и ждёт его завершения; после отказа Wait в полёте ничего не осталось,
+	// так что буферы запросов и страницы пакета можно отпускать
+	virtual bool  EndBatch()
+	{
+		bool Result = Base::EndBatch();
+		if( Batching != this ) return Result;
+
+		while( InFlight > 0 )
+			if( !Wait( InFlight ) ) break;
+		Result = Result && !BatchFailed && (!Wrote || this->Saved());
+
+		Requests.clear();
+		Batching = NULL;
+		BatchLock.unlock();
+		return Result;
+	}
+
+private:
+	// запрос пакета, user_data в кольце - его номер в Requests
+	struct Request
+	{
+		bool	Write;
+		unsigned long long	Offset;
+		vector< struct iovec >	Parts;	// буфер вектора не переезжает вместе с Request
+	};
+
+	// readv/writev ядро принимает не длиннее UIO_MAXIOV
+	static const unsigned MaxVector = 1024;
+	// сколько раз подряд повторять io_uring_enter, когда ни ждать, ни разбирать нечего
+	static const unsigned MaxRetries = 16;
+
+	_Ring				Ring;
+	mutex				BatchLock;	// один пакет за раз
+	vector< Request >	Requests;
+	unsigned			InFlight;	// поставлено в кольцо и ещё не завершено
+	bool				BatchFailed;
+	bool				Wrote;		// в пакете были записи - при FileSyncAlways синхронизируемся один раз в конце
+	static thread_local UringPageDevice*	Batching;	// устройство, пакет которого открыл этот поток
+
+	bool	Enqueue( bool Write, unsigned Index, unsigned Count, Page<PageSize>** Refs )
+	{
+		if( !this->Valid( Index, Count ) ) return false;
+		for( unsigned First = 0, Part; First < Count; First += Part )
+		{
+			Part = Count - First < MaxVector ? Count - First : MaxVector;
+			Request Next;
+			Next.Write = Write;
+			Next.Offset = this->Offset( Index + First );
+			Next.Parts.resize( Part );
+			for( unsigned i = 0; i < Part; i++ )
+			{
+				Next.Parts[i].iov_base = Refs[First + i];
+				Next.Parts[i].iov_len = PageBytes;
+			}
+			if( !Push( Next ) ) return false;
+		}
+		return true;
+	}
+
+	bool	Push( Request& Next )
+	{
+		// кольцо заполнено - ждём, пока освободится место; после отказа кольца пакет уже провален
+		while( InFlight >= Ring.Depth() )
+			if( !Wait( 1 ) ) return false;
+		if( !Ring.Ready() ) return false;
+
+		Requests.push_back( move( Next ) );
+		Request& Queued = Requests.back();
+		if( !Ring.Queue( Queued.Write ? IORING_OP_WRITEV : IORING_OP_READV, this->Handle(), &Queued.Parts[0],
+				(unsigned)Queued.Parts.size(), Queued.Offset, Requests.size() - 1 ) )
+			return this->Failed( EAGAIN );
+		InFlight++;
+		Wrote = Wrote || Queued.Write;
+		return true;
+	}
+
+	// отдаёт поставленное ядру, ждёт Count завершений и разбирает все готовые.
+	// Полная очередь завершений (EBUSY) или нехватка ресурсов ядра (EAGAIN) - разбираем готовое
+	// и повторяем; другой отказ проваливает пакет через Abandon
+	bool	Wait( unsigned Count )
+	{
+		for( unsigned Idle = 0; !Ring.Submit( Count ); )
+		{
+			int Code = errno;
+			if( Code != EBUSY && Code != EAGAIN ) return Abandon( Code );
+			if( Reap() > 0 ) continue;
+			// готового нет: ждём, пока ядро завершит что-то из уже отданного, а если ждать
+			// нечего - повторяем ещё несколько раз
+			if( InFlight > Ring.Unsubmitted() )
+			{
+				if( !Ring.Await( 1 ) && errno != EBUSY && errno != EAGAIN ) return Abandon( errno );
+			}
+			else if( ++Idle == MaxRetries ) return Abandon( Code );
+			else this_thread::yield();
+		}
+		Reap();
+		return true;
+	}
+
+	// разбирает все готовые завершения, возвращает их число
+	unsigned	Reap()
+	{
+		unsigned long long Id;
+		int Result;
+		unsigned Count = 0;
+		for( ; Ring.Reap( Id, Result ); Count++ )
+		{
+			Complete( Requests[(size_t)Id], Result );
+			InFlight--;
+		}
+		return Count;
+	}
+
+	// отказ кольца: не отданные ядру запросы снимаем, отданные дожидаемся - ядро не должно писать
+	// в страницы и векторы пакета после его конца. Если не удаётся и дождаться, кольцо закрывается
+	// и устройство дальше работает синхронно
+	bool	Abandon( int Code )
+	{
+		BatchFailed = true;
+		this->Failed( Code );
+		InFlight -= Ring.Retract();
+		while( InFlight > 0 )
+		{
+			if( !Ring.Await( InFlight ) && errno != EBUSY && errno != EAGAIN )
+			{
+				Ring.Shutdown();
+				InFlight = 0;
+				break;
+			}
+			Reap();
+		}
+		return false;
+	}
+
+	// ошибка проваливает пакет, короткая передача дописывается синхронно, конец файла при чтении - нули
+	void	Complete( Request& Done, int Result )
+	{
+		if( Result < 0 )
+		{
+			BatchFailed = true;
+			this->Failed( -Result );
+			return;
+		}
+
+		size_t Transferred = (size_t)Result;
+		unsigned long long At = Done.Offset;
+		for( size_t i = 0; i < Done.Parts.size(); i++ )
+		{
+			char* Data = (char*)Done.Parts[i].iov_base;
+			size_t Size = Done.Parts[i].iov_len;
+			size_t Skip = Transferred < Size ? Transferred : Size;
+			Transferred -= Skip;
+			At += Skip;
+			if( Skip == Size ) continue;
+
+			long long Part = Done.Write ? FileIO::WriteAt( this->Handle(), Data + Skip, Size - Skip, At )
+				: FileIO::ReadAt( this->Handle(), Data + Skip, Size - Skip, At );
+			if( Part < 0 || (Done.Write && Part != (long long)(Size - Skip)) )
+			{
+				BatchFailed = true;
+				this->Failed();
+				return;
+			}
+			if( !Done.Write ) memset( Data + Skip + Part, 0, Size - Skip - (size_t)Part );
+			At += Size - Skip;
+		}
+	}
+#endif
+};
+
+#ifdef CACHE_IO_URING
+template< unsigned PageSize, unsigned PoolSize, unsigned SpaceSize, template< class, unsigned, unsigned > class CachePolicy, class _Ring >
+thread_local UringPageDevice<PageSize, PoolSize, SpaceSize, CachePolicy, _Ring>*
+	UringPageDevice<PageSize, PoolSize, SpaceSize, CachePolicy, _Ring>::Batching = NULL;
+#endif
@@ -0,0 +1,421 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "PageDevice.h"
+
+using namespace std;
+/*
+	Политика кэширования с фоновым сбросом грязных страниц.
+	Вытеснение такое же, как в Cache (по кругу), но отдельный поток заранее сохраняет
+	грязные слоты, стоящие перед указателем вытеснения, и промах чаще находит чистую жертву:
+	вместо Save + Load платит только Load. Страницы пула и копии потока лежат в PageBuffer,
+	описания слотов - в своём массиве.
+
+		StaticPageDevice<16,16,8,WritebackCache> SPD;
+		SPD.StartWriteback( 0.5, 0.25 );	// будить поток при 50% грязных слотов, чистить до 25%
+
+	Поток копирует пачку страниц (до четверти пула, не больше 32) под блокировкой пула и сохраняет
+	копии без неё одним пакетом обращений. Обращения к устройству из потока и из GetData/Flush
+	идут по очереди (DeviceLock), так что Load/Save устройства потокобезопасными быть не обязаны.
+	Поток сохраняет только страницы, записанные через Pin/PageHandle/GetDataRange и уже
+	откреплённые. Страницу, выданную на запись через GetData/GetDataForWrite, он не трогает:
+	писать через такой указатель можно когда угодно до Flush, а сохранит её вытеснение или Flush,
+	как в Cache.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						WritebackCache
+///////////////////////////////////////////////////////////////////////////////
+
+template
+<
+	class _T,
+		unsigned CacheSize = 16,
+		unsigned SpaceSize = 8
+>
+class WritebackCache : public CacheBase<_T>
+{
+public:
+	typedef _T DataType;
+
+	WritebackCache(): Pages(CacheSize), Pool(CacheSize), VMap(1 << SpaceSize, (int)-1), Buffer(FlushBatch)
+	{
+		LastLoadedIndex = -1;
+		Error = CacheOk;
+		DirtyCount = 0;
+		InWriteback = 0;
+		Seq = 0;
+		HighMark = CacheSize;
+		LowMark = CacheSize;
+		Running = Kicked = false;
+		// Проинициализируем пул
+		for( int i = 0; i < (int)CacheSize; i++ )
+		{
+			Pool[i].Index = -1;
+			Pool[i].Dirty = 0;
+			Pool[i].PinCount = 0;
+			Pool[i].WriteSeq = 0;
+			Pool[i].Busy = false;
+			Pool[i].Open = false;
+		}
+	}
+
+	virtual ~WritebackCache()
+	{
+		// обычно поток уже остановлен в Close() из деструктора устройства
+		StopWriteback();
+	}
+
+	_T*		GetData( unsigned Index, bool ForWrite )
+	{
+		lock_guard< mutex > Guard( Lock );
+		return OpenForWrite( Fetch( Index, this->Blocks( ForWrite ) ), Index, ForWrite );
+	}
+
+	// берёт страницу на запись, грязными помечаются только блоки, покрывающие [Offset, Offset + Size)
+	_T*		GetDataForWrite( unsigned Index, unsigned Offset, unsigned Size )
+	{
+		lock_guard< mutex > Guard( Lock );
+		return OpenForWrite( Fetch( Index, this->Blocks( Offset, Size ) ), Index, Size != 0 );
+	}
+
+	// загружает и закрепляет страницу, каждому Pin должен соответствовать Unpin
+	_T*		Pin( unsigned Index, bool ForWrite )
+	{
+		lock_guard< mutex > Guard( Lock );
+		_T* Ptr = Fetch( Index, this->Blocks( ForWrite ) );
+		if( Ptr ) Pool[VMap[Index]].PinCount++;
+		return Ptr;
+	}
+
+	void	Unpin( unsigned Index )
+	{
+		lock_guard< mutex > Guard( Lock );
+		if( Index < VMap.size() && VMap[Index] >= 0 && Pool[VMap[Index]].PinCount > 0 )
+			Pool[VMap[Index]].PinCount--;
+	}
+
+	// закрепляет страницы [Index, Index + Count) по одной, пакетной загрузки у политики нет
+	PageSpan<_T>	GetDataRange( unsigned Index, unsigned Count, bool ForWrite )
+	{
+		return this->PinEach( *this, Index, Count, ForWrite );
+	}
+
+	void	UnpinRange( const PageSpan<_T>& Span )
+	{
+		this->UnpinEach( *this, Span );
+	}
+
+	// помечает грязными блоки [Offset, Offset + Size) страницы Span[i]: страница закреплена,
+	// слот берётся из карты без поиска и без счёта попадания
+	void	MarkDirty( const PageSpan<_T>& Span, unsigned i, unsigned Offset, unsigned Size )
+	{
+		lock_guard< mutex > Guard( Lock );
+		MarkDirty( Pool[VMap[Span.GetIndex() + i]], this->Blocks( Offset, Size ) );
+	}
+
+	virtual bool	Flush()
+	{
+		unique_lock< mutex > Guard( Lock );
+		return FlushLocked( Guard );
+	}
+
+	// сбрасывает и выбрасывает все страницы пула; поток сброса, если запущен, продолжает работать
+	virtual bool	Invalidate()
+	{
+		unique_lock< mutex > Guard( Lock );
+		Idle.wait( Guard, [this]{ return InWriteback == 0; } );
+		for( unsigned i = 0; i < CacheSize; i++ )
+			if( Pool[i].PinCount > 0 )
+			{
+				Error = CacheAllPinned;
+				return false;
+			}
+		if( !FlushLocked( Guard ) ) return false;
+
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( Pool[i].Index >= 0 ) VMap[Pool[i].Index] = -1;
+			Pool[i].Index = -1;
+		}
+		LastLoadedIndex = -1;
+		lock_guard< mutex > Device( DeviceLock );
+		this->ClearTier();
+		return true;
+	}
+
+	virtual bool	Close()
+	{
+		StopWriteback();
+		return Flush();
+	}
+
+	// запускает фоновый сброс: когда грязных слотов больше доли High, поток чистит их до доли Low
+	bool	StartWriteback( double High = 0.5, double Low = 0.25 )
+	{
+		if( !(Low >= 0 && Low <= High && High <= 1) ) return false;
+
+		lock_guard< mutex > Guard( Lock );
+		if( Running ) return false;
+		HighMark = (unsigned)(High * CacheSize);
+		LowMark = (unsigned)(Low * CacheSize);
+		Running = true;
+		Kicked = DirtyCount > HighMark;
+		Flusher = thread( &WritebackCache::FlusherLoop, this );
+		return true;
+	}
+
+	void	StopWriteback()
+	{
+		{
+			lock_guard< mutex > Guard( Lock );
+			if( !Running ) return;
+			Running = false;
+		}
+		Wake.notify_one();
+		Flusher.join();
+	}
+
+	CacheError	LastError() const { return Error; }
+
+protected:
+	virtual bool  Load( unsigned Index, _T& Ref ) = 0;
+	virtual bool  Save( unsigned Index, _T& Ref ) = 0;
+private:
+	typedef typename CacheBase<_T>::DirtyPage DirtyPage;
+	typedef typename CacheBase<_T>::BlockMask BlockMask;
+
+	// сколько страниц поток сохраняет одним пакетом
+	static const unsigned FlushBatch = CacheSize / 4 > 32 ? 32 : CacheSize / 4 ? CacheSize / 4 : 1;
+
+	// описание слота пула, сама страница - Pages[номер слота]: поиск жертвы и грязных слотов
+	// идёт по плотному массиву описаний, не задевая страниц
+	struct Slot
+	{
+		int	 Index;
+		BlockMask Dirty;	// грязные блоки страницы
+		unsigned PinCount;	// сколько раз страница закреплена
+		unsigned WriteSeq;	// номер обращения, в котором страницу последний раз взяли на запись
+		bool Busy;			// копию страницы сейчас сохраняет поток сброса
+		bool Open;			// выдана на запись без Pin: сохранят её вытеснение или Flush, не поток
+	};
+	PageBuffer< _T >         Pages;
+	vector< Slot >           Pool;
+	vector< int >            VMap;	// индекс страницы -> позиция в Pool, -1 если не загружена
+	int           LastLoadedIndex;
+	CacheError    Error;
+
+	mutex               Lock;		// защищает всё состояние пула
+	mutex               DeviceLock;	// обращения к устройству и второму уровню - по одному, берётся после Lock
+	condition_variable  Wake;		// будит поток сброса
+	condition_variable  Idle;		// поток закончил очередное сохранение
+	thread        Flusher;
+	bool          Running;
+	bool          Kicked;		// грязных слотов стало больше HighMark
+	unsigned      HighMark;
+	unsigned      LowMark;
+	unsigned      DirtyCount;
+	unsigned      InWriteback;	// сколько слотов помечено Busy
+	unsigned      Seq;			// счётчик обращений к кэшу
+	PageBuffer< _T >	Buffer;		// копии сохраняемых потоком страниц, выровнены как и пул
+
+	// Flush под уже взятым Lock
+	bool	FlushLocked( unique_lock< mutex >& Guard )
+	{
+		// дождёмся сохранений потока, иначе его старая копия может лечь поверх наших данных
+		Idle.wait( Guard, [this]{ return InWriteback == 0; } );
+
+		vector< DirtyPage > Dirty;
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( Pool[i].Dirty && Pool[i].Index >= 0 )
+			{
+				DirtyPage Page = { (unsigned)Pool[i].Index, &Pages[i], &Pool[i].Dirty };
+				Dirty.push_back( Page );
+			}
+		}
+		bool Result;
+		{
+			lock_guard< mutex > Device( DeviceLock );
+			Result = this->WriteBack( Dirty );
+		}
+
+		DirtyCount = 0;
+		for( unsigned i = 0; i < CacheSize; i++ )
+		{
+			if( Pool[i].Dirty ) DirtyCount++;
+			else Pool[i].Open = false;
+		}
+
+		if( !Result ) Error = CacheSaveFailed;
+		return Result;
+	}
+
+	// то же, что Cache::GetData, вызывается под Lock; Written - блоки под запись
+	_T*		Fetch( unsigned Index, BlockMask Written )
+	{
+		if( Index >= VMap.size() )
+		{
+			Error = CacheBadIndex;
+			return NULL;
+		}
+
+		Seq++;
+		if( VMap[Index] >= 0 )
+		{
+			this->Stats.Hit();
+			if( Written ) MarkDirty( Pool[VMap[Index]], Written );
+			return &Pages[VMap[Index]];
+		}
+		this->Stats.Miss();
+
+		// найдём место для загрузки, закреплённые и сохраняемые потоком слоты пропускаем
+		unsigned PoolPos = (LastLoadedIndex + 1) % CacheSize;
+		for( unsigned Tries = 1; Pool[PoolPos].PinCount > 0 || Pool[PoolPos].Busy; Tries++ )
+		{
+			if( Tries == CacheSize )
+			{
+				Error = CacheAllPinned;
+				return NULL;
+			}
+			PoolPos = (PoolPos + 1) % CacheSize;
+		}
+
+		lock_guard< mutex > Device( DeviceLock );
+		if( Pool[PoolPos].Index >= 0 )
+		{
+			if( Pool[PoolPos].Dirty )
+			{
+				// поток не успел - сохраняем сами
+				if( !this->SavePage( Pool[PoolPos].Index, Pages[PoolPos], Pool[PoolPos].Dirty ) )
+				{
+					// ошибка сохранения страницы
+					Error = CacheSaveFailed;
+					return NULL;
+				}
+				Pool[PoolPos].Dirty = 0;
+				DirtyCount--;
+			}
+			this->Retire( Pool[PoolPos].Index, Pages[PoolPos] );
+			VMap[Pool[PoolPos].Index] = -1;
+			Pool[PoolPos].Index = -1;
+			Pool[PoolPos].Open = false;
+			this->Stats.Eviction();
+		}
+
+		if( !this->LoadPage( Index, Pages[PoolPos] ) )
+		{
+			Error = CacheLoadFailed;
+			return NULL;
+		}
+
+		Pool[PoolPos].Index = Index;
+		LastLoadedIndex = PoolPos;
+		VMap[Index] = PoolPos;
+		if( Written ) MarkDirty( Pool[PoolPos], Written );
+		return &Pages[PoolPos];
+	}
+
+	// страница, выданная на запись без Pin, до Flush или вытеснения закрыта для потока
+	_T*		OpenForWrite( _T* Ptr, unsigned Index, bool Written )
+	{
+		if( Ptr && Written ) Pool[VMap[Index]].Open = true;
+		return Ptr;
+	}
+
+	void	MarkDirty( Slot& Marked, BlockMask Written )
+	{
+		Marked.WriteSeq = Seq;
+		bool WasDirty = Marked.Dirty != 0;
+		Marked.Dirty |= Written;
+		if( WasDirty ) return;
+		if( ++DirtyCount > HighMark && Running && !Kicked )
+		{
+			Kicked = true;
+			Wake.notify_one();
+		}
+	}
+
+	// ближайший к указателю вытеснения откреплённый слот, записанный через Pin, -1 если таких нет
+	int		NextDirty()
+	{
+		for( unsigned i = 1; i <= CacheSize; i++ )
+		{
+			unsigned PoolPos = (LastLoadedIndex + i) % CacheSize;
+			Slot& Candidate = Pool[PoolPos];
+			if( Candidate.Dirty && !Candidate.Busy && Candidate.PinCount == 0 && !Candidate.Open )
+				return PoolPos;
+		}
+		return -1;
+	}
+
+	void	FlusherLoop()
+	{
+		// сохраняемая пачка: слот, его номер обращения и маска на момент копирования
+		struct Job
+		{
+			unsigned	PoolPos;
+			unsigned	Index;
+			unsigned	WriteSeq;
+			BlockMask	Dirty;
+		};
+		vector< Job > Jobs;
+		vector< char > Saved;
+
+		unique_lock< mutex > Guard( Lock );
+		while( Running )
+		{
+			Wake.wait( Guard, [this]{ return Kicked || !Running; } );
+			Kicked = false;
+
+			while( Running && DirtyCount > LowMark )
+			{
+				// копируем до FlushBatch слотов, копии уходят в хранилище одним пакетом
+				Jobs.clear();
+				while( Jobs.size() < FlushBatch && DirtyCount - Jobs.size() > LowMark )
+				{
+					int PoolPos = NextDirty();
+					if( PoolPos < 0 ) break;
+
+					Slot& Copied = Pool[PoolPos];
+					Job Next = { (unsigned)PoolPos, (unsigned)Copied.Index, Copied.WriteSeq, Copied.Dirty };
+					Copied.Busy = true;
+					InWriteback++;
+					Buffer[Jobs.size()] = Pages[PoolPos];
+					Jobs.push_back( Next );
+				}
+				if( Jobs.empty() ) break;
+
+				Guard.unlock();
+				Saved.assign( Jobs.size(), 0 );
+				bool Done;
+				{
+					lock_guard< mutex > Device( DeviceLock );
+					this->BeginBatch();
+					for( size_t k = 0; k < Jobs.size(); k++ )
+						Saved[k] = this->SavePage( Jobs[k].Index, Buffer[k], Jobs[k].Dirty );
+					Done = this->EndBatch();
+				}
+				Guard.lock();
+
+				// пока сохраняли, страницу могли снова взять на запись - тогда она остаётся грязной
+				for( size_t k = 0; k < Jobs.size(); k++ )
+				{
+					Slot& Copied = Pool[Jobs[k].PoolPos];
+					Copied.Busy = false;
+					InWriteback--;
+					if( Done && Saved[k] && Copied.Dirty && Copied.WriteSeq == Jobs[k].WriteSeq )
+					{
+						Copied.Dirty = 0;
+						DirtyCount--;
+					}
+					Done = Done && Saved[k];
+				}
+				Idle.notify_all();
+				if( !Done ) break;
+			}
+		}
+	}
+};
@@ -0,0 +1,121 @@
+#pragma once
+#include <stddef.h>
+#include <string.h>
+#if defined(_M_X64) || defined(__x86_64__)
+#define ZERO_CHECK_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/*
+	Проверка блока памяти на нули - для страниц, которые не нужно ни хранить, ни читать.
+	На x86-64 по 128 байт за шаг: AVX2, если он есть (выбор один раз, по cpuid), иначе SSE2;
+	на других платформах - по 8 байт. Ненулевые данные обычно находятся в первых байтах,
+	поэтому сначала смотрится начало блока, а дальше выход на первом ненулевом шаге.
+
+		if( IsZero( &Page, sizeof(Page) ) ) ...
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						IsZero
+///////////////////////////////////////////////////////////////////////////////
+
+namespace ZeroCheckImpl
+{
+	inline bool	Software( const unsigned char* p, size_t Size )
+	{
+		for( ; Size && ((size_t)p & 7); Size--, p++ )
+			if( *p ) return false;
+		for( ; Size >= 64; Size -= 64, p += 64 )
+		{
+			unsigned long long w[8];
+			memcpy( w, p, 64 );
+			if( w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7] ) return false;
+		}
+		for( ; Size >= 8; Size -= 8, p += 8 )
+		{
+			unsigned long long w;
+			memcpy( &w, p, 8 );
+			if( w ) return false;
+		}
+		for( ; Size; Size--, p++ )
+			if( *p ) return false;
+		return true;
+	}
+
+#ifdef ZERO_CHECK_X86
+#ifdef _MSC_VER
+#define ZERO_CHECK_AVX2
+#else
+#define ZERO_CHECK_AVX2 __attribute__((target("avx2")))
+#endif
+
+	inline bool	Sse2( const unsigned char* p, size_t Size )
+	{
+		for( ; Size >= 128; Size -= 128, p += 128 )
+		{
+			__m128i a = _mm_or_si128( _mm_loadu_si128( (const __m128i*)p ), _mm_loadu_si128( (const __m128i*)(p + 16) ) );
+			__m128i b = _mm_or_si128( _mm_loadu_si128( (const __m128i*)(p + 32) ), _mm_loadu_si128( (const __m128i*)(p + 48) ) );
+			__m128i c = _mm_or_si128( _mm_loadu_si128( (const __m128i*)(p + 64) ), _mm_loadu_si128( (const __m128i*)(p + 80) ) );
+			__m128i d = _mm_or_si128( _mm_loadu_si128( (const __m128i*)(p + 96) ), _mm_loadu_si128( (const __m128i*)(p + 112) ) );
+			__m128i All = _mm_or_si128( _mm_or_si128( a, b ), _mm_or_si128( c, d ) );
+			if( _mm_movemask_epi8( _mm_cmpeq_epi8( All, _mm_setzero_si128() ) ) != 0xFFFF ) return false;
+		}
+		return Software( p, Size );
+	}
+
+	ZERO_CHECK_AVX2 inline bool	Avx2( const unsigned char* p, size_t Size )
+	{
+		for( ; Size >= 128; Size -= 128, p += 128 )
+		{
+			__m256i a = _mm256_or_si256( _mm256_loadu_si256( (const __m256i*)p ), _mm256_loadu_si256( (const __m256i*)(p + 32) ) );
+			__m256i b = _mm256_or_si256( _mm256_loadu_si256( (const __m256i*)(p + 64) ), _mm256_loadu_si256( (const __m256i*)(p + 96) ) );
+			__m256i All = _mm256_or_si256( a, b );
+			if( !_mm256_testz_si256( All, All ) ) return false;
+		}
+		return Software( p, Size );
+	}
+
+	inline bool	HasAvx2()
+	{
+#ifdef _MSC_VER
+		int Info[4];
+		__cpuid( Info, 1 );
+		// ОС сохраняет регистры AVX (OSXSAVE и XCR0)
+		if( (Info[2] & (1 << 27)) == 0 || (_xgetbv( 0 ) & 6) != 6 ) return false;
+		__cpuidex( Info, 7, 0 );
+		return (Info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports( "avx2" ) != 0;
+#endif
+	}
+
+	inline bool	UseAvx2()
+	{
+		static const bool Result = HasAvx2();
+		return Result;
+	}
+#endif
+}
+
+// все Size байт с Data - нули
+inline bool	IsZero( const void* Data, size_t Size )
+{
+	const unsigned char* p = (const unsigned char*)Data;
+	// ненулевая страница почти всегда видна уже по первым словам
+	if( Size >= 64 && !ZeroCheckImpl::Software( p, 64 ) ) return false;
+#ifdef ZERO_CHECK_X86
+	if( ZeroCheckImpl::UseAvx2() ) return ZeroCheckImpl::Avx2( p, Size );
+	return ZeroCheckImpl::Sse2( p, Size );
+#else
+	return ZeroCheckImpl::Software( p, Size );
+#endif
+}
+
+// то же без SIMD - для сравнения и проверки
+inline bool	IsZeroSoftware( const void* Data, size_t Size )
+{
+	return ZeroCheckImpl::Software( (const unsigned char*)Data, Size );
+}
@@ -0,0 +1,269 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <bitset>
+#include <utility>
+#include "ZeroCheck.h"
+#include "PerThread.h"
+
+using namespace std;
+/*
+	Нулевые страницы поверх любого устройства: нулевая страница, про которую известно, что
+	и в хранилище она нулевая, не сохраняется и не загружается - Load заполняет её memset'ом.
+	Такие страницы отмечены в битовой карте, по биту на страницу.
+
+		ZeroPageDevice< FilePageDevice<16,64,14,Cache> >	ZPD;
+		ZPD.Open( "pages.bin" );
+		ZPD.ElidedSaves();		// сколько сохранений не понадобилось
+
+	Бит ставится, когда страница прочитана из хранилища нулевой или нулевой сохранена,
+	и снимается перед сохранением ненулевой. Первое сохранение обнулённой страницы поверх
+	старых данных поэтому идёт в хранилище (иначе после переоткрытия файла они вернулись бы),
+	а все следующие - нет. Карта живёт в памяти: у только что созданного хранилища она
+	заполняется по первым загрузкам, у открытого заново - так же, с нуля.
+
+	Проверка на нули (IsZero) делается при каждом сохранении и загрузке, ненулевая страница
+	отбрасывается по первым байтам. В пакете (BeginBatch/EndBatch) асинхронное устройство
+	дочитывает и дописывает страницы только в EndBatch - там и ставятся их биты, при отказе
+	пакета - не ставятся. Страницы, отданные без копирования (Direct, PassThroughCache),
+	могут меняться мимо устройства - их биты снимаются.
+*/
+
+///////////////////////////////////////////////////////////////////////////////
+//						ZeroPageDevice
+///////////////////////////////////////////////////////////////////////////////
+
+template< class _Device >
+class ZeroPageDevice : public _Device
+{
+public:
+	typedef typename _Device::DataType DataType;
+
+	ZeroPageDevice(): Words((_Device::__PageCount + 63) / 64), Zero(new atomic< unsigned long long >[(_Device::__PageCount + 63) / 64])
+	{
+		for( size_t i = 0; i < Words; i++ ) Zero[i].store( 0 );
+		SkippedLoads.store( 0 );
+		SkippedSaves.store( 0 );
+	}
+
+	virtual ~ZeroPageDevice()
+	{
+		// сливаем кэш, пока Save с пропуском нулевых ещё доступен
+		this->Close();
+	}
+
+	// страница нулевая и в хранилище - её не нужно ни читать, ни писать
+	bool	IsZeroPage( unsigned Index ) const
+	{
+		return Index < _Device::__PageCount && (Zero[Index / 64].load() >> (Index % 64) & 1) != 0;
+	}
+
+	unsigned long long	ZeroPages() const
+	{
+		unsigned long long Count = 0;
+		for( size_t i = 0; i < Words; i++ ) Count += bitset< 64 >( Zero[i].load() ).count();
+		return Count;
+	}
+
+	// загрузки и сохранения, которые не дошли до хранилища
+	unsigned long long	ElidedLoads() const
+	{
+		return SkippedLoads.load();
+	}
+
+	unsigned long long	ElidedSaves() const
+	{
+		return SkippedSaves.load();
+	}
+
+protected:
+	// серии и участки устройство может делать и через Load/Save, и своим путём:
+	// Nested не даёт проверить и отметить страницу дважды
+	virtual bool  Load( unsigned Index, DataType& Ref )
+	{
+		if( Nested() ) return _Device::Load( Index, Ref );
+		if( IsZeroPage( Index ) )
+		{
+			memset( &Ref, 0, sizeof(DataType) );
+			SkippedLoads++;
+			return true;
+		}
+		if( !_Device::Load( Index, Ref ) ) return false;
+		if( IsZero( &Ref, sizeof(DataType) ) ) Mark( Index );
+		return true;
+	}
+
+	virtual bool  Save( unsigned Index, DataType& Ref )
+	{
+		if( Nested() ) return _Device::Save( Index, Ref );
+		bool Zeroed = IsZero( &Ref, sizeof(DataType) );
+		if( Zeroed && IsZeroPage( Index ) )
+		{
+			SkippedSaves++;
+			return true;
+		}
+		if( !Zeroed ) Forget( Index );
+		if( !_Device::Save( Index, Ref ) ) return false;
+		if( Zeroed )
+		{
+			Written( Threads::Enter( this ), Index );
+			Threads::Leave( this );
+		}
+		return true;
+	}
+
+	// нулевые известные страницы разрывают серию, остальное уходит устройству кусками
+	virtual bool  LoadRange( unsigned Index, unsigned Count, DataType** Refs )
+	{
+		bool Result = true;
+		ThreadState& State = Threads::Enter( this );
+		State.Nested++;
+		for( unsigned i = 0, First = 0; Result && i <= Count; i++ )
+		{
+			bool Known = i < Count && IsZeroPage( Index + i );
+			if( i < Count && !Known ) continue;
+			if( i > First ) Result = _Device::LoadRange( Index + First, i - First, Refs + First );
+			if( Known )
+			{
+				memset( Refs[i], 0, sizeof(DataType) );
+				SkippedLoads++;
+			}
+			First = i + 1;
+		}
+		State.Nested--;
+
+		for( unsigned i = 0; Result && i < Count; i++ )
+		{
+			if( IsZeroPage( Index + i ) ) continue;
+			if( State.Batch > 0 ) State.Deferred.push_back( make_pair( Index + i, Refs[i] ) );
+			else if( IsZero( Refs[i], sizeof(DataType) ) ) Mark( Index + i );
+		}
+		Threads::Leave( this );
+		return Result;
+	}
+
+	virtual bool  SaveRange( unsigned Index, unsigned Count, DataType** Refs )
+	{
+		// Zeroed - нулевые, которые ещё придётся записать; у ненулевых бит снимается до записи
+		vector< unsigned char > Zeroed( Count );
+		for( unsigned i = 0; i < Count; i++ )
+		{
+			if( !IsZero( Refs[i], sizeof(DataType) ) ) Forget( Index + i );
+			else if( !IsZeroPage( Index + i ) ) Zeroed[i] = 1;
+		}
+
+		bool Result = true;
+		ThreadState& State = Threads::Enter( this );
+		State.Nested++;
+		for( unsigned i = 0, First = 0; Result && i <= Count; i++ )
+		{
+			// бит остался только у нулевых страниц, уже нулевых в хранилище
+			bool Known = i < Count && IsZeroPage( Index + i );
+			if( i < Count && !Known ) continue;
+			if( i > First ) Result = _Device::SaveRange( Index + First, i - First, Refs + First );
+			if( Known ) SkippedSaves++;
+			First = i + 1;
+		}
+		State.Nested--;
+
+		for( unsigned i = 0; Result && i < Count; i++ )
+			if( Zeroed[i] ) Written( State, Index + i );
+		Threads::Leave( this );
+		return Result;
+	}
+
+	// в пуле страница целиком актуальна, неизменённые блоки совпадают с хранилищем
+	virtual bool  SaveExtents( unsigned Index, DataType& Ref, const PageExtent* Extents, unsigned Count )
+	{
+		if( Nested() ) return _Device::SaveExtents( Index, Ref, Extents, Count );
+		bool Zeroed = IsZero( &Ref, sizeof(DataType) );
+		if( Zeroed && IsZeroPage( Index ) )
+		{
+			SkippedSaves++;
+			return true;
+		}
+		if( !Zeroed ) Forget( Index );
+		ThreadState& State = Threads::Enter( this );
+		State.Nested++;
+		bool Result = _Device::SaveExtents( Index, Ref, Extents, Count );
+		State.Nested--;
+		if( Result && Zeroed ) Written( State, Index );
+		Threads::Leave( this );
+		return Result;
+	}
+
+	// по указателю страницу могут изменить мимо Save
+	virtual DataType*  Direct( unsigned Index )
+	{
+		Forget( Index );
+		return _Device::Direct( Index );
+	}
+
+	virtual void  BeginBatch()
+	{
+		_Device::BeginBatch();
+		Threads::Enter( this ).Batch++;
+	}
+
+	// страницы пакета прочитаны и записаны только теперь
+	virtual bool  EndBatch()
+	{
+		ThreadState& State = Threads::Enter( this );
+		State.Batch--;
+		bool Result = _Device::EndBatch();
+		for( size_t i = 0; Result && i < State.Deferred.size(); i++ )
+			if( IsZero( State.Deferred[i].second, sizeof(DataType) ) ) Mark( State.Deferred[i].first );
+		for( size_t i = 0; Result && i < State.Pending.size(); i++ ) Mark( State.Pending[i] );
+		State.Deferred.clear();
+		State.Pending.clear();
+		Threads::Leave( this );
+		return Result;
+	}
+
+private:
+	size_t				Words;
+	unique_ptr< atomic< unsigned long long >[] >	Zero;	// бит на страницу: нулевая и в хранилище (шарды пишут одновременно)
+	atomic< unsigned long long >	SkippedLoads;
+	atomic< unsigned long long >	SkippedSaves;
+
+	// что делает с устройством поток: у каждого устройства своё
+	struct ThreadState
+	{
+		unsigned	Nested;	// глубина вызовов LoadRange/SaveRange/SaveExtents
+		unsigned	Batch;	// внутри BeginBatch/EndBatch
+		vector< pair< unsigned, DataType* > >	Deferred;	// прочитанные в пакете: нулевые ли, видно только в EndBatch
+		vector< unsigned >	Pending;	// нулевые страницы, записанные в пакете
+
+		ThreadState(): Nested(0), Batch(0) {}
+
+		bool	Idle() const
+		{
+			return Nested == 0 && Batch == 0 && Deferred.empty() && Pending.empty();
+		}
+	};
+	typedef PerThread< ThreadState > Threads;
+
+	bool	Nested() const
+	{
+		ThreadState* State = Threads::Find( this );
+		return State && State->Nested > 0;
+	}
+
+	void	Mark( unsigned Index )
+	{
+		if( Index < _Device::__PageCount ) Zero[Index / 64] |= 1ull << (Index % 64);
+	}
+
+	void	Forget( unsigned Index )
+	{
+		if( Index < _Device::__PageCount ) Zero[Index / 64] &= ~(1ull << (Index % 64));
+	}
+
+	// нулевая страница сохранена; в пакете - станет известной, когда пакет завершится
+	void	Written( ThreadState& State, unsigned Index )
+	{
+		if( State.Batch > 0 ) State.Pending.push_back( Index );
+		else Mark( Index );
+	}
+};
@@ -1,7 +1,27 @@
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
 #include "protocol.h"
 #include "persist.h"
 #include "BinDiffSynchronizer.h"
 #include "StaticPageDevice.h"
+#include "LRUCache.h"
+#include "TwoQCache.h"
+#include "WritebackCache.h"
+#include "ShardedCache.h"
+#include "OptimisticCache.h"
+#include "ResizableCache.h"
+#include "PassThroughCache.h"
+#include "ChecksummedDevice.h"
+#include "FilePageDevice.h"
+#include "MmapPageDevice.h"
+#include "UringPageDevice.h"
+#include "ZeroPageDevice.h"
+#include "DedupPageDevice.h"
+#include "SnapshotPageDevice.h"
 
 
 //typedef persist< fptr< double > > pfptr_double;
@@ -90,16 +110,1937 @@ bool	test3( void )
 	return true;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	политики вытеснения LRUCache и ClockCache
+
+// заполним все страницы их номерами, а потом прочитаем и проверим в встречном порядке
+template< class _Device >
+bool	FillAndCheck( _Device& Dev, int PageCount, int PageBytes )
+{
+	int	p, b;
+	unsigned char* Data;
+	for( p = 0; p < PageCount; p++ )
+	{
+		Data = Dev.GetData( p, true )->Data;
+		for( b = 0; b < PageBytes; b++ )
+			Data[b] = p;
+	}
+
+	for( p = 0; p < PageCount; p++ )
+	{
+		Data = Dev.GetData( PageCount-1-p, false )->Data;
+		for( b = 0; b < PageBytes; b++ )
+			if( Data[b] != (unsigned char)(PageCount-1-p) ) return false;
+	}
+
+	return true;
+}
+
+StaticPageDevice<12,16,8,LRUCache>		LRUSPD;
+StaticPageDevice<12,16,8,ClockCache>	ClockSPD;
+
+bool	test4( void )
+{
+	return FillAndCheck( LRUSPD, 256, 1 << 12 );
+}
+
+bool	test5( void )
+{
+	return FillAndCheck( ClockSPD, 256, 1 << 12 );
+}
+
+// устройство считающее загрузки страниц, промахи кэша = число вызовов Load
+template< template< class, unsigned, unsigned > class CachePolicy, unsigned PoolSize = 16 >
+class CountingPageDevice : public StaticPageDevice<12,PoolSize,8,CachePolicy>
+{
+public:
+	unsigned	Loads;
+	CountingPageDevice(): Loads(0) {}
+protected:
+	virtual bool  Load( unsigned Index, Page<12>& Ref )
+	{
+		Loads++;
+		return StaticPageDevice<12,PoolSize,8,CachePolicy>::Load( Index, Ref );
+	}
+};
+
+// генератор номеров страниц с распределением Ципфа (детерминированный, для повторяемости)
+class ZipfGenerator
+{
+	vector<double>	Cdf;
+	unsigned		Seed;
+public:
+	ZipfGenerator( unsigned Count, double S ): Cdf(Count), Seed(12345)
+	{
+		double Sum = 0;
+		for( unsigned i = 0; i < Count; i++ ) Cdf[i] = Sum += 1.0 / pow( (double)(i + 1), S );
+		for( unsigned i = 0; i < Count; i++ ) Cdf[i] /= Sum;
+	}
+
+	unsigned	Next()
+	{
+		Seed = Seed * 1664525 + 1013904223;
+		double U = (Seed >> 8) / (double)(1 << 24);
+		unsigned Rank = (unsigned)(lower_bound( Cdf.begin(), Cdf.end(), U ) - Cdf.begin());
+		if( Rank >= Cdf.size() ) Rank = (unsigned)Cdf.size() - 1;
+		// перемешиваем ранги по страницам, чтобы горячие страницы не шли подряд
+		return (Rank * 167) & 255;
+	}
+};
+
+template< template< class, unsigned, unsigned > class CachePolicy >
+double	ZipfHitRatio( double S, unsigned Requests )
+{
+	CountingPageDevice<CachePolicy>* Dev = new CountingPageDevice<CachePolicy>;
+	ZipfGenerator Zipf( 256, S );
+	for( unsigned i = 0; i < Requests; i++ )
+		Dev->GetData( Zipf.Next(), (i & 3) == 0 );
+	double HitRatio = 1.0 - (double)Dev->Loads / Requests;
+	delete Dev;
+	return HitRatio;
+}
+
+// доля попаданий для пула в 16 страниц из 256 на распределении Ципфа
+void	bench_zipf( void )
+{
+	double S[] = { 0.8, 1.0, 1.2 };
+	for( int i = 0; i < 3; i++ )
+	{
+		cout << "zipf s=" << S[i]
+			 << "  Cache: " << ZipfHitRatio<Cache>( S[i], 1000000 )
+			 << "  LRUCache: " << ZipfHitRatio<LRUCache>( S[i], 1000000 )
+			 << "  ClockCache: " << ZipfHitRatio<ClockCache>( S[i], 1000000 ) << "\n";
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	устойчивость TwoQCache к последовательному проходу
+
+StaticPageDevice<12,16,8,TwoQCache>		TwoQSPD;
+
+bool	test6( void )
+{
+	return FillAndCheck( TwoQSPD, 256, 1 << 12 );
+}
+
+// сколько загрузок стоит вернуть рабочий набор из 8 страниц после полного прохода по 256 страницам
+template< template< class, unsigned, unsigned > class CachePolicy >
+unsigned	ScanReloads( void )
+{
+	CountingPageDevice<CachePolicy>* Dev = new CountingPageDevice<CachePolicy>;
+	unsigned p, r, Reloads;
+	// прогреваем рабочий набор вперемешку с холодными страницами
+	for( r = 0; r < 8; r++ )
+	{
+		for( p = 0; p < 8; p++ ) Dev->GetData( p, false );
+		for( p = 0; p < 8; p++ ) Dev->GetData( 16 + r * 8 + p, false );
+	}
+	for( p = 0; p < 8; p++ ) Dev->GetData( p, false );
+
+	// ночной проход
+	for( p = 8; p < 256; p++ ) Dev->GetData( p, false );
+
+	Dev->Loads = 0;
+	for( p = 0; p < 8; p++ ) Dev->GetData( p, false );
+	Reloads = Dev->Loads;
+	delete Dev;
+	return Reloads;
+}
+
+// страница, поднятая призраком в Am и забытая Am, возвращается через A1in: проход её вытесняет
+bool	GhostReadmission( void )
+{
+	CountingPageDevice<TwoQCache>* Dev = new CountingPageDevice<TwoQCache>;
+	unsigned p;
+	for( p = 0; p < 20; p++ ) Dev->GetData( p, false );		// 0..3 уходят в призраки
+	for( p = 0; p < 12; p++ ) Dev->GetData( p, false );		// поднимаем 0..11 в Am, в A1in остаётся 4
+	Dev->GetData( 0, false );
+	Dev->GetData( 100, false );								// Am вытесняет самую старую - 1
+	Dev->GetData( 1, false );
+	for( p = 200; p < 220; p++ ) Dev->GetData( p, false );
+
+	Dev->Loads = 0;
+	Dev->GetData( 1, false );
+	bool Result = Dev->Loads == 1;
+	delete Dev;
+	return Result;
+}
+
+bool	test7( void )
+{
+	return ScanReloads<TwoQCache>() == 0 && GhostReadmission();
+}
+
+void	bench_scan( void )
+{
+	cout << "reloads after scan  Cache: " << ScanReloads<Cache>()
+		 << "  LRUCache: " << ScanReloads<LRUCache>()
+		 << "  ClockCache: " << ScanReloads<ClockCache>()
+		 << "  TwoQCache: " << ScanReloads<TwoQCache>() << "\n";
+	double S[] = { 0.8, 1.0, 1.2 };
+	for( int i = 0; i < 3; i++ )
+		cout << "zipf s=" << S[i] << "  TwoQCache: " << ZipfHitRatio<TwoQCache>( S[i], 1000000 ) << "\n";
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	закреплённые страницы
+
+template< class _Device >
+bool	PinCheck( _Device& Dev )
+{
+	unsigned p;
+	PageHandle<_Device> Pinned( Dev, 7, true );
+	if( !Pinned ) return false;
+	memset( Pinned->Data, 0x77, 16 );
+
+	// прогоняем через пул все страницы: закреплённая не должна быть вытеснена
+	for( p = 0; p < 256; p++ )
+		if( !Dev.GetData( p, false ) ) return false;
+	if( Dev.GetData( 7, false ) != Pinned.Get() || Pinned->Data[0] != 0x77 ) return false;
+
+	// закрепим весь пул - следующий промах обязан отказать
+	vector< PageHandle<_Device> > All;
+	All.reserve( 16 );
+	for( p = 100; All.size() < 15; p++ )
+		All.push_back( PageHandle<_Device>( Dev, p, false ) );
+	if( Dev.GetData( 200, false ) != NULL || Dev.LastError() != CacheAllPinned ) return false;
+
+	All.clear();
+	Pinned.Release();
+	return Dev.GetData( 200, false ) != NULL;
+}
+
+StaticPageDevice<12,16,8,Cache>		SmallSPD;
+
+bool	test8( void )
+{
+	return PinCheck( SmallSPD ) && PinCheck( LRUSPD ) && PinCheck( ClockSPD ) && PinCheck( TwoQSPD );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	сброс кэша по возрастанию номеров со склейкой соседних страниц
+
+// устройство, запоминающее вызовы SaveRange
+class RangeLogDevice : public StaticPageDevice<12,16,8,Cache>
+{
+public:
+	vector< pair<unsigned, unsigned> >	Ranges;
+protected:
+	virtual bool  SaveRange( unsigned Index, unsigned Count, Page<12>** Refs )
+	{
+		Ranges.push_back( make_pair( Index, Count ) );
+		return StaticPageDevice<12,16,8,Cache>::SaveRange( Index, Count, Refs );
+	}
+};
+
+RangeLogDevice	RangeSPD;
+
+bool	test9( void )
+{
+	unsigned p, Order[] = { 11, 3, 10, 5, 4 };
+	for( p = 0; p < 5; p++ )
+		RangeSPD.GetData( Order[p], true )->Data[0] = (unsigned char)Order[p];
+
+	if( !RangeSPD.Flush() ) return false;
+	if( RangeSPD.Ranges.size() != 2 ) return false;
+	if( RangeSPD.Ranges[0] != make_pair( 3u, 3u ) || RangeSPD.Ranges[1] != make_pair( 10u, 2u ) ) return false;
+
+	// повторный сброс ничего не пишет
+	if( !RangeSPD.Flush() || RangeSPD.Ranges.size() != 2 ) return false;
+
+	// вытесняем чистые страницы и читаем из хранилища
+	for( p = 100; p < 116; p++ ) RangeSPD.GetData( p, false );
+	for( p = 0; p < 5; p++ )
+		if( RangeSPD.GetData( Order[p], false )->Data[0] != Order[p] ) return false;
+	return RangeSPD.Ranges.size() == 2;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	фоновый сброс грязных страниц
+
+// устройство, считающее сохранения из основного потока и из потока сброса
+class WritebackLogDevice : public StaticPageDevice<12,16,8,WritebackCache>
+{
+public:
+	thread::id			Foreground;
+	atomic<unsigned>	ForegroundSaves;
+	atomic<unsigned>	BackgroundSaves;
+
+	WritebackLogDevice(): Foreground( this_thread::get_id() ), ForegroundSaves(0), BackgroundSaves(0) {}
+protected:
+	virtual bool  Save( unsigned Index, Page<12>& Ref )
+	{
+		if( this_thread::get_id() == Foreground ) ForegroundSaves++;
+		else BackgroundSaves++;
+		return StaticPageDevice<12,16,8,WritebackCache>::Save( Index, Ref );
+	}
+};
+
+// пишем страницы вразброс через PageHandle, каждая запись целиком переписывает страницу
+bool	WritebackRun( WritebackLogDevice& Dev, unsigned Rounds )
+{
+	unsigned r, p, b;
+	unsigned char* Data;
+	for( r = 0; r < Rounds; r++ )
+	{
+		for( p = 0; p < 256; p++ )
+		{
+			unsigned Index = (p * 167 + r) & 255;
+			PageHandle<WritebackLogDevice> Page( Dev, Index, true );
+			for( b = 0; b < 1 << 12; b++ )
+				Page->Data[b] = (unsigned char)(Index + r);
+		}
+	}
+	if( !Dev.Flush() ) return false;
+
+	for( p = 0; p < 256; p++ )
+	{
+		Data = Dev.GetData( p, false )->Data;
+		for( b = 0; b < 1 << 12; b++ )
+			if( Data[b] != (unsigned char)(p + Rounds - 1) ) return false;
+	}
+	return true;
+}
+
+bool	test10( void )
+{
+	WritebackLogDevice* Dev = new WritebackLogDevice;
+	bool Result = Dev->StartWriteback( 0.5, 0.25 ) && WritebackRun( *Dev, 20 ) && Dev->BackgroundSaves > 0;
+	delete Dev;
+	if( !Result ) return false;
+
+	// страницы, выданные через GetData на запись, поток не сохраняет: пишем в них много позже
+	unsigned p;
+	unsigned char* Data[16];
+	Dev = new WritebackLogDevice;
+	for( p = 0; p < 16; p++ ) Dev->GetData( p, false );
+	Dev->StartWriteback( 0.5, 0.25 );
+	for( p = 0; p < 16; p++ ) Data[p] = Dev->GetData( p, true )->Data;
+	this_thread::sleep_for( chrono::milliseconds( 50 ) );
+	for( p = 0; p < 16; p++ ) memset( Data[p], p + 1, 1 << 12 );
+	Result = Dev->Flush() && Dev->BackgroundSaves == 0;
+
+	// вытесняем и читаем из хранилища
+	for( p = 100; p < 116; p++ ) Dev->GetData( p, false );
+	for( p = 0; p < 16 && Result; p++ )
+	{
+		unsigned char* Loaded = Dev->GetData( p, false )->Data;
+		Result = Loaded[0] == p + 1 && Loaded[(1 << 12) - 1] == p + 1;
+	}
+	delete Dev;
+	return Result;
+}
+
+void	bench_writeback( void )
+{
+	WritebackLogDevice* Sync = new WritebackLogDevice;
+	WritebackLogDevice* Async = new WritebackLogDevice;
+	Async->StartWriteback( 0.5, 0.25 );
+	WritebackRun( *Sync, 100 );
+	WritebackRun( *Async, 100 );
+	cout << "saves in GetData  without writeback: " << Sync->ForegroundSaves
+		 << "  with writeback: " << Async->ForegroundSaves << " (+" << Async->BackgroundSaves << " in background)\n";
+	delete Sync;
+	delete Async;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	шардированный кэш из нескольких потоков
+
+typedef StaticPageDevice<12,16,8,ShardedCache>	ShardedDevice;
+ShardedDevice	ShardedSPD;
+
+// каждый из 4 потоков пишет свои страницы через PageHandle
+void	ShardedWriter( unsigned Thread )
+{
+	for( unsigned r = 0; r < 16; r++ )
+	{
+		for( unsigned p = Thread; p < 256; p += 4 )
+		{
+			PageHandle<ShardedDevice> Page( ShardedSPD, p, true );
+			memset( Page->Data, (unsigned char)(p + r), 1 << 12 );
+		}
+	}
+}
+
+// пул в 20 слотов на 8 шардов держит 20 страниц: остаток деления не теряется
+template< template< class, unsigned, unsigned > class CachePolicy >
+bool	ShardRemainder( void )
+{
+	CountingPageDevice<CachePolicy, 20>* Dev = new CountingPageDevice<CachePolicy, 20>;
+	unsigned p;
+	for( p = 0; p < 20; p++ ) Dev->GetData( p, false );
+	Dev->Loads = 0;
+	for( p = 0; p < 20; p++ ) Dev->GetData( p, false );
+	bool Result = Dev->Loads == 0;
+	delete Dev;
+	return Result;
+}
+
+bool	test11( void )
+{
+	if( !ShardRemainder<ShardedCache>() ) return false;
+
+	vector<thread> Writers;
+	for( unsigned t = 0; t < 4; t++ ) Writers.push_back( thread( ShardedWriter, t ) );
+	for( unsigned t = 0; t < 4; t++ ) Writers[t].join();
+	if( !ShardedSPD.Flush() ) return false;
+
+	for( unsigned p = 0; p < 256; p++ )
+	{
+		PageHandle<ShardedDevice> Page( ShardedSPD, p, false );
+		for( unsigned b = 0; b < 1 << 12; b++ )
+			if( Page->Data[b] != (unsigned char)(p + 15) ) return false;
+	}
+	return true;
+}
+
+// попаданий GetData в секунду: Threads потоков читают 64 загруженные страницы вразброс,
+// Global != NULL - все обращения через общий мьютекс, как сейчас делают с Cache
+template< class _Device >
+double	HitThroughput( _Device& Dev, mutex* Global, unsigned Threads, unsigned Ops )
+{
+	for( unsigned p = 0; p < 64; p++ ) Dev.GetData( p, false );
+
+	vector<thread> Workers;
+	chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+	for( unsigned t = 0; t < Threads; t++ )
+	{
+		Workers.push_back( thread( [&Dev, Global, Ops, t]
+		{
+			unsigned Seed = t * 7919 + 1;
+			for( unsigned i = 0; i < Ops; i++ )
+			{
+				Seed = Seed * 1664525 + 1013904223;
+				unsigned Index = (Seed >> 16) & 63;
+				if( Global )
+				{
+					lock_guard< mutex > Guard( *Global );
+					Dev.GetData( Index, false );
+				}
+				else Dev.GetData( Index, false );
+			}
+		} ) );
+	}
+	for( unsigned t = 0; t < Threads; t++ ) Workers[t].join();
+	chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+	return Threads * (double)Ops / Elapsed.count();
+}
+
+void	bench_sharded( void )
+{
+	StaticPageDevice<12,64,8,Cache>*		Plain = new StaticPageDevice<12,64,8,Cache>;
+	StaticPageDevice<12,64,8,ShardedCache>*	Sharded = new StaticPageDevice<12,64,8,ShardedCache>;
+	mutex Global;
+	unsigned MaxThreads = thread::hardware_concurrency();
+	if( MaxThreads < 2 ) MaxThreads = 2;
+
+	for( unsigned Threads = 1; Threads <= MaxThreads; Threads *= 2 )
+	{
+		cout << "threads " << Threads
+			 << "  Cache+mutex: " << HitThroughput( *Plain, &Global, Threads, 2000000 ) / 1e6
+			 << "  ShardedCache: " << HitThroughput( *Sharded, (mutex*)NULL, Threads, 2000000 ) / 1e6 << " Mhits/s\n";
+	}
+	delete Plain;
+	delete Sharded;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	чтение без блокировок
+
+typedef StaticPageDevice<12,16,8,OptimisticCache>	OptimisticDevice;
+OptimisticDevice	OptimisticSPD;
+
+// читатели сверяют содержимое страниц, пока соседний поток гоняет вытеснение промахами
+bool	test12( void )
+{
+	unsigned p;
+	if( !ShardRemainder<OptimisticCache>() ) return false;
+	for( p = 0; p < 256; p++ )
+		memset( OptimisticSPD.GetData( p, true )->Data, (unsigned char)p, 1 << 12 );
+	if( !OptimisticSPD.Flush() ) return false;
+
+	atomic<bool> Stop( false ), Torn( false );
+	thread Scanner( [&Stop]
+	{
+		for( unsigned i = 0; !Stop; i++ ) OptimisticSPD.GetData( (i * 37) & 255, false );
+	} );
+
+	vector<thread> Readers;
+	for( unsigned t = 0; t < 2; t++ )
+	{
+		Readers.push_back( thread( [&Torn, t]
+		{
+			unsigned char Data[64];
+			unsigned Seed = t + 1;
+			for( unsigned i = 0; i < 200000; i++ )
+			{
+				Seed = Seed * 1664525 + 1013904223;
+				unsigned Index = (Seed >> 16) & 255;
+				if( !OptimisticSPD.Read( Index, (Seed >> 8) & 0xF80, Data, sizeof(Data) ) ) { Torn = true; return; }
+				for( unsigned b = 0; b < sizeof(Data); b++ )
+					if( Data[b] != (unsigned char)Index ) { Torn = true; return; }
+			}
+		} ) );
+	}
+	for( unsigned t = 0; t < 2; t++ ) Readers[t].join();
+
+	// Write() целиком переписывает страницы 0..15, читатели не должны увидеть смеси двух записей
+	atomic<bool> Written( false );
+	thread Writer( [&Written]
+	{
+		unsigned char Fill[1 << 12];
+		for( unsigned i = 0; !Written; i++ )
+		{
+			memset( Fill, (unsigned char)i, sizeof(Fill) );
+			OptimisticSPD.Write( i & 15, 0, Fill, sizeof(Fill) );
+		}
+	} );
+	Readers.clear();
+	for( unsigned t = 0; t < 2; t++ )
+	{
+		Readers.push_back( thread( [&Torn, t]
+		{
+			unsigned char Data[1 << 12];
+			for( unsigned i = 0; i < 20000; i++ )
+			{
+				if( !OptimisticSPD.Read( (i + t) & 15, 0, Data, sizeof(Data) ) ) { Torn = true; return; }
+				for( unsigned b = 1; b < sizeof(Data); b++ )
+					if( Data[b] != Data[0] ) { Torn = true; return; }
+			}
+		} ) );
+	}
+	for( unsigned t = 0; t < 2; t++ ) Readers[t].join();
+	Written = true;
+	Writer.join();
+	Stop = true;
+	Scanner.join();
+	return !Torn;
+}
+
+// попаданий на чтение в секунду у Readers потоков, пока Writers потоков пишут в те же шарды
+template< class _Device >
+double	ContendedHits( _Device& Dev, unsigned Readers, unsigned Writers, unsigned Ops )
+{
+	for( unsigned p = 0; p < 64; p++ ) Dev.GetData( p, false );
+
+	atomic<bool> Stop( false );
+	vector<thread> Threads;
+	for( unsigned w = 0; w < Writers; w++ )
+	{
+		Threads.push_back( thread( [&Dev, &Stop, w]
+		{
+			for( unsigned i = w; !Stop; i++ ) Dev.GetData( 32 + (i & 31), true )->Data[0]++;
+		} ) );
+	}
+
+	vector<thread> Workers;
+	chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+	for( unsigned t = 0; t < Readers; t++ )
+	{
+		Workers.push_back( thread( [&Dev, Ops, t]
+		{
+			unsigned Seed = t * 7919 + 1;
+			for( unsigned i = 0; i < Ops; i++ )
+			{
+				Seed = Seed * 1664525 + 1013904223;
+				Dev.GetData( (Seed >> 16) & 31, false );
+			}
+		} ) );
+	}
+	for( unsigned t = 0; t < Readers; t++ ) Workers[t].join();
+	chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+
+	Stop = true;
+	for( unsigned w = 0; w < Writers; w++ ) Threads[w].join();
+	return Readers * (double)Ops / Elapsed.count();
+}
+
+void	bench_optimistic( void )
+{
+	StaticPageDevice<12,64,8,ShardedCache>*		Sharded = new StaticPageDevice<12,64,8,ShardedCache>;
+	StaticPageDevice<12,64,8,OptimisticCache>*	Optimistic = new StaticPageDevice<12,64,8,OptimisticCache>;
+	unsigned Mix[][2] = { { 1, 0 }, { 2, 0 }, { 2, 1 }, { 4, 2 } };
+
+	for( int i = 0; i < 4; i++ )
+	{
+		cout << "readers " << Mix[i][0] << " writers " << Mix[i][1]
+			 << "  ShardedCache: " << ContendedHits( *Sharded, Mix[i][0], Mix[i][1], 2000000 ) / 1e6
+			 << "  OptimisticCache: " << ContendedHits( *Optimistic, Mix[i][0], Mix[i][1], 2000000 ) / 1e6 << " Mhits/s\n";
+	}
+	delete Sharded;
+	delete Optimistic;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	упреждающее чтение
+
+// устройство, считающее обращения к хранилищу за загрузкой
+class LoadLogDevice : public StaticPageDevice<12,16,8,Cache>
+{
+public:
+	unsigned	Calls;		// вызовов Load и LoadRange снаружи
+	unsigned	Pages;		// загружено страниц
+	unsigned	Ranges;		// из них серий длиннее одной страницы
+	bool		InRange;
+
+	LoadLogDevice(): Calls(0), Pages(0), Ranges(0), InRange(false) {}
+	void	Reset() { Calls = Pages = Ranges = 0; }
+protected:
+	virtual bool  Load( unsigned Index, Page<12>& Ref )
+	{
+		if( !InRange ) Calls++;
+		Pages++;
+		return StaticPageDevice<12,16,8,Cache>::Load( Index, Ref );
+	}
+	virtual bool  LoadRange( unsigned Index, unsigned Count, Page<12>** Refs )
+	{
+		Calls++;
+		if( Count > 1 ) Ranges++;
+		InRange = true;
+		bool Result = StaticPageDevice<12,16,8,Cache>::LoadRange( Index, Count, Refs );
+		InRange = false;
+		return Result;
+	}
+};
+
+LoadLogDevice	ReadAheadSPD;
+
+bool	test13( void )
+{
+	unsigned p;
+	// последовательный проход: окна склеивают загрузки
+	ReadAheadSPD.SetReadAhead( 4 );
+	if( !FillAndCheck( ReadAheadSPD, 256, 1 << 12 ) ) return false;
+	ReadAheadSPD.Reset();
+	for( p = 0; p < 256; p++ )
+		if( ReadAheadSPD.GetData( p, false )->Data[0] != (unsigned char)p ) return false;
+	if( ReadAheadSPD.Calls > ReadAheadSPD.Pages / 3 ) return false;
+
+	// проход с шагом: окно не открывается, лишних загрузок нет
+	ReadAheadSPD.Reset();
+	for( p = 0; p < 256; p++ )
+		if( ReadAheadSPD.GetData( (p * 167) & 255, false )->Data[0] != (unsigned char)((p * 167) & 255) ) return false;
+	return ReadAheadSPD.Ranges == 0 && ReadAheadSPD.Pages == ReadAheadSPD.Calls;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	статистика кэша (собирается при CACHE_STATS)
+
+StaticPageDevice<12,16,8,Cache>	StatsSPD;
+
+bool	test14( void )
+{
+#ifdef CACHE_STATS
+	unsigned p, w;
+	StatsSPD.SetReadAhead( 0 );
+	StatsSPD.ResetStatistics();
+	// 32 страницы при пуле в 16 страниц, в каждую 1024 записи - промах только первая
+	for( p = 0; p < 32; p++ )
+		for( w = 0; w < 1024; w++ )
+			StatsSPD.GetData( p, true )->Data[w * 4] = (unsigned char)w;
+	if( !StatsSPD.Flush() ) return false;
+
+	CacheStatistics Stats = StatsSPD.Statistics();
+	return Stats.Misses == 32 && Stats.Hits == 32 * 1023 && Stats.Evictions == 16
+		&& Stats.WriteBacks == 32 && Stats.BytesLoaded == (32 << 12) && Stats.BytesSaved == (32 << 12)
+		&& Stats.LoadFailures == 0 && Stats.SaveFailures == 0;
+#else
+	return true;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	сохранение только изменённых блоков страницы
+
+class ExtentLogDevice : public StaticPageDevice<16,4,4,Cache>
+{
+public:
+	unsigned	Saves;			// страниц сохранено целиком
+	vector< PageExtent >	Extents;	// участки, сохранённые через SaveExtents
+
+protected:
+	virtual bool  Save( unsigned Index, Page<16>& Ref )
+	{
+		Saves++;
+		return StaticPageDevice<16,4,4,Cache>::Save( Index, Ref );
+	}
+
+	virtual bool  SaveExtents( unsigned Index, Page<16>& Ref, const PageExtent* List, unsigned Count )
+	{
+		Extents.insert( Extents.end(), List, List + Count );
+		return StaticPageDevice<16,4,4,Cache>::SaveExtents( Index, Ref, List, Count );
+	}
+};
+
+ExtentLogDevice	ExtentSPD;
+
+bool	test15( void )
+{
+	unsigned p;
+	ExtentSPD.Saves = 0;
+	ExtentSPD.SetReadAhead( 0 );
+	ExtentSPD.ResetStatistics();
+
+	// по 4 байта в два блока страницы 1 и целиком страницы 2, 3
+	memcpy( ExtentSPD.GetDataForWrite( 1, 5000, 4 )->Data + 5000, "abcd", 4 );
+	memcpy( ExtentSPD.GetDataForWrite( 1, 65530, 4 )->Data + 65530, "efgh", 4 );
+	// запись мимо GetDataForWrite не помечает блок - в хранилище она не попадёт
+	ExtentSPD.GetData( 1, false )->Data[0] = 1;
+	ExtentSPD.GetData( 2, true )->Data[0] = 2;
+	ExtentSPD.GetData( 3, true )->Data[0] = 3;
+	if( !ExtentSPD.Flush() ) return false;
+
+	if( ExtentSPD.Saves != 2 || ExtentSPD.Extents.size() != 2 ) return false;
+	if( ExtentSPD.Extents[0].Offset != 4096 || ExtentSPD.Extents[0].Size != 4096 ) return false;
+	if( ExtentSPD.Extents[1].Offset != 61440 || ExtentSPD.Extents[1].Size != 4096 ) return false;
+#ifdef CACHE_STATS
+	if( ExtentSPD.Statistics().BytesSaved != 2 * 4096 + 2 * 65536 ) return false;
+#endif
+
+	// вытесняем страницы и читаем их из хранилища
+	for( p = 4; p < 8; p++ ) ExtentSPD.GetData( p, false );
+	Page<16>* Ptr = ExtentSPD.GetData( 1, false );
+	return memcmp( Ptr->Data + 5000, "abcd", 4 ) == 0 && memcmp( Ptr->Data + 65530, "efgh", 4 ) == 0
+		&& Ptr->Data[0] == 0 && ExtentSPD.GetData( 2, false )->Data[0] == 2;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	пул, меняющий размер во время работы
+
+typedef StaticPageDevice<12,16,8,ResizableCache>	ResizableDevice;
+ResizableDevice	ResizableSPD;
+
+bool	test16( void )
+{
+	unsigned p;
+	size_t Slot = ResizableDevice::SlotBytes();
+
+	// пул растёт по промахам только до ёмкости
+	if( !FillAndCheck( ResizableSPD, 256, 1 << 12 ) || ResizableSPD.Size() != 16 ) return false;
+	if( !ResizableSPD.Resize( 64 ) || !FillAndCheck( ResizableSPD, 256, 1 << 12 ) || ResizableSPD.Size() != 64 ) return false;
+
+	// нехватка памяти: грязные страницы сохраняются, данные не теряются
+	for( p = 0; p < 64; p++ ) ResizableSPD.GetData( p, true )->Data[1] = (unsigned char)(p + 1);
+	if( ResizableSPD.ReleaseMemory( 10 * Slot - 1 ) != 10 * Slot || ResizableSPD.Size() != 54 ) return false;
+	if( !ResizableSPD.SetBudget( 8 * Slot ) || ResizableSPD.Size() != 8 || ResizableSPD.MemoryUsage() != 8 * Slot ) return false;
+	for( p = 0; p < 64; p++ )
+		if( ResizableSPD.GetData( p, false )->Data[1] != (unsigned char)(p + 1) ) return false;
+
+	// больше бюджета пул не вырастет, закреплённые слоты не освобождаются
+	if( !ResizableSPD.Resize( 100 ) || ResizableSPD.GetCapacity() != 8 ) return false;
+	vector< PageHandle<ResizableDevice> > All;
+	for( p = 0; p < 6; p++ )
+		All.push_back( PageHandle<ResizableDevice>( ResizableSPD, p, false ) );
+	if( ResizableSPD.Resize( 4 ) || ResizableSPD.Size() != 6 || ResizableSPD.LastError() != CacheAllPinned ) return false;
+	All.clear();
+	return ResizableSPD.Resize( 4 ) && ResizableSPD.Size() == 4 && FillAndCheck( ResizableSPD, 256, 1 << 12 );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	выравнивание страниц пула
+
+bool	test17( void )
+{
+	unsigned p;
+	for( p = 0; p < 40; p++ )
+	{
+		if( (size_t)SPD.GetData( p, false ) % (1 << 16) != 0 ) return false;
+		if( (size_t)SmallSPD.GetData( p, false ) % (1 << 12) != 0 ) return false;
+	}
+
+	// буфер от 2 МБ выровнен на большую страницу
+	PageBuffer< Page<16> > Buffer( 32 );
+	if( (size_t)&Buffer[0] % PageBuffer< Page<16> >::HugePage != 0 ) return false;
+	memset( Buffer[31].Data, 0xFF, sizeof(Page<16>) );
+	return Buffer[31].Data[(1 << 16) - 1] == 0xFF;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	страницы прямо из памяти устройства, без пула
+
+class PassThroughDevice : public StaticPageDevice<12,16,8,PassThroughCache>
+{
+public:
+	unsigned	Copies;		// вызовы Load и Save
+
+	PassThroughDevice(): Copies(0) {}
+
+protected:
+	virtual bool  Load( unsigned Index, Page<12>& Ref )
+	{
+		Copies++;
+		return StaticPageDevice<12,16,8,PassThroughCache>::Load( Index, Ref );
+	}
+
+	virtual bool  Save( unsigned Index, Page<12>& Ref )
+	{
+		Copies++;
+		return StaticPageDevice<12,16,8,PassThroughCache>::Save( Index, Ref );
+	}
+};
+
+PassThroughDevice	PassThroughSPD;
+
+bool	test18( void )
+{
+	Page<12>* First = PassThroughSPD.GetData( 9, true );
+	if( !FillAndCheck( PassThroughSPD, 256, 1 << 12 ) || !PassThroughSPD.Flush() ) return false;
+	if( PassThroughSPD.GetData( 9, false ) != First || PassThroughSPD.GetData( 256, false ) != NULL ) return false;
+
+	PageHandle< PassThroughDevice > Pinned( PassThroughSPD, 3, false );
+	return Pinned && Pinned->Data[0] == 3 && PassThroughSPD.Copies == 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	сжатый второй уровень кэша
+
+// упреждающее чтение есть только у Cache
+template< template< class, unsigned, unsigned > class CachePolicy >
+void	ReadAheadOn( CountingPageDevice<CachePolicy>& )
+{
+}
+
+void	ReadAheadOn( CountingPageDevice<Cache>& Dev )
+{
+	Dev.SetReadAhead( 4 );
+}
+
+template< template< class, unsigned, unsigned > class CachePolicy >
+bool	TierCheck( void )
+{
+	unsigned p, b;
+	CountingPageDevice<CachePolicy>* Dev = new CountingPageDevice<CachePolicy>;
+	Dev->SetSecondTier( 1 << 20 );
+	ReadAheadOn( *Dev );
+
+	// полстраницы данных, полстраницы нулей - сжимается хорошо
+	for( p = 0; p < 64; p++ )
+	{
+		unsigned char* Data = Dev->GetData( p, true )->Data;
+		for( b = 0; b < 2048; b++ ) Data[b] = (unsigned char)(p * 7 + b / 16);
+	}
+	unsigned Loads = Dev->Loads;
+
+	// вытесненные страницы возвращаются распаковкой, устройство больше не читается
+	// (обратный порядок - чтобы не включалось упреждающее чтение)
+	bool Result = true;
+	for( p = 48; p-- > 0; )
+		if( Dev->GetData( p, false )->Data[100] != (unsigned char)(p * 7 + 100 / 16) ) Result = false;
+	TierStatistics Tier = Dev->SecondTierStatistics();
+	Result = Result && Dev->Loads == Loads && Tier.Hits == 48 && Tier.BytesCompressed * 4 < Tier.BytesIn;
+
+	// и ещё раз подряд, через упреждающее чтение у Cache
+	for( p = 0; p < 64; p++ )
+	{
+		unsigned char* Data = Dev->GetData( p, false )->Data;
+		for( b = 0; b < 4096; b++ )
+			if( Data[b] != (b < 2048 ? (unsigned char)(p * 7 + b / 16) : 0) ) Result = false;
+	}
+	delete Dev;
+	return Result;
+}
+
+bool	test19( void )
+{
+	unsigned i, Size;
+	unsigned char In[8192], Packed[9000], Out[8192];
+	unsigned Seed = 1;
+
+	// нули, повторяющийся текст, случайные байты, смесь
+	for( int Pattern = 0; Pattern < 4; Pattern++ )
+	{
+		for( i = 0; i < sizeof(In); i++ )
+		{
+			Seed = Seed * 1103515245 + 12345;
+			In[i] = Pattern == 0 ? 0 : Pattern == 1 ? "page cache "[i % 11]
+				: Pattern == 2 ? (unsigned char)(Seed >> 16) : (i & 512 ? (unsigned char)(Seed >> 16) : (unsigned char)i);
+		}
+		Size = LZCompress( In, sizeof(In), Packed, sizeof(Packed) );
+		if( Size == 0 || !LZDecompress( Packed, Size, Out, sizeof(Out) ) || memcmp( In, Out, sizeof(In) ) != 0 ) return false;
+		if( Pattern < 2 && Size > 200 ) return false;
+		// обрезанные данные распаковка должна отвергнуть
+		if( LZDecompress( Packed, Size - 1, Out, sizeof(Out) ) ) return false;
+	}
+	// несжимаемое в меньший буфер не влезает
+	if( LZCompress( In, sizeof(In), Packed, 4096 ) != 0 ) return false;
+
+	return TierCheck<Cache>() && TierCheck<LRUCache>() && TierCheck<TwoQCache>();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	контрольные суммы страниц
+
+// устройство, у которого можно испортить хранимую страницу в обход кэша
+template< template< class, unsigned, unsigned > class CachePolicy >
+class CorruptibleDevice : public ChecksummedDevice< StaticPageDevice<12,16,8,CachePolicy> >
+{
+public:
+	void	Corrupt( unsigned Index )
+	{
+		this->Direct( Index )->Data[5] ^= 1;
+	}
+};
+
+CorruptibleDevice<LRUCache>	CrcLRUSPD;
+CorruptibleDevice<Cache>	CrcSPD;
+
+// пакет и серия загрузок устройства напрямую, мимо кэша
+template< class _Device >
+class BatchProbe : public _Device
+{
+public:
+	void	Begin()
+	{
+		this->BeginBatch();
+	}
+
+	bool	End()
+	{
+		return this->EndBatch();
+	}
+
+	bool	Range( unsigned Index, unsigned Count, typename _Device::DataType** Refs )
+	{
+		return this->LoadRange( Index, Count, Refs );
+	}
+};
+
+BatchProbe< CorruptibleDevice<Cache> >	CrcBatchSPD, CrcOtherSPD;
+
+// устройство, запись которого можно заставить отказать
+class RefusingDevice : public StaticPageDevice<12,16,8,Cache>
+{
+public:
+	bool	Refuse;
+
+	RefusingDevice(): Refuse(false) {}
+
+protected:
+	virtual bool  Save( unsigned Index, Page<12>& Ref )
+	{
+		return !Refuse && StaticPageDevice<12,16,8,Cache>::Save( Index, Ref );
+	}
+};
+
+// Save и Load устройства напрямую, мимо кэша
+class RefusingCrcDevice : public ChecksummedDevice< RefusingDevice >
+{
+public:
+	bool	Store( unsigned Index, Page<12>& Ref )
+	{
+		return this->Save( Index, Ref );
+	}
+
+	bool	Fetch( unsigned Index, Page<12>& Ref )
+	{
+		return this->Load( Index, Ref );
+	}
+
+	void	Corrupt( unsigned Index )
+	{
+		this->Direct( Index )->Data[5] ^= 1;
+	}
+};
+
+RefusingCrcDevice	CrcRefusingSPD;
+
+bool	test20( void )
+{
+	unsigned i, p;
+	unsigned char Buffer[1000];
+
+	// контрольное значение CRC32C и совпадение аппаратного и табличного расчёта на любых выравниваниях
+	if( Crc32c( "123456789", 9 ) != 0xE3069283 || Crc32cSoftware( "123456789", 9 ) != 0xE3069283 ) return false;
+	for( i = 0; i < sizeof(Buffer); i++ ) Buffer[i] = (unsigned char)(i * 31 + 7);
+	for( i = 0; i < 64; i++ )
+		if( Crc32c( Buffer + i, sizeof(Buffer) - 2 * i ) != Crc32cSoftware( Buffer + i, sizeof(Buffer) - 2 * i ) ) return false;
+	if( Crc32c( Buffer + 100, 900, Crc32c( Buffer, 100 ) ) != Crc32c( Buffer, 1000 ) ) return false;
+
+	// порча сохранённой страницы обнаруживается при загрузке
+	if( !FillAndCheck( CrcLRUSPD, 256, 1 << 12 ) || CrcLRUSPD.ChecksumErrors() != 0 ) return false;
+	CrcLRUSPD.Corrupt( 100 );
+	if( CrcLRUSPD.GetData( 100, false ) != NULL || CrcLRUSPD.LastError() != CacheLoadFailed ) return false;
+	if( CrcLRUSPD.ChecksumErrors() != 1 ) return false;
+	CrcLRUSPD.SetVerify( false );
+	if( CrcLRUSPD.GetData( 100, false ) == NULL ) return false;
+
+	// и при упреждающем чтении: испорченная страница не загружается, соседние - да
+	CrcSPD.SetReadAhead( 4 );
+	if( !FillAndCheck( CrcSPD, 256, 1 << 12 ) ) return false;
+	CrcSPD.Corrupt( 140 );
+	for( p = 130; p < 160; p++ )
+	{
+		Page<12>* Ptr = CrcSPD.GetData( p, false );
+		if( p == 140 ? Ptr != NULL : Ptr == NULL || Ptr->Data[0] != (unsigned char)p ) return false;
+	}
+	if( CrcSPD.ChecksumErrors() < 1 ) return false;
+
+	// пакет одного устройства не откладывает проверку у другого того же типа в том же потоке
+	static Page<12> Probe;
+	Page<12>* ProbeRef = &Probe;
+	if( !FillAndCheck( CrcOtherSPD, 32, 1 << 12 ) || !CrcOtherSPD.Flush() ) return false;
+	CrcOtherSPD.Corrupt( 10 );
+	CrcBatchSPD.Begin();
+	if( CrcOtherSPD.Range( 10, 1, &ProbeRef ) || CrcOtherSPD.ChecksumErrors() != 1 ) return false;
+	if( !CrcBatchSPD.End() || CrcBatchSPD.ChecksumErrors() != 0 ) return false;
+
+	// неудачная запись не подменяет сумму: в хранилище прежняя версия, и она читается
+	static Page<12> In, Out;
+	memset( Out.Data, 1, sizeof(Out.Data) );
+	if( !CrcRefusingSPD.Store( 3, Out ) || !CrcRefusingSPD.Fetch( 3, In ) ) return false;
+	CrcRefusingSPD.Refuse = true;
+	memset( Out.Data, 2, sizeof(Out.Data) );
+	if( CrcRefusingSPD.Store( 3, Out ) ) return false;
+	if( !CrcRefusingSPD.Fetch( 3, In ) || In.Data[0] != 1 || CrcRefusingSPD.ChecksumErrors() != 0 ) return false;
+	// удачная - подменяет, и дальше проверяется только новая версия
+	CrcRefusingSPD.Refuse = false;
+	if( !CrcRefusingSPD.Store( 3, Out ) || !CrcRefusingSPD.Fetch( 3, In ) || In.Data[0] != 2 ) return false;
+	CrcRefusingSPD.Corrupt( 3 );
+	if( CrcRefusingSPD.Fetch( 3, In ) || CrcRefusingSPD.ChecksumErrors() != 1 ) return false;
+
+	// суммы переживают закрытие: порча файла, пока устройство закрыто, видна после переоткрытия
+	const char* Path = "ChecksummedDevice.test";
+	remove( Path );
+	remove( "ChecksummedDevice.test.crc" );
+	ChecksummedDevice< FilePageDevice<12,16,8,Cache> >* Dev = new ChecksummedDevice< FilePageDevice<12,16,8,Cache> >;
+	bool Result = Dev->Open( Path ) && FillAndCheck( *Dev, 256, 1 << 12 );
+	delete Dev;
+
+	FileIO::Handle File = FileIO::Open( Path, false );
+	unsigned char Byte = 0x5A;
+	Result = Result && File != FileIO::Invalid() && FileIO::WriteAt( File, &Byte, 1, (77 << 12) + 5 ) == 1;
+	if( File != FileIO::Invalid() ) FileIO::Close( File );
+
+	Dev = new ChecksummedDevice< FilePageDevice<12,16,8,Cache> >;
+	Result = Result && Dev->Open( Path, false );
+	Result = Result && Dev->GetData( 77, false ) == NULL && Dev->LastError() == CacheLoadFailed && Dev->ChecksumErrors() == 1;
+	Result = Result && Dev->GetData( 78, false ) != NULL && Dev->GetData( 78, false )->Data[5] == 78;
+	delete Dev;
+
+	// авария без Flush: вытесненные страницы записаны, устройство не закрыто и не удаляется;
+	// запись данных страницы 150 до файла не дошла - в нём прежняя версия
+	Dev = new ChecksummedDevice< FilePageDevice<12,16,8,Cache> >;
+	Result = Result && Dev->Open( Path, false );
+	for( p = 100; Result && p < 256; p++ ) memset( Dev->GetData( p, true )->Data, (unsigned char)(p + 1), 1 << 12 );
+	static unsigned char Old[1 << 12];
+	memset( Old, 150, sizeof(Old) );
+	File = FileIO::Open( Path, false );
+	Result = Result && File != FileIO::Invalid() && FileIO::WriteAt( File, Old, sizeof(Old), 150 << 12 ) == sizeof(Old);
+	if( File != FileIO::Invalid() ) FileIO::Close( File );
+
+	Dev = new ChecksummedDevice< FilePageDevice<12,16,8,Cache> >;
+	Result = Result && Dev->Open( Path, false );
+	for( p = 100; Result && p < 256; p++ )
+	{
+		Page<12>* Ptr = Dev->GetData( p, false );
+		if( !Ptr || (Ptr->Data[0] != (unsigned char)(p + 1) && Ptr->Data[0] != (unsigned char)p) ) Result = false;
+	}
+	Result = Result && Dev->GetData( 100, false )->Data[0] == 101 && Dev->GetData( 150, false )->Data[0] == 150
+		&& Dev->ChecksumErrors() == 0;
+	delete Dev;
+
+	// файл сумм удалённого файла страниц: без Create устройство не открывается и файлов не создаёт,
+	// новому пустому файлу страниц старые суммы не мешают
+	remove( Path );
+	Dev = new ChecksummedDevice< FilePageDevice<12,16,8,Cache> >;
+	Result = Result && !Dev->Open( Path, false ) && FileIO::Open( Path, false ) == FileIO::Invalid();
+	delete Dev;
+	Dev = new ChecksummedDevice< FilePageDevice<12,16,8,Cache> >;
+	Result = Result && Dev->Open( Path ) && Dev->GetData( 100, false ) != NULL && Dev->ChecksumErrors() == 0;
+	delete Dev;
+	remove( Path );
+	remove( "ChecksummedDevice.test.crc" );
+	Dev = new ChecksummedDevice< FilePageDevice<12,16,8,Cache> >;
+	Result = Result && !Dev->Open( Path, false ) && FileIO::Open( "ChecksummedDevice.test.crc", false ) == FileIO::Invalid();
+	delete Dev;
+	return Result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	серии страниц: GetDataRange и MemoryDevice
+
+LoadLogDevice	RangeLoadSPD;
+
+template< template< class, unsigned, unsigned > class CachePolicy >
+bool	MemoryRangeCheck( void )
+{
+	static MemoryDevice<20,12,16,CachePolicy,StaticPageDevice>	MD;
+	static unsigned char Out[5 * 4096], In[5 * 4096], Other[64 * 4096];
+	unsigned i;
+
+	// запись и чтение через границы страниц, с невыровненного адреса; записанное
+	// вытесняется и читается из хранилища - блоки помечены грязными
+	for( i = 0; i < sizeof(Out); i++ ) Out[i] = (unsigned char)(i * 7 + i / 4096);
+	if( !MD.Write( 4000, Out, sizeof(Out) ) || !MD.Flush() ) return false;
+	if( !MD.Read( 100 * 4096, Other, sizeof(Other) ) ) return false;
+	if( !MD.Read( 4000, In, sizeof(In) ) || memcmp( In, Out, sizeof(In) ) != 0 ) return false;
+#ifdef CACHE_STATS
+	// страницы уже в пуле: запись - одно попадание на страницу серии, без повторного поиска
+	MD.ResetStatistics();
+	if( !MD.Write( 4000, Out, sizeof(Out) ) || MD.Statistics().Hits != 6 || MD.Statistics().Misses != 0 ) return false;
+#endif
+	if( !MD.Read( 4096 * 3 + 5, In, 100 ) || memcmp( In, Out + 4096 * 3 + 5 - 4000, 100 ) != 0 ) return false;
+
+	// за концом памяти - отказ, а не обращение мимо
+	return !MD.Read( (1 << 20) - 100, In, 200 );
+}
+
+// устройство, у которого не читается страница 5; считает загрузки
+template< unsigned PageSize, unsigned PoolSize, unsigned SpaceSize, template< class, unsigned, unsigned > class CachePolicy >
+class FailingPageDevice : public StaticPageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>
+{
+public:
+	unsigned	Loads;
+
+	FailingPageDevice(): Loads(0) {}
+
+protected:
+	virtual bool  Load( unsigned Index, Page<PageSize>& Ref )
+	{
+		Loads++;
+		return Index != 5 && StaticPageDevice<PageSize, PoolSize, SpaceSize, CachePolicy>::Load( Index, Ref );
+	}
+};
+
+// отказ загрузки не повторяется сериями поменьше - он сразу уходит вызывающему
+template< template< class, unsigned, unsigned > class CachePolicy >
+bool	MemoryFailCheck( void )
+{
+	static MemoryDevice<20,12,16,CachePolicy,FailingPageDevice>	MD;
+	static unsigned char In[8 * 4096];
+	return !MD.Read( 0, In, sizeof(In) ) && MD.Device().LastError() == CacheLoadFailed && MD.Device().Loads == 6;
+}
+
+bool	test21( void )
+{
+	unsigned i;
+	if( !FillAndCheck( RangeLoadSPD, 256, 1 << 12 ) ) return false;
+	RangeLoadSPD.SetReadAhead( 0 );
+	for( i = 100; i < 104; i++ ) RangeLoadSPD.GetData( i, false );
+
+	// попадания в середине, по краям - две серии промахов, два обращения к хранилищу
+	RangeLoadSPD.Reset();
+	PageSpan< Page<12> > Span = RangeLoadSPD.GetDataRange( 98, 8, false );
+	if( Span.Size() != 8 || Span.GetIndex() != 98 ) return false;
+	if( RangeLoadSPD.Calls != 2 || RangeLoadSPD.Pages != 4 ) return false;
+	for( i = 0; i < 8; i++ )
+		if( Span[i]->Data[0] != (unsigned char)(98 + i) ) return false;
+
+	// серия закреплена: в остаток пула девять страниц не влезут
+	if( RangeLoadSPD.GetDataRange( 0, 9, false ) || RangeLoadSPD.LastError() != CacheAllPinned ) return false;
+	if( Span[7]->Data[0] != 105 ) return false;
+	RangeLoadSPD.UnpinRange( Span );
+	Span = RangeLoadSPD.GetDataRange( 0, 16, true );
+	if( !Span ) return false;
+	RangeLoadSPD.UnpinRange( Span );
+	if( RangeLoadSPD.GetDataRange( 250, 10, false ) || RangeLoadSPD.LastError() != CacheBadIndex ) return false;
+
+	return MemoryRangeCheck<Cache>() && MemoryRangeCheck<LRUCache>() && MemoryRangeCheck<ShardedCache>()
+		&& MemoryRangeCheck<PassThroughCache>()
+		&& MemoryFailCheck<Cache>() && MemoryFailCheck<LRUCache>() && MemoryFailCheck<ShardedCache>();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	страницы в файле
+
+typedef FilePageDevice<12,16,8,Cache>	FileDevice;
+
+bool	test22( void )
+{
+	const char* Path = "FilePageDevice.test";
+	unsigned p, b;
+	remove( Path );
+
+	// сохраняем две страницы из 256 - остальное остаётся дырами
+	FileDevice* Dev = new FileDevice;
+	if( !Dev->Open( Path ) ) return false;
+	memset( Dev->GetData( 3, true )->Data, 3, 1 << 12 );
+	memset( Dev->GetData( 200, true )->Data, 200, 1 << 12 );
+	delete Dev;
+
+	// после переоткрытия: сохранённое на месте, дыры и всё за концом файла - нули
+	Dev = new FileDevice;
+	bool Result = Dev->Open( Path, false ) && Dev->FileBytes() == 201 << 12 && Dev->AllocatedBytes() < Dev->FileBytes();
+	for( p = 0; Result && p < 256; p++ )
+	{
+		unsigned char* Data = Dev->GetData( p, false )->Data;
+		unsigned char Expected = p == 3 || p == 200 ? (unsigned char)p : 0;
+		for( b = 0; b < 1 << 12; b++ )
+			if( Data[b] != Expected ) Result = false;
+	}
+	Result = Result && FillAndCheck( *Dev, 256, 1 << 12 );
+	delete Dev;
+
+	// полное заполнение пережило закрытие, серии чтения идут одним preadv
+	static MemoryDevice<20,12,16,Cache,FilePageDevice>	MD;
+	static unsigned char Data[4096 * 4];
+	Result = Result && MD.Device().Open( Path, false ) && MD.Read( 254 << 12, Data, 2 << 12 )
+		&& Data[0] == 254 && Data[(2 << 12) - 1] == 255;
+	Result = Result && MD.Write( 4000, Data, sizeof(Data) ) && MD.Flush() && MD.Device().FileBytes() == 256 << 12;
+
+	FileDevice Missing;
+	Result = Result && !Missing.Open( "FilePageDevice.missing", false ) && Missing.SystemError() != 0;
+
+	remove( Path );
+	return Result;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////
 #define CHECK(name)									\
 	if( name() ) cout << #name << ": OK\n";			\
 	else { cout << #name << ": FAIL\n"; return; }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	скорость CRC32C на страницах 64 КБ
+
+void	bench_crc( void )
+{
+	PageBuffer< Page<16> > Data( 16 );
+	for( unsigned i = 0; i < 16; i++ ) memset( Data[i].Data, i * 17, sizeof(Page<16>) );
+
+	for( int Hardware = 1; Hardware >= 0; Hardware-- )
+	{
+		unsigned Sum = 0;
+		chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+		for( unsigned r = 0; r < 4096; r++ )
+			Sum ^= Hardware ? Crc32c( &Data[r & 15], sizeof(Page<16>) ) : Crc32cSoftware( &Data[r & 15], sizeof(Page<16>) );
+		chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+		cout << (Hardware ? "crc32c sse4.2: " : "crc32c slicing-by-8: ") << 4096.0 * sizeof(Page<16>) / Elapsed.count() / 1e9
+			 << " GB/s, " << Elapsed.count() / 4096 * 1e6 << " us/page (" << Sum << ")\n";
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	отображённый в память файл
+
+typedef MmapPageDevice<12,16,8,PassThroughCache>	MmapDevice;
+
+bool	test23( void )
+{
+	const char* Path = "MmapPageDevice.test";
+	unsigned p;
+	remove( Path );
+
+	// пустой файл растёт по мере обращений, выданные указатели при этом не переезжают
+	MmapDevice* Dev = new MmapDevice;
+	if( !Dev->Open( Path ) || Dev->MappedBytes() != 0 ) return false;
+	Dev->Advise( MmapRandom );
+	Page<12>* First = Dev->GetData( 3, true );
+	if( First == NULL || First->Data[0] != 0 ) return false;
+	memset( First->Data, 3, 1 << 12 );
+	unsigned long long Before = Dev->MappedBytes();
+	memset( Dev->GetData( 200, true )->Data, 200, 1 << 12 );
+	bool Result = Dev->MappedBytes() > Before && Dev->GetData( 3, false ) == First && First->Data[100] == 3;
+	Result = Result && Dev->WillNeed( 0, 256 ) && Dev->Flush();
+	delete Dev;
+
+	// тот же файл читается FilePageDevice: формат общий
+	FileDevice* Check = new FileDevice;
+	Result = Result && Check->Open( Path, false );
+	for( p = 0; Result && p < 256; p++ )
+		if( Check->GetData( p, false )->Data[4095] != (p == 3 || p == 200 ? (unsigned char)p : 0) ) Result = false;
+	delete Check;
+
+	// с пулом: Load/Save и частичные сохранения через отображение
+	MmapPageDevice<12,16,8,LRUCache>* Pooled = new MmapPageDevice<12,16,8,LRUCache>;
+	Result = Result && Pooled->Open( Path, false ) && Pooled->GetData( 200, false )->Data[0] == 200;
+	Result = Result && FillAndCheck( *Pooled, 256, 1 << 12 );
+	Pooled->GetDataForWrite( 7, 10, 1 )->Data[10] = 77;
+	Result = Result && Pooled->Flush();
+	delete Pooled;
+
+	static MemoryDevice<20,12,16,PassThroughCache,MmapPageDevice>	MD;
+	unsigned char Data[3];
+	Result = Result && MD.Device().Open( Path, false ) && MD.Read( (7 << 12) + 9, Data, 3 )
+		&& Data[0] == 7 && Data[1] == 77 && Data[2] == 7;
+	remove( Path );
+
+	// файл не кратен ни странице, ни шагу роста: открытие и чтение его длину не меняют,
+	// неполная последняя страница дочитывается нулями
+	static unsigned char Odd[5000];
+	memset( Odd, 9, sizeof(Odd) );
+	FileIO::Handle Raw = FileIO::Open( Path, true );
+	Result = Result && Raw != FileIO::Invalid() && FileIO::WriteAt( Raw, Odd, sizeof(Odd), 0 ) == sizeof(Odd);
+	if( Raw != FileIO::Invalid() ) FileIO::Close( Raw );
+
+	MmapPageDevice<12,16,8,LRUCache>* Reader = new MmapPageDevice<12,16,8,LRUCache>;
+	Result = Result && Reader->Open( Path, false ) && Reader->MappedBytes() == sizeof(Odd);
+	Page<12>* Tail = Result ? Reader->GetData( 1, false ) : NULL;
+	Result = Result && Tail && Tail->Data[903] == 9 && Tail->Data[904] == 0 && Reader->GetData( 2, false )->Data[0] == 0;
+	Result = Result && Reader->Flush() && Reader->MappedBytes() == sizeof(Odd);
+	delete Reader;
+
+	// без роста через Direct страница за концом файла не отдаётся
+	MmapDevice* Direct = new MmapDevice;
+	Direct->SetDirectGrowth( false );
+	Result = Result && Direct->Open( Path, false ) && Direct->GetData( 0, false ) && Direct->GetData( 0, false )->Data[4095] == 9;
+	Result = Result && Direct->GetData( 1, false ) == NULL && Direct->LastError() == CacheLoadFailed;
+	delete Direct;
+
+	FileDevice* Size = new FileDevice;
+	Result = Result && Size->Open( Path, false ) && Size->FileBytes() == sizeof(Odd);
+	delete Size;
+
+	// запись за конец файла его удлиняет
+	Reader = new MmapPageDevice<12,16,8,LRUCache>;
+	Result = Result && Reader->Open( Path, false );
+	if( Result ) Reader->GetDataForWrite( 1, 4000, 1 )->Data[4000] = 1;
+	Result = Result && Reader->Flush() && Reader->MappedBytes() >= 2 << 12;
+	delete Reader;
+	Size = new FileDevice;
+	Result = Result && Size->Open( Path, false ) && Size->FileBytes() >= 2 << 12;
+	Tail = Result ? Size->GetData( 1, false ) : NULL;
+	Result = Result && Tail && Tail->Data[903] == 9 && Tail->Data[904] == 0 && Tail->Data[4000] == 1;
+	delete Size;
+
+	remove( Path );
+	return Result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	асинхронные пакеты через io_uring
+
+// сверяет файл с ожидаемым: первые Bytes байт страницы p равны Fill( p )
+template< class _Fill >
+bool	FileMatches( const char* Path, unsigned Bytes, _Fill Fill )
+{
+	FileDevice* Check = new FileDevice;
+	bool Result = Check->Open( Path, false );
+	for( unsigned p = 0; Result && p < 256; p++ )
+	{
+		unsigned char* Data = Check->GetData( p, false )->Data;
+		for( unsigned b = 0; b < Bytes; b++ )
+			if( Data[b] != Fill( p ) ) Result = false;
+	}
+	delete Check;
+	return Result;
+}
+
+class CorruptibleFileDevice : public ChecksummedDevice< UringPageDevice<12,16,8,Cache> >
+{
+public:
+	// портит байт страницы в файле в обход кэша
+	bool	Corrupt( const char* Path, unsigned Index )
+	{
+		FileIO::Handle File = FileIO::Open( Path, false );
+		unsigned char Byte = 0x5A;
+		bool Result = FileIO::WriteAt( File, &Byte, 1, ((unsigned long long)Index << 12) + 5 ) == 1;
+		FileIO::Close( File );
+		return Result;
+	}
+};
+
+#ifdef CACHE_IO_URING
+// кольцо, у которого io_uring_enter номер FailAt отказывает с кодом Code
+class FlakyRing : public IoRing
+{
+public:
+	static unsigned	Calls, FailAt;
+	static int		Code;
+
+	bool	Submit( unsigned Wait )
+	{
+		if( ++Calls == FailAt )
+		{
+			errno = Code;
+			return false;
+		}
+		return IoRing::Submit( Wait );
+	}
+};
+
+unsigned FlakyRing::Calls = 0, FlakyRing::FailAt = 0;
+int FlakyRing::Code = 0;
+
+typedef UringPageDevice<12,256,8,Cache,FlakyRing> FlakyUringDevice;
+#endif
+
+// отказы io_uring_enter посреди пакета из 128 запросов при глубине кольца 64
+bool	SubmitFailCheck( const char* Path )
+{
+#ifdef CACHE_IO_URING
+	unsigned p;
+	remove( Path );
+	FlakyUringDevice* Dev = new FlakyUringDevice;
+	bool Result = Dev->Open( Path );
+	for( p = 0; Result && p < 256; p++ ) memset( Dev->GetData( p, true )->Data, (unsigned char)p, 1 << 12 );
+	Result = Result && Dev->Flush();
+	if( !Result || !Dev->Async() )
+	{
+		delete Dev;
+		return Result;
+	}
+
+	// EBUSY - разбираем готовое и повторяем, пакет проходит
+	for( p = 0; p < 256; p += 2 ) memset( Dev->GetData( p, true )->Data, (unsigned char)(p + 1), 1 << 12 );
+	FlakyRing::FailAt = FlakyRing::Calls + 1;
+	FlakyRing::Code = EBUSY;
+	Result = Dev->Flush();
+
+	// другой отказ на втором вызове: отданное дожидается, пакет проваливается, страницы
+	// остаются грязными, кольцо работает дальше
+	for( p = 0; Result && p < 256; p += 2 ) memset( Dev->GetData( p, true )->Data, (unsigned char)(p * 3), 1 << 12 );
+	FlakyRing::FailAt = FlakyRing::Calls + 2;
+	FlakyRing::Code = EINVAL;
+	Result = Result && !Dev->Flush() && Dev->SystemError() == EINVAL && Dev->Async();
+	Result = Result && Dev->Flush();
+	delete Dev;
+	return Result && FileMatches( Path, 1 << 12, []( unsigned p ){ return (unsigned char)(p & 1 ? p : p * 3); } );
+#else
+	return true;
+#endif
+}
+
+bool	test24( void )
+{
+	const char* Path = "UringPageDevice.test";
+	unsigned p;
+	remove( Path );
+
+	// сброс целиком грязных и частично изменённых страниц - пакетами
+	UringPageDevice<12,16,8,Cache>* Dev = new UringPageDevice<12,16,8,Cache>;
+	bool Result = Dev->Open( Path ) && FillAndCheck( *Dev, 256, 1 << 12 ) && Dev->Flush();
+	for( p = 0; Result && p < 256; p += 2 ) Dev->GetDataForWrite( p, 0, 1 )->Data[0] = (unsigned char)(p + 1);
+	Result = Result && Dev->Flush();
+	delete Dev;
+	Result = Result && FileMatches( Path, 1, []( unsigned p ){ return (unsigned char)(p & 1 ? p : p + 1); } );
+
+	// упреждающее чтение и GetDataRange с попаданиями посередине
+	Dev = new UringPageDevice<12,16,8,Cache>;
+	Dev->SetReadAhead( 4 );
+	Result = Result && Dev->Open( Path, false );
+	for( p = 0; Result && p < 256; p++ )
+		if( Dev->GetData( p, false )->Data[4095] != (unsigned char)p ) Result = false;
+	Dev->GetData( 20, false );
+	PageSpan< Page<12> > Span = Dev->GetDataRange( 16, 8, true );
+	for( p = 0; Result && p < 8; p++ )
+		if( !Span || Span[p]->Data[100] != (unsigned char)(16 + p) ) Result = false;
+	if( Span ) Dev->UnpinRange( Span );
+	delete Dev;
+
+	// поток сброса сохраняет пачки одним пакетом
+	UringPageDevice<12,16,8,WritebackCache>* Background = new UringPageDevice<12,16,8,WritebackCache>;
+	Result = Result && Background->Open( Path, false ) && Background->StartWriteback( 0.5, 0.25 );
+	for( p = 0; Result && p < 256; p++ ) memset( Background->GetData( p, true )->Data, (unsigned char)(p * 3), 1 << 12 );
+	Result = Result && Background->Flush();
+	delete Background;
+	Result = Result && FileMatches( Path, 1 << 12, []( unsigned p ){ return (unsigned char)(p * 3); } );
+
+	// проверка сумм откладывается до конца пакета упреждающего чтения
+	CorruptibleFileDevice* Checked = new CorruptibleFileDevice;
+	Checked->SetReadAhead( 4 );
+	Result = Result && Checked->Open( Path ) && FillAndCheck( *Checked, 256, 1 << 12 ) && Checked->Flush()
+		&& Checked->Corrupt( Path, 140 );
+	for( p = 130; Result && p < 160; p++ )
+	{
+		Page<12>* Ptr = Checked->GetData( p, false );
+		if( p == 140 ? Ptr != NULL : Ptr == NULL || Ptr->Data[0] != (unsigned char)p ) Result = false;
+	}
+	Result = Result && Checked->ChecksumErrors() >= 1;
+	delete Checked;
+
+	Result = Result && SubmitFailCheck( Path );
+
+	remove( Path );
+	remove( "UringPageDevice.test.crc" );
+	return Result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	файл мимо кэша ОС
+
+bool	test25( void )
+{
+	const char* Path = "DirectPageDevice.test";
+	unsigned p;
+	remove( Path );
+
+	// пул Cache выровнен - страницы читаются и пишутся прямо в него, частичные сохранения тоже
+	DirectPageDevice<12,16,8,Cache>* Dev = new DirectPageDevice<12,16,8,Cache>;
+	bool Result = Dev->Open( Path ) && Dev->IsDirect() && FillAndCheck( *Dev, 256, 1 << 12 ) && Dev->Flush();
+	for( p = 0; Result && p < 256; p += 3 ) Dev->GetDataForWrite( p, 0, 1 )->Data[0] = (unsigned char)(p + 1);
+	Result = Result && Dev->Flush() && Dev->BouncedPages() == 0;
+	delete Dev;
+	Result = Result && FileMatches( Path, 1, []( unsigned p ){ return (unsigned char)(p % 3 ? p : p + 1); } );
+
+	// пул LRUCache тоже выровнен
+	DirectPageDevice<12,16,8,LRUCache>* Listed = new DirectPageDevice<12,16,8,LRUCache>;
+	Result = Result && Listed->Open( Path, false );
+	for( p = 0; Result && p < 256; p++ )
+		if( Listed->GetData( p, false )->Data[4095] != (unsigned char)p ) Result = false;
+	for( p = 0; Result && p < 256; p++ ) memset( Listed->GetData( p, true )->Data, (unsigned char)(p * 3), 1 << 12 );
+	Result = Result && Listed->Flush() && Listed->BouncedPages() == 0;
+	delete Listed;
+	Result = Result && FileMatches( Path, 1 << 12, []( unsigned p ){ return (unsigned char)(p * 3); } );
+
+	// слоты ResizableCache выделяются по одному и не выровнены - через буфер устройства
+	DirectPageDevice<12,16,8,ResizableCache>* Slotted = new DirectPageDevice<12,16,8,ResizableCache>;
+	Result = Result && Slotted->Open( Path, false );
+	for( p = 0; Result && p < 256; p++ )
+		if( Slotted->GetData( p, false )->Data[4095] != (unsigned char)(p * 3) ) Result = false;
+	for( p = 0; Result && p < 256; p++ ) memset( Slotted->GetData( p, true )->Data, (unsigned char)(p * 5), 1 << 12 );
+	Result = Result && Slotted->Flush() && Slotted->BouncedPages() > 0;
+	delete Slotted;
+	Result = Result && FileMatches( Path, 1 << 12, []( unsigned p ){ return (unsigned char)(p * 5); } );
+
+	// пакеты io_uring без кэша ОС
+	UringPageDevice<12,16,8,Cache>* Async = new UringPageDevice<12,16,8,Cache>;
+	Result = Result && Async->Open( Path, false, true ) && Async->IsDirect();
+	for( p = 0; Result && p < 256; p++ )
+		if( Async->GetData( p, false )->Data[100] != (unsigned char)(p * 5) ) Result = false;
+	for( p = 0; Result && p < 256; p++ ) memset( Async->GetData( p, true )->Data, (unsigned char)(p * 7), 1 << 12 );
+	Result = Result && Async->Flush() && Async->BouncedPages() == 0;
+	delete Async;
+	Result = Result && FileMatches( Path, 1 << 12, []( unsigned p ){ return (unsigned char)(p * 7); } );
+
+	// страница меньше 4 КБ мимо кэша ОС не передаётся
+	FilePageDevice<10,4,8,Cache>* Small = new FilePageDevice<10,4,8,Cache>;
+	Result = Result && !Small->Open( Path, false, true ) && !Small->IsOpen() && Small->SystemError() != 0;
+	delete Small;
+
+	static MemoryDevice<20,12,16,Cache,DirectPageDevice>	MD;
+	unsigned char Data[3] = { 1, 2, 3 };
+	Result = Result && MD.Device().Open( Path, false ) && MD.Write( (9 << 12) - 1, Data, 3 ) && MD.Read( (9 << 12) - 2, Data, 3 )
+		&& Data[0] == (unsigned char)(8 * 7) && Data[1] == 1 && Data[2] == 2;
+
+	remove( Path );
+	return Result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	нулевые страницы
+
+class ZeroLogDevice : public StaticPageDevice<12,16,8,Cache>
+{
+public:
+	unsigned	Loads;		// страниц, дошедших до хранилища
+	unsigned	Saves;
+
+	ZeroLogDevice(): Loads(0), Saves(0) {}
+	void	Reset() { Loads = Saves = 0; }
+protected:
+	virtual bool  Load( unsigned Index, Page<12>& Ref )
+	{
+		Loads++;
+		return StaticPageDevice<12,16,8,Cache>::Load( Index, Ref );
+	}
+	virtual bool  Save( unsigned Index, Page<12>& Ref )
+	{
+		Saves++;
+		return StaticPageDevice<12,16,8,Cache>::Save( Index, Ref );
+	}
+	virtual bool  SaveExtents( unsigned Index, Page<12>& Ref, const PageExtent* Extents, unsigned Count )
+	{
+		Saves++;
+		return StaticPageDevice<12,16,8,Cache>::SaveExtents( Index, Ref, Extents, Count );
+	}
+};
+
+ZeroPageDevice< ZeroLogDevice >	ZeroSPD;
+BatchProbe< ZeroPageDevice< ZeroLogDevice > >	ZeroBatchSPD, ZeroOtherSPD;
+
+bool	test26( void )
+{
+	static unsigned char Buffer[8192];
+	const unsigned Marks[] = { 0, 7, 63, 64, 127, 128, 200, 4095, 8000, 8191 };
+	unsigned i, o, p;
+
+	// векторная проверка совпадает с побайтовой на любых выравниваниях и длинах
+	for( i = 0; i < sizeof(Marks) / sizeof(Marks[0]); i++ )
+	{
+		Buffer[Marks[i]] = 1;
+		for( o = 0; o < 64; o++ )
+			if( IsZero( Buffer + o, sizeof(Buffer) - o - i ) != IsZeroSoftware( Buffer + o, sizeof(Buffer) - o - i ) ) return false;
+		Buffer[Marks[i]] = 0;
+	}
+	if( !IsZero( Buffer, sizeof(Buffer) ) || !IsZero( Buffer + 3, 0 ) ) return false;
+
+	// чистое пространство читается из хранилища один раз, дальше - по карте
+	for( p = 0; p < 256; p++ )
+		if( ZeroSPD.GetData( p, false )->Data[4095] != 0 ) return false;
+	if( ZeroSPD.Loads != 256 || ZeroSPD.ZeroPages() != 256 ) return false;
+	ZeroSPD.Reset();
+	for( p = 0; p < 256; p++ ) ZeroSPD.GetData( p, false );
+	if( ZeroSPD.Loads != 0 || ZeroSPD.ElidedLoads() < 240 ) return false;
+
+	// записываются только ненулевые страницы
+	for( p = 0; p < 256; p++ )
+	{
+		Page<12>* Ptr = ZeroSPD.GetData( p, true );
+		if( p % 4 == 0 ) Ptr->Data[100] = (unsigned char)(p | 1);
+	}
+	if( !ZeroSPD.Flush() || ZeroSPD.Saves != 64 || ZeroSPD.ZeroPages() != 192 ) return false;
+
+	// обнулённая страница записывается один раз - поверх старых данных
+	memset( ZeroSPD.GetData( 4, true )->Data, 0, 1 << 12 );
+	if( !ZeroSPD.Flush() || ZeroSPD.Saves != 65 || !ZeroSPD.IsZeroPage( 4 ) ) return false;
+	ZeroSPD.GetDataForWrite( 4, 0, 1 );
+	if( !ZeroSPD.Flush() || ZeroSPD.Saves != 65 ) return false;
+	for( p = 0; p < 256; p++ )
+		if( ZeroSPD.GetData( p, false )->Data[100] != (p % 4 == 0 && p != 4 ? (unsigned char)(p | 1) : 0) ) return false;
+
+	// пакет одного устройства не задерживает отметки другого того же типа в том же потоке
+	static Page<12> Probe;
+	Page<12>* ProbeRef = &Probe;
+	ZeroBatchSPD.Begin();
+	if( !ZeroOtherSPD.Range( 7, 1, &ProbeRef ) || !ZeroOtherSPD.IsZeroPage( 7 ) ) return false;
+	if( !ZeroBatchSPD.End() || ZeroBatchSPD.IsZeroPage( 7 ) ) return false;
+
+	// в файле нулевые страницы остаются дырами
+	const char* Path = "ZeroPageDevice.test";
+	remove( Path );
+	ZeroPageDevice< FileDevice >* Dev = new ZeroPageDevice< FileDevice >;
+	bool Result = Dev->Open( Path );
+	for( p = 0; Result && p < 256; p++ ) memset( Dev->GetData( p, true )->Data, p % 16 ? 0 : (unsigned char)(p + 1), 1 << 12 );
+	Result = Result && Dev->Flush() && Dev->ElidedSaves() == 240 && Dev->AllocatedBytes() <= 32 << 12;
+	delete Dev;
+	Result = Result && FileMatches( Path, 1 << 12, []( unsigned p ){ return (unsigned char)(p % 16 ? 0 : p + 1); } );
+	remove( Path );
+	return Result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	память устройства по требованию
+
+bool	test27( void )
+{
+	// 4 ГБ пространства: память получают только записанные страницы
+	StaticPageDevice<12,16,20,Cache>* Dev = new StaticPageDevice<12,16,20,Cache>;
+	const unsigned Touched[] = { 0, 1000, 1 << 19, (1 << 20) - 1 };
+	unsigned i;
+	bool Result = Dev->StoredPages() == 0;
+	for( i = 0; i < 4; i++ ) memset( Dev->GetData( Touched[i], true )->Data, (unsigned char)(i + 1), 1 << 12 );
+	for( i = 0; i < 64; i++ ) Dev->GetData( 5000 + i, true );
+	Result = Result && Dev->Flush() && Dev->StoredPages() == 4;
+	for( i = 0; Result && i < 4; i++ )
+		if( Dev->GetData( Touched[i], false )->Data[4095] != (unsigned char)(i + 1) ) Result = false;
+	Result = Result && Dev->GetData( 777777, false )->Data[0] == 0;
+
+	// обнулённая сохранённая страница остаётся сохранённой и читается нулями
+	memset( Dev->GetData( 1000, true )->Data, 0, 1 << 12 );
+	Result = Result && Dev->Flush() && Dev->StoredPages() == 4;
+	for( i = 0; i < 64; i++ ) Dev->GetData( 2000 + i, false );
+	Result = Result && Dev->GetData( 1000, false )->Data[10] == 0;
+	delete Dev;
+
+	// разреженная память в 4 ГБ поверх него
+	static MemoryDevice<32,12,16,Cache,StaticPageDevice>	MD;
+	unsigned char Data[3] = { 7, 8, 9 };
+	return Result && MD.Write( 0xFFFFFFFFu - 2, Data, 3 ) && MD.Read( 0xFFFFFFFFu - 3, Data, 3 )
+		&& Data[0] == 0 && Data[1] == 7 && Data[2] == 8 && MD.Device().StoredPages() <= 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	дедупликация страниц
+
+DedupPageDevice<12,16,8,LRUCache>	DedupSPD;
+
+bool	test28( void )
+{
+	unsigned p;
+	// хэш детерминирован и различает соседние данные
+	unsigned char Buffer[256];
+	memset( Buffer, 1, sizeof(Buffer) );
+	Hash128 First = PageHash( Buffer, sizeof(Buffer) );
+	Buffer[200] = 2;
+	if( First == PageHash( Buffer, sizeof(Buffer) ) || PageHash( Buffer, sizeof(Buffer) ) != PageHash( Buffer, sizeof(Buffer) ) ) return false;
+	if( PageHash( Buffer, 255 ) == PageHash( Buffer, 256 ) || PageHash( Buffer, 256, 1 ) == PageHash( Buffer, 256 ) ) return false;
+
+	// 256 страниц из 8 шаблонов - 8 копий
+	for( p = 0; p < 256; p++ ) memset( DedupSPD.GetData( p, true )->Data, (unsigned char)(p % 8 + 1), 1 << 12 );
+	if( !DedupSPD.Flush() ) return false;
+	DedupStatistics Stats = DedupSPD.DedupStats();
+	if( Stats.Pages != 256 || Stats.Copies != 8 || Stats.Duplicates != 248 || DedupSPD.DedupRatio() != 32.0 ) return false;
+
+	// изменение разделённой страницы не трогает остальные, единственная ссылка переписывается на месте
+	DedupSPD.GetDataForWrite( 9, 0, 1 )->Data[0] = 77;
+	DedupSPD.GetDataForWrite( 9, 1, 1 )->Data[1] = 78;
+	memset( DedupSPD.GetData( 10, true )->Data, 0, 1 << 12 );
+	if( !DedupSPD.Flush() ) return false;
+	Stats = DedupSPD.DedupStats();
+	if( Stats.Pages != 255 || Stats.Copies != 9 || Stats.ZeroSaves != 1 ) return false;
+	for( p = 0; p < 256; p++ )
+	{
+		unsigned char* Data = DedupSPD.GetData( p, false )->Data;
+		unsigned char Fill = p == 10 ? 0 : (unsigned char)(p % 8 + 1);
+		if( Data[0] != (p == 9 ? 77 : Fill) || Data[1] != (p == 9 ? 78 : Fill) || Data[4095] != Fill ) return false;
+	}
+
+	// страница возвращается к общему содержимому - её копия освобождается
+	memset( DedupSPD.GetData( 9, true )->Data, 2, 2 );
+	if( !DedupSPD.Flush() ) return false;
+	Stats = DedupSPD.DedupStats();
+	return Stats.Copies == 8 && Stats.Pages == 255 && Stats.Collisions == 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	снимки копированием при записи
+
+typedef SnapshotPageDevice<12,16,8,LRUCache>	SnapDevice;
+SnapDevice	SnapSPD;
+
+bool	test29( void )
+{
+	unsigned p;
+	unsigned char Data[2];
+
+	// снимок не копирует данных
+	if( !FillAndCheck( SnapSPD, 256, 1 << 12 ) ) return false;
+	SnapDevice::SnapshotType First = SnapSPD.Snapshot();
+	if( !First || First->Pages() != 255 || SnapSPD.StorePages() != 255 ) return false;
+
+	// записи после снимка уходят в новые страницы
+	for( p = 1; p < 256; p += 16 ) SnapSPD.GetDataForWrite( p, 0, 1 )->Data[0] = 200;
+	SnapDevice::SnapshotType Second = SnapSPD.Snapshot();
+	if( !Second || SnapSPD.StorePages() != 255 + 16 ) return false;
+
+	// каждый снимок читается своей памятью
+	static MemoryDevice<20,12,16,LRUCache,SnapshotPageDevice>	Before, After;
+	if( !Before.Device().Open( First ) || !After.Device().Open( Second ) ) return false;
+	if( !Before.Read( 17 << 12, Data, 2 ) || Data[0] != 17 || Data[1] != 17 ) return false;
+	if( !After.Read( 17 << 12, Data, 2 ) || Data[0] != 200 || Data[1] != 17 ) return false;
+
+	// копия снимка пишет в свои страницы, не трогая ни снимков, ни устройства
+	Data[0] = Data[1] = 99;
+	if( !Before.Write( (18 << 12) + 5, Data, 2 ) || !Before.Flush() ) return false;
+	if( SnapSPD.GetData( 18, false )->Data[5] != 18 || !After.Read( (18 << 12) + 5, Data, 2 ) || Data[0] != 18 ) return false;
+	if( !Before.Read( (18 << 12) + 4, Data, 2 ) || Data[0] != 18 || Data[1] != 99 ) return false;
+
+	// Open поверх занятого пула: закреплённая страница не даёт сменить снимок,
+	// грязная - не попадает ни в новый снимок, ни в пул после Open
+	Data[0] = Data[1] = 98;
+	if( !Before.Write( 17 << 12, Data, 2 ) || !Before.Device().Pin( 19, false ) ) return false;
+	if( Before.Device().Open( Second ) || Before.Device().LastError() != CacheAllPinned ) return false;
+	Before.Device().Unpin( 19 );
+	if( !Before.Device().Open( Second ) ) return false;
+	if( !Before.Read( 17 << 12, Data, 2 ) || Data[0] != 200 || Data[1] != 17 ) return false;
+	if( !Before.Read( (18 << 12) + 5, Data, 2 ) || Data[0] != 18 || Data[1] != 18 ) return false;
+	if( !After.Read( 17 << 12, Data, 2 ) || Data[0] != 200 || Data[1] != 17 ) return false;
+
+	// страницы снимка без ссылок освобождаются
+	for( p = 3; p < 256; p += 16 ) SnapSPD.GetDataForWrite( p, 0, 1 )->Data[0] = 201;
+	SnapDevice::SnapshotType Temporary = SnapSPD.Snapshot();
+	size_t Pages = SnapSPD.StorePages();
+	for( p = 3; p < 256; p += 16 ) SnapSPD.GetDataForWrite( p, 0, 1 )->Data[0] = 202;
+	if( !SnapSPD.Flush() || SnapSPD.StorePages() != Pages + 16 ) return false;
+	Temporary.reset();
+	return SnapSPD.StorePages() == Pages && SnapSPD.GetData( 3, false )->Data[0] == 202;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	последовательное чтение файла: серии preadv против постраничного pread
+
+void	bench_file( void )
+{
+	typedef FilePageDevice<16,64,10,Cache>	BenchFileDevice;
+	const char* Path = "FilePageDevice.bench";
+	remove( Path );
+	BenchFileDevice* Dev = new BenchFileDevice;
+	Dev->Open( Path );
+	for( unsigned p = 0; p < 1024; p++ ) memset( Dev->GetData( p, true )->Data, p, sizeof(Page<16>) );
+	delete Dev;
+
+	for( int Window = 16; Window >= 0; Window -= 16 )
+	{
+		Dev = new BenchFileDevice;
+		Dev->Open( Path, false );
+		Dev->SetReadAhead( Window );
+		unsigned Sum = 0;
+		chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+		for( unsigned p = 0; p < 1024; p++ ) Sum += Dev->GetData( p, false )->Data[0];
+		chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+		cout << "file read, read-ahead " << Window << ": " << 1024.0 * sizeof(Page<16>) / Elapsed.count() / 1e9 << " GB/s (" << Sum << ")\n";
+		delete Dev;
+	}
+	remove( Path );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	сброс разрозненных грязных страниц: пакет io_uring против синхронных pwrite
+
+template< class _Device >
+double	ScatteredFlush( const char* Path )
+{
+	_Device* Dev = new _Device;
+	Dev->Open( Path );
+	for( unsigned p = 0; p < 1024; p += 2 ) memset( Dev->GetData( p, true )->Data, p, sizeof(Page<16>) );
+	chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+	Dev->Flush();
+	chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+	delete Dev;
+	return Elapsed.count();
+}
+
+void	bench_uring( void )
+{
+	const char* Path = "UringPageDevice.bench";
+	for( int Round = 0; Round < 3; Round++ )
+	{
+		remove( Path );
+		double Sync = ScatteredFlush< FilePageDevice<16,1024,10,Cache> >( Path );
+		remove( Path );
+		double Async = ScatteredFlush< UringPageDevice<16,1024,10,Cache> >( Path );
+		cout << "flush of 512 scattered 64 KB pages  pwrite: " << Sync * 1e3 << " ms  io_uring: " << Async * 1e3 << " ms\n";
+	}
+	remove( Path );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	нулевые страницы: проверка на нули и сброс разреженного пространства
+
+template< class _Device >
+void	SparseFlush( const char* Path, const char* Name )
+{
+	remove( Path );
+	_Device* Dev = new _Device;
+	Dev->Open( Path );
+	chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+	for( unsigned p = 0; p < 1024; p++ ) memset( Dev->GetData( p, true )->Data, p % 16 ? 0 : 1, sizeof(Page<16>) );
+	Dev->Flush();
+	chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+	cout << Name << ": " << Elapsed.count() * 1e3 << " ms, " << Dev->AllocatedBytes() / 1048576.0 << " MB on disk\n";
+	delete Dev;
+	remove( Path );
+}
+
+void	bench_zero( void )
+{
+	static Page<16> Data[16];
+	for( int Vector = 1; Vector >= 0; Vector-- )
+	{
+		unsigned Count = 0;
+		chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+		for( unsigned r = 0; r < 16384; r++ )
+			Count += Vector ? IsZero( &Data[r & 15], sizeof(Page<16>) ) : IsZeroSoftware( &Data[r & 15], sizeof(Page<16>) );
+		chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+		cout << (Vector ? "zero check simd: " : "zero check scalar: ") << 16384.0 * sizeof(Page<16>) / Elapsed.count() / 1e9
+			 << " GB/s (" << Count << ")\n";
+	}
+
+	SparseFlush< FilePageDevice<16,64,10,Cache> >( "ZeroPageDevice.bench", "1024 pages, 1/16 non-zero, all stored" );
+	SparseFlush< ZeroPageDevice< FilePageDevice<16,64,10,Cache> > >( "ZeroPageDevice.bench", "1024 pages, 1/16 non-zero, zero elided" );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	разреженное пространство в 1 ГБ: создание и разбросанные записи
+
+void	bench_static( void )
+{
+	typedef StaticPageDevice<16,16,14,Cache>	SparseDevice;
+	chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+	SparseDevice* Dev = new SparseDevice;
+	chrono::duration<double> Created = chrono::steady_clock::now() - Start;
+	for( unsigned p = 0; p < 16384; p += 256 ) memset( Dev->GetData( p, true )->Data, 1, sizeof(Page<16>) );
+	Dev->Flush();
+	chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+	cout << "1 GB space: created in " << Created.count() * 1e3 << " ms, 64 pages written in " << Elapsed.count() * 1e3
+		 << " ms, " << Dev->StoredPages() * sizeof(Page<16>) / 1048576.0 << " MB stored\n";
+	delete Dev;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	дедупликация: доля повторов и цена хэширования на сохранение
+
+template< class _Device >
+double	TemplateFlush( _Device& Dev, unsigned Templates )
+{
+	chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+	for( unsigned p = 0; p < 1024; p++ )
+	{
+		unsigned char* Data = Dev.GetData( p, true )->Data;
+		memset( Data, (unsigned char)(p % Templates + 1), sizeof(Page<16>) );
+	}
+	Dev.Flush();
+	chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+	return Elapsed.count();
+}
+
+void	bench_dedup( void )
+{
+	for( unsigned Templates = 256; Templates >= 4; Templates /= 8 )
+	{
+		StaticPageDevice<16,16,10,LRUCache>* Plain = new StaticPageDevice<16,16,10,LRUCache>;
+		DedupPageDevice<16,16,10,LRUCache>* Dedup = new DedupPageDevice<16,16,10,LRUCache>;
+		double PlainTime = TemplateFlush( *Plain, Templates );
+		double DedupTime = TemplateFlush( *Dedup, Templates );
+		DedupStatistics Stats = Dedup->DedupStats();
+		cout << "1024 pages of 64 KB, " << Templates << " distinct: ratio " << Dedup->DedupRatio() << ", "
+			 << Stats.Copies * sizeof(Page<16>) / 1048576.0 << " MB stored, hash " << (double)Stats.HashNanoseconds / Stats.Saves / 1e3
+			 << " us/save, total " << PlainTime * 1e3 << " ms plain vs " << DedupTime * 1e3 << " ms dedup\n";
+		delete Plain;
+		delete Dedup;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////
+//	снимок 64 МБ: заморозка карты против копирования данных
+
+void	bench_snapshot( void )
+{
+	typedef SnapshotPageDevice<12,64,14,Cache>	BenchSnapDevice;
+	BenchSnapDevice* Dev = new BenchSnapDevice;
+	for( unsigned p = 0; p < 16384; p++ ) memset( Dev->GetData( p, true )->Data, p | 1, sizeof(Page<12>) );
+	Dev->Flush();
+
+	chrono::steady_clock::time_point Start = chrono::steady_clock::now();
+	BenchSnapDevice::SnapshotType Image = Dev->Snapshot();
+	chrono::duration<double> Frozen = chrono::steady_clock::now() - Start;
+
+	vector< unsigned char > Copy( 16384 * sizeof(Page<12>) );
+	Start = chrono::steady_clock::now();
+	for( unsigned p = 0; p < 16384; p++ ) memcpy( &Copy[p * sizeof(Page<12>)], Dev->GetData( p, false )->Data, sizeof(Page<12>) );
+	chrono::duration<double> Copied = chrono::steady_clock::now() - Start;
+
+	cout << "snapshot of 64 MB: " << Frozen.count() * 1e3 << " ms, full copy: " << Copied.count() * 1e3 << " ms ("
+		 << Image->Pages() << " pages)\n";
+	Image.reset();
+	delete Dev;
+}
+
 void	main( void )
 {
 	//CHECK( test1 );
 	//CHECK( test2 );
 	//CHECK( test3 );
+	//CHECK( test4 );
+	//CHECK( test5 );
+	//CHECK( test6 );
+	//CHECK( test7 );
+	//CHECK( test8 );
+	//CHECK( test9 );
+	//CHECK( test10 );
+	//CHECK( test11 );
+	//CHECK( test12 );
+	//CHECK( test13 );
+	//CHECK( test14 );
+	//CHECK( test15 );
+	//CHECK( test16 );
+	//CHECK( test17 );
+	//CHECK( test18 );
+	//CHECK( test19 );
+	//CHECK( test20 );
+	//CHECK( test21 );
+	//CHECK( test22 );
+	//CHECK( test23 );
+	//CHECK( test24 );
+	//CHECK( test25 );
+	//CHECK( test26 );
+	//CHECK( test27 );
+	//CHECK( test28 );
+	//CHECK( test29 );
+	//bench_zipf();
+	//bench_scan();
+	//bench_writeback();
+	//bench_sharded();
+	//bench_optimistic();
+	//bench_crc();
+	//bench_file();
+	//bench_uring();
+	//bench_zero();
+	//bench_static();
+	//bench_dedup();
+	//bench_snapshot();
 	
 	//unsigned char* p1ptr;
 	//p1ptr = SPD.GetData( 1, true )->Data;